@@ -0,0 +1,98 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include "mesh.h"
+#include <vector>
+#include <memory>
+#include <cassert>
+#include <utility>
+
+using namespace std;
+
+/** frame-scoped bump allocator for temporary meshes
+ *
+ * allocate() hands out the next scratch Mesh; release() and reset() just move
+ * the bump index back. The meshes keep their triangle storage, so once the
+ * arena has seen the largest frame no more heap allocations are needed.
+ */
+class FrameArena final
+{
+    vector<unique_ptr<Mesh>> meshes;
+    size_t usedCount = 0;
+public:
+    FrameArena()
+    {
+    }
+    FrameArena(const FrameArena &) = delete;
+    void operator =(const FrameArena &) = delete;
+    Mesh &allocate(shared_ptr<Texture> image = nullptr)
+    {
+        if(usedCount >= meshes.size())
+            meshes.push_back(unique_ptr<Mesh>(new Mesh));
+        Mesh &retval = *meshes[usedCount++];
+        retval.clear();
+        retval.image = std::move(image);
+        return retval;
+    }
+    template <typename T>
+    Mesh &allocateCopy(T &&source)
+    {
+        Mesh &retval = allocate();
+        retval.assign(std::forward<T>(source));
+        return retval;
+    }
+    size_t mark() const
+    {
+        return usedCount;
+    }
+    void release(size_t markValue)
+    {
+        assert(markValue <= usedCount);
+        for(size_t i = markValue; i < usedCount; i++)
+        {
+            meshes[i]->image = nullptr; // don't keep textures alive
+        }
+        usedCount = markValue;
+    }
+    void reset()
+    {
+        release(0);
+    }
+    size_t size() const
+    {
+        return usedCount;
+    }
+};
+
+class FrameArenaScope final
+{
+    FrameArena &arena;
+    size_t markValue;
+public:
+    explicit FrameArenaScope(FrameArena &arena)
+        : arena(arena), markValue(arena.mark())
+    {
+    }
+    FrameArenaScope(const FrameArenaScope &) = delete;
+    void operator =(const FrameArenaScope &) = delete;
+    ~FrameArenaScope()
+    {
+        arena.release(markValue);
+    }
+};
+
+inline Mesh &transform(FrameArena &arena, Transform tform, const Mesh &mesh)
+{
+    Mesh &retval = arena.allocate();
+    retval.assign(mesh, tform);
+    return retval;
+}
+
+inline Mesh &colorize(FrameArena &arena, ColorF color, const Mesh &mesh)
+{
+    Mesh &retval = arena.allocate();
+    retval.assign(mesh, color);
+    return retval;
+}
+
+#endif // ARENA_H_INCLUDED
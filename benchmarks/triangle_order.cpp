@@ -0,0 +1,146 @@
+/* Measures how triangle order affects z-buffer cache behaviour.
+ *
+ * Rasterizes a shuffled torus in the order given by reorderTriangles() and
+ * feeds every z-buffer read through a simulated 32KiB 8-way L1 cache with
+ * 64 byte lines. Only headers are needed :
+ *
+ *     g++ -std=c++11 -O2 -I.. triangle_order.cpp -o triangle_order
+ */
+#include "generate.h"
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+class CacheSimulator final
+{
+    static constexpr size_t lineSize = 64, wayCount = 8, setCount = 32 * 1024 / lineSize / wayCount;
+    vector<uint64_t> tags;
+    vector<uint64_t> lastUse;
+    uint64_t time = 0;
+public:
+    uint64_t hits = 0, misses = 0;
+    CacheSimulator()
+        : tags(setCount * wayCount, ~(uint64_t)0), lastUse(setCount * wayCount, 0)
+    {
+    }
+    void access(uint64_t address)
+    {
+        uint64_t line = address / lineSize;
+        size_t set = line % setCount;
+        size_t oldestWay = 0;
+        time++;
+        for(size_t way = 0; way < wayCount; way++)
+        {
+            size_t index = set * wayCount + way;
+            if(tags[index] == line)
+            {
+                lastUse[index] = time;
+                hits++;
+                return;
+            }
+            if(lastUse[index] < lastUse[set * wayCount + oldestWay])
+                oldestWay = way;
+        }
+        misses++;
+        tags[set * wayCount + oldestWay] = line;
+        lastUse[set * wayCount + oldestWay] = time;
+    }
+};
+
+vector<Triangle> makeTorus(size_t uCount, size_t vCount, float r1, float r2)
+{
+    vector<Triangle> retval;
+    auto point = [&](size_t ui, size_t vi)
+    {
+        float u = 2 * M_PI * ui / uCount, v = 2 * M_PI * vi / vCount;
+        return VectorF((r1 + r2 * cos(v)) * cos(u), r2 * sin(v), (r1 + r2 * cos(v)) * sin(u));
+    };
+    for(size_t ui = 0; ui < uCount; ui++)
+    {
+        for(size_t vi = 0; vi < vCount; vi++)
+        {
+            VectorF p1 = point(ui, vi), p2 = point(ui + 1, vi), p3 = point(ui + 1, vi + 1), p4 = point(ui, vi + 1);
+            retval.push_back(Triangle(p1, p2, p3));
+            retval.push_back(Triangle(p1, p3, p4));
+        }
+    }
+    return retval;
+}
+
+/// rasterizes like SoftwareRenderer does but only records the z-buffer reads
+void simulateZBufferReads(const vector<Triangle> &triangles, Matrix tform, size_t w, size_t h, CacheSimulator &cache)
+{
+    for(const Triangle &triIn : triangles)
+    {
+        VectorF p[3] = {tform.apply(triIn.p1), tform.apply(triIn.p2), tform.apply(triIn.p3)};
+        float x[3], y[3];
+        bool visible = true;
+        for(int i = 0; i < 3; i++)
+        {
+            if(p[i].z >= -eps)
+                visible = false;
+            x[i] = (p[i].x / -p[i].z + 1) * 0.5f * w;
+            y[i] = (1 - p[i].y / -p[i].z) * 0.5f * h;
+        }
+        if(!visible)
+            continue;
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if(area <= 0)
+            continue;
+        int minX = max<int>(0, (int)floor(min(x[0], min(x[1], x[2]))));
+        int maxX = min<int>((int)w - 1, (int)ceil(max(x[0], max(x[1], x[2]))));
+        int minY = max<int>(0, (int)floor(min(y[0], min(y[1], y[2]))));
+        int maxY = min<int>((int)h - 1, (int)ceil(max(y[0], max(y[1], y[2]))));
+        for(int py = minY; py <= maxY; py++)
+        {
+            for(int px = minX; px <= maxX; px++)
+            {
+                bool inside = true;
+                for(int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3)
+                {
+                    if((x[j] - x[i]) * (py + 0.5f - y[i]) - (px + 0.5f - x[i]) * (y[j] - y[i]) < 0)
+                        inside = false;
+                }
+                if(inside)
+                    cache.access((uint64_t)(px + py * w) * sizeof(float));
+            }
+        }
+    }
+}
+}
+
+int main()
+{
+    const size_t w = 640, h = 480;
+    vector<Triangle> triangles = makeTorus(400, 200, 1, 0.4);
+    minstd_rand0 randomGenerator;
+    shuffle(triangles.begin(), triangles.end(), randomGenerator);
+    Matrix tform = Matrix::rotateX(0.7).concat(Matrix::translate(0, 0, -3));
+    struct
+    {
+        const char *name;
+        vector<Triangle> triangles;
+    } cases[] =
+    {
+        {"shuffled", triangles},
+        {"morton", reorderTriangles(triangles, TriangleOrder::Morton)},
+        {"hilbert", reorderTriangles(triangles, TriangleOrder::Hilbert)},
+        {"hilbert + normal groups", reorderTriangles(triangles, TriangleOrder::Hilbert, true)},
+    };
+    cout << triangles.size() << " triangles, " << w << "x" << h << endl;
+    for(auto &c : cases)
+    {
+        CacheSimulator cache;
+        simulateZBufferReads(c.triangles, tform, w, h, cache);
+        cout << setw(24) << left << c.name << " z-buffer hit rate " << fixed << setprecision(2)
+             << 100.0 * cache.hits / (cache.hits + cache.misses) << "% (" << cache.misses << " misses)" << endl;
+    }
+    return 0;
+}
@@ -2,193 +2,569 @@
 #define BSP_TREE_H_INCLUDED
 
 #include "triangle.h"
+#include "polygon.h"
+#include "thread_pool.h"
+#include "weld.h"
 #include <utility>
+#include <algorithm>
 #include <random>
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
 
 struct BSPNode final
 {
-    vector<Triangle> triangles;
+    enum : uint32_t {NoIndex = ~(uint32_t)0};
     VectorF normal;
     float d;
-    BSPNode *front;
-    BSPNode *back;
-    BSPNode(Triangle tri)
-        : triangles(1, tri), normal(tri.normal()), front(nullptr), back(nullptr)
-    {
-        d = -dot(normal, tri.p1);
-    }
-    BSPNode(Triangle tri, VectorF normal, float d)
-        : triangles(1, tri), normal(tri.empty() ? VectorF(0) : normal), d(d), front(nullptr), back(nullptr)
-    {
-    }
-    BSPNode(vector<Triangle> triangles, VectorF normal, float d)
-        : triangles(std::move(triangles)), normal(normal), d(d), front(nullptr), back(nullptr)
+    uint32_t front = NoIndex;
+    uint32_t back = NoIndex;
+    /// the node's polygons are linked through BSPTree::nextPolygon
+    uint32_t firstPolygon = NoIndex;
+    uint32_t lastPolygon = NoIndex;
+    uint32_t polygonCount = 0;
+    BSPNode(VectorF normal, float d)
+        : normal(normal), d(d)
     {
     }
     bool good() const
     {
         return normal != VectorF(0);
     }
-    void invert()
+};
+
+enum class DrawOrder
+{
+    BackToFront,
+    FrontToBack
+};
+
+struct BSPTreeLoadException : public runtime_error
+{
+    explicit BSPTreeLoadException(const string &msg)
+        : runtime_error(msg)
     {
-        for(Triangle &tri : triangles)
-        {
-            tri = reverse(tri);
-        }
-        normal = -normal;
-        d = -d;
-        if(front)
-            front->invert();
-        if(back)
-            back->invert();
-        auto temp = front;
-        front = back;
-        back = temp;
     }
 };
 
+/** BSP tree with all the nodes in one array and all the polygons in a PolygonList
+ *
+ * Nodes refer to each other and to their polygons by 32-bit index, so
+ * copying, inverting and transforming a tree are linear sweeps over the
+ * arrays. Polygons that are replaced by clipTo() are left behind in the
+ * polygon list until the next compact().
+ *
+ * Triangles are turned into convex polygons on the way in, and splitting a
+ * polygon gives one polygon on each side, so polygons are only triangulated
+ * again by getTriangles().
+ */
 class BSPTree final
 {
-    BSPNode *root = nullptr;
-    static void freeNode(BSPNode *node)
+    enum : uint32_t {NoIndex = BSPNode::NoIndex};
+    vector<BSPNode> nodes;
+    PolygonList polygons;
+    vector<uint32_t> nextPolygon;
+    uint32_t root = NoIndex;
+    size_t unusedPolygonCount = 0;
+    void appendPolygon(uint32_t node, const Vertex *vertices, size_t vertexCount)
+    {
+        uint32_t index = (uint32_t)polygons.size();
+        polygons.addPolygon(vertices, vertexCount);
+        if(polygons.size() == index)
+            return;
+        nextPolygon.push_back(NoIndex);
+        BSPNode &n = nodes[node];
+        if(n.lastPolygon == NoIndex)
+            n.firstPolygon = index;
+        else
+            nextPolygon[n.lastPolygon] = index;
+        n.lastPolygon = index;
+        n.polygonCount++;
+    }
+    void appendPolygons(uint32_t node, const PolygonList &source)
     {
-        if(node != nullptr)
-        {
-            freeNode(node->front);
-            freeNode(node->back);
-            delete node;
-        }
+        for(size_t i = 0; i < source.size(); i++)
+            appendPolygon(node, source.polygon(i), source.polygonVertexCount(i));
     }
-    static BSPNode *dupNode(const BSPNode *node)
+    void getNodeTriangles(vector<Triangle> &dest, uint32_t node) const
     {
-        if(node == nullptr)
-            return nullptr;
-        BSPNode *retval = new BSPNode(*node);
-        retval->front = dupNode(node->front);
-        retval->back = dupNode(node->back);
-        return retval;
+        for(uint32_t i = nodes[node].firstPolygon; i != NoIndex; i = nextPolygon[i])
+            triangulate(dest, polygons.polygon(i), polygons.polygonVertexCount(i));
     }
-    static void insertTriangle(BSPNode *&tree, Triangle tri)
+    void getNodePolygons(PolygonList &dest, uint32_t node) const
     {
-        if(tri.empty())
+        for(uint32_t i = nodes[node].firstPolygon; i != NoIndex; i = nextPolygon[i])
+            dest.addPolygon(polygons.polygon(i), polygons.polygonVertexCount(i));
+    }
+    void clearNodePolygons(uint32_t node)
+    {
+        BSPNode &n = nodes[node];
+        unusedPolygonCount += n.polygonCount;
+        n.firstPolygon = NoIndex;
+        n.lastPolygon = NoIndex;
+        n.polygonCount = 0;
+    }
+    struct TraversalEntry final
+    {
+        uint32_t node;
+        bool visit;
+    };
+    /** calls fn(node) for every node in the subtree, back side first where backFirst(node) is true
+     *
+     * The traversals here all use an explicit stack instead of recursion so
+     * that a badly unbalanced tree can't overflow the stack of the thread
+     * they run on.
+     */
+    template <typename BackFirstFn, typename Fn>
+    void forEachNode(uint32_t tree, vector<TraversalEntry> &stack, const BackFirstFn &backFirst, const Fn &fn) const
+    {
+        stack.clear();
+        stack.push_back(TraversalEntry{tree, false});
+        while(!stack.empty())
         {
-            return;
+            TraversalEntry entry = stack.back();
+            stack.pop_back();
+            if(entry.node == NoIndex)
+                continue;
+            if(entry.visit)
+            {
+                fn(entry.node);
+                continue;
+            }
+            const BSPNode &node = nodes[entry.node];
+            bool isBackFirst = backFirst(node);
+            stack.push_back(TraversalEntry{isBackFirst ? node.front : node.back, false});
+            stack.push_back(TraversalEntry{entry.node, true});
+            stack.push_back(TraversalEntry{isBackFirst ? node.back : node.front, false});
         }
-        if(tree == nullptr)
+    }
+    /** the polygons waiting to be pushed further down a tree
+     *
+     * pending holds one run of polygons per stack entry with the top entry's
+     * run at the end, so going down a level just replaces the last run with
+     * the runs for the node's children and no per-level lists are needed.
+     */
+    struct ClipStackEntry final
+    {
+        uint32_t node;
+        size_t start;
+    };
+    struct ClipScratch final
+    {
+        PolygonList pending, current, front, back;
+        vector<ClipStackEntry> stack;
+    };
+    /// appends the parts of the polygons in source that aren't behind the tree's surface to dest
+    void clipPolygons(const PolygonList &source, PolygonList &dest, ClipScratch &scratch) const
+    {
+        scratch.pending.clear();
+        scratch.pending.append(source);
+        scratch.stack.clear();
+        scratch.stack.push_back(ClipStackEntry{root, 0});
+        while(!scratch.stack.empty())
         {
-            tree = new BSPNode(tri);
-            return;
+            ClipStackEntry entry = scratch.stack.back();
+            scratch.stack.pop_back();
+            if(entry.node == NoIndex)
+            {
+                dest.append(scratch.pending, entry.start, scratch.pending.size());
+                scratch.pending.truncate(entry.start);
+                continue;
+            }
+            scratch.current.clear();
+            scratch.current.append(scratch.pending, entry.start, scratch.pending.size());
+            scratch.pending.truncate(entry.start);
+            const BSPNode &node = nodes[entry.node];
+            VectorF tn = node.normal;
+            float td = node.d;
+            scratch.front.clear();
+            scratch.back.clear();
+            for(size_t i = 0; i < scratch.current.size(); i++)
+            {
+                const Vertex *vertices = scratch.current.polygon(i);
+                size_t vertexCount = scratch.current.polygonVertexCount(i);
+                if(cutPolygon(vertices, vertexCount, tn, td, scratch.front, scratch.back))
+                {
+                    if(dot(polygonCross(vertices, vertexCount), tn) >= 0)
+                        scratch.front.addPolygon(vertices, vertexCount);
+                    else
+                        scratch.back.addPolygon(vertices, vertexCount);
+                }
+            }
+            // the back side's results go first, so its run goes on top
+            if(!scratch.front.empty())
+            {
+                scratch.stack.push_back(ClipStackEntry{node.front, scratch.pending.size()});
+                scratch.pending.append(scratch.front);
+            }
+            if(!scratch.back.empty() && node.back != NoIndex)
+            {
+                scratch.stack.push_back(ClipStackEntry{node.back, scratch.pending.size()});
+                scratch.pending.append(scratch.back);
+            }
         }
-        CutTriangle ct = cut(tri, tree->normal, tree->d);
-        for(size_t i = 0; i < ct.coplanarTriangleCount; i++)
+    }
+    /// below this many polygons splitting work across threads costs more than it saves
+    enum : size_t {ParallelGrainSize = 512};
+    /// the part of a node's polygons that one task clips
+    struct ClipWork final
+    {
+        BSPTree *tree;
+        const BSPTree *clipTree;
+        uint32_t node;
+        uint32_t firstPolygon;
+        size_t polygonCount;
+        PolygonList result;
+    };
+    void addClipWork(vector<ClipWork> &work, const BSPTree &clipTree)
+    {
+        for(uint32_t node = 0; node < nodes.size(); node++)
         {
-            tree->triangles.push_back(ct.coplanarTriangles[i]);
+            uint32_t polygon = nodes[node].firstPolygon;
+            size_t left = nodes[node].polygonCount;
+            while(left > 0)
+            {
+                ClipWork item;
+                item.tree = this;
+                item.clipTree = &clipTree;
+                item.node = node;
+                item.firstPolygon = polygon;
+                item.polygonCount = min<size_t>(left, ParallelGrainSize);
+                for(size_t i = 0; i < item.polygonCount; i++)
+                    polygon = nextPolygon[polygon];
+                left -= item.polygonCount;
+                work.push_back(std::move(item));
+            }
         }
-        for(size_t i = 0; i < ct.backTriangleCount; i++)
+    }
+    /** clips every item on the render threads then puts the results back in order
+     *
+     * clipPolygons() only looks at the clipping tree's planes, so items for
+     * different trees can run together as long as no tree's polygons are
+     * read while being replaced.
+     */
+    static void runClipWork(vector<ClipWork> &work)
+    {
+        ClipWork *items = work.data();
+        parallelFor(work.size(), 1, [items](size_t start, size_t end)
         {
-            insertTriangle(tree->back, ct.backTriangles[i]);
-        }
-        for(size_t i = 0; i < ct.frontTriangleCount; i++)
+            PolygonList source;
+            ClipScratch scratch;
+            for(size_t i = start; i < end; i++)
+            {
+                ClipWork &item = items[i];
+                const BSPTree &tree = *item.tree;
+                source.clear();
+                uint32_t polygon = item.firstPolygon;
+                for(size_t j = 0; j < item.polygonCount; j++)
+                {
+                    source.addPolygon(tree.polygons.polygon(polygon), tree.polygons.polygonVertexCount(polygon));
+                    polygon = tree.nextPolygon[polygon];
+                }
+                item.clipTree->clipPolygons(source, item.result, scratch);
+            }
+        });
+        for(size_t i = 0; i < work.size(); i++)
         {
-            insertTriangle(tree->front, ct.frontTriangles[i]);
+            ClipWork &item = work[i];
+            BSPTree &tree = *item.tree;
+            if(i == 0 || work[i - 1].tree != item.tree || work[i - 1].node != item.node)
+                tree.clearNodePolygons(item.node);
+            tree.appendPolygons(item.node, item.result);
+            item.result = PolygonList();
+            if(i + 1 == work.size() || work[i + 1].tree != item.tree)
+                tree.compact();
         }
     }
-    static void getTriangles(vector<Triangle> &triangles, const BSPNode *tree)
+    static float scoreSplitter(VectorF normal, float d, const PolygonList &polygons, size_t sampleStep)
     {
-        if(tree == nullptr)
-            return;
-        getTriangles(triangles, tree->front);
-        triangles.insert(triangles.end(), tree->triangles.begin(), tree->triangles.end());
-        getTriangles(triangles, tree->back);
+        size_t frontCount = 0, backCount = 0, splitCount = 0;
+        for(size_t i = 0; i < polygons.size(); i += sampleStep)
+        {
+            const Vertex *vertices = polygons.polygon(i);
+            size_t vertexCount = polygons.polygonVertexCount(i);
+            bool anyFront = false, anyBack = false;
+            for(size_t j = 0; j < vertexCount; j++)
+            {
+                float distance = dot(vertices[j].p, normal) + d;
+                if(distance > eps)
+                    anyFront = true;
+                else if(distance < -eps)
+                    anyBack = true;
+            }
+            if(anyFront && anyBack)
+                splitCount++;
+            else if(anyFront)
+                frontCount++;
+            else if(anyBack)
+                backCount++;
+        }
+        const float splitWeight = 16;
+        return splitWeight * splitCount + std::fabs((float)frontCount - (float)backCount);
+    }
+    /** makes a new node to hold polygons
+     *
+     * The node's plane is the best of a few randomly picked polygons'
+     * planes, scored on a sample of the input by how many polygons it would
+     * split and how unbalanced it would leave the two sides. The picked
+     * polygon is moved from polygons to the new node, so even a sliver
+     * whose own vertices don't test as coplanar can't stall the build.
+     * Returns NoIndex if all the polygons are empty.
+     */
+    uint32_t newSplitterNode(PolygonList &polygons)
+    {
+        polygons.removeIf(polygonEmpty);
+        if(polygons.empty())
+            return NoIndex;
+        const size_t candidateCount = min<size_t>(16, polygons.size());
+        const size_t sampleStep = max<size_t>(1, polygons.size() / 256);
+        default_random_engine rg(polygons.size());
+        uniform_int_distribution<size_t> pickCandidate(0, polygons.size() - 1);
+        VectorF bestNormal = VectorF(0);
+        float bestD = 0, bestScore = 0;
+        size_t bestIndex = 0;
+        for(size_t i = 0; i < candidateCount; i++)
+        {
+            size_t candidateIndex = pickCandidate(rg);
+            const Vertex *candidate = polygons.polygon(candidateIndex);
+            VectorF normal = normalizeNoThrow(polygonCross(candidate, polygons.polygonVertexCount(candidateIndex)));
+            float d = -dot(normal, candidate[0].p);
+            float score = scoreSplitter(normal, d, polygons, sampleStep);
+            if(i == 0 || score < bestScore)
+            {
+                bestNormal = normal;
+                bestD = d;
+                bestScore = score;
+                bestIndex = candidateIndex;
+            }
+        }
+        nodes.push_back(BSPNode(bestNormal, bestD));
+        uint32_t node = (uint32_t)(nodes.size() - 1);
+        appendPolygon(node, polygons.polygon(bestIndex), polygons.polygonVertexCount(bestIndex));
+        polygons.erase(bestIndex);
+        return node;
     }
-    static void getTriangles(vector<Triangle> &triangles, const BSPNode *tree, VectorF viewPoint)
+    struct PartitionedPolygons final
     {
-        if(tree == nullptr)
-            return;
-        if(dot(viewPoint, tree->normal) > -tree->d)
+        PolygonList coplanar, front, back;
+    };
+    static void partitionPolygons(PartitionedPolygons &dest, const PolygonList &polygons, size_t start, size_t end, VectorF normal, float d)
+    {
+        for(size_t i = start; i < end; i++)
         {
-            getTriangles(triangles, tree->back, viewPoint);
-            triangles.insert(triangles.end(), tree->triangles.begin(), tree->triangles.end());
-            getTriangles(triangles, tree->front, viewPoint);
+            const Vertex *vertices = polygons.polygon(i);
+            size_t vertexCount = polygons.polygonVertexCount(i);
+            if(polygonEmpty(vertices, vertexCount))
+                continue;
+            if(cutPolygon(vertices, vertexCount, normal, d, dest.front, dest.back))
+                dest.coplanar.addPolygon(vertices, vertexCount);
         }
-        else
+    }
+    enum Link : uint8_t
+    {
+        RootLink,
+        FrontLink,
+        BackLink
+    };
+    uint32_t getLink(uint32_t parent, Link link) const
+    {
+        switch(link)
         {
-            getTriangles(triangles, tree->front, viewPoint);
-            triangles.insert(triangles.end(), tree->triangles.begin(), tree->triangles.end());
-            getTriangles(triangles, tree->back, viewPoint);
+        case RootLink:
+            return root;
+        case FrontLink:
+            return nodes[parent].front;
+        case BackLink:
+            return nodes[parent].back;
         }
+        assert(false);
+        return NoIndex;
     }
-    static vector<Triangle> clipTriangles(vector<Triangle> triangles, const BSPNode *tree)
+    void setLink(uint32_t parent, Link link, uint32_t node)
     {
-        if(tree == nullptr)
-            return std::move(triangles);
-        vector<Triangle> front, back;
-        VectorF tn = tree->normal;
-        float td = tree->d;
-        for(Triangle tri : triangles)
+        switch(link)
         {
-            CutTriangle ct = cut(tri, tn, td);
-            for(size_t i = 0; i < ct.coplanarTriangleCount; i++)
+        case RootLink:
+            root = node;
+            return;
+        case FrontLink:
+            nodes[parent].front = node;
+            return;
+        case BackLink:
+            nodes[parent].back = node;
+            return;
+        }
+        assert(false);
+    }
+    struct BuildStackEntry final
+    {
+        uint32_t parent;
+        Link link;
+        size_t start;
+    };
+    /// works like ClipScratch, with parts holding the per-chunk results of partitioning current
+    struct BuildScratch final
+    {
+        PolygonList pending, current;
+        vector<PartitionedPolygons> parts;
+        size_t partCount = 0;
+        vector<BuildStackEntry> stack;
+    };
+    /// adds the coplanar parts of scratch.current to node and leaves the rest in scratch.parts
+    void partitionPolygons(uint32_t node, BuildScratch &scratch)
+    {
+        VectorF normal = nodes[node].normal;
+        float d = nodes[node].d;
+        size_t count = scratch.current.size();
+        scratch.partCount = (count + ParallelGrainSize - 1) / ParallelGrainSize;
+        if(scratch.parts.size() < scratch.partCount)
+            scratch.parts.resize(scratch.partCount);
+        for(size_t i = 0; i < scratch.partCount; i++)
+        {
+            scratch.parts[i].coplanar.clear();
+            scratch.parts[i].front.clear();
+            scratch.parts[i].back.clear();
+        }
+        PartitionedPolygons *partsData = scratch.parts.data();
+        const PolygonList *source = &scratch.current;
+        parallelFor(count, ParallelGrainSize, [partsData, source, normal, d](size_t start, size_t end)
+        {
+            partitionPolygons(partsData[start / ParallelGrainSize], *source, start, end, normal, d);
+        });
+        for(size_t i = 0; i < scratch.partCount; i++)
+            appendPolygons(node, scratch.parts[i].coplanar);
+    }
+    /** pushes the polygons in scratch.pending down the tree, building new subtrees where they reach empty leaves
+     *
+     * Front subtrees are finished before back subtrees, so the front side's
+     * run of pending polygons goes on top.
+     */
+    void insertPending(BuildScratch &scratch)
+    {
+        scratch.stack.clear();
+        scratch.stack.push_back(BuildStackEntry{NoIndex, RootLink, 0});
+        while(!scratch.stack.empty())
+        {
+            BuildStackEntry entry = scratch.stack.back();
+            scratch.stack.pop_back();
+            scratch.current.clear();
+            scratch.current.append(scratch.pending, entry.start, scratch.pending.size());
+            scratch.pending.truncate(entry.start);
+            uint32_t node = getLink(entry.parent, entry.link);
+            if(node == NoIndex)
             {
-                if(dot(ct.coplanarTriangles[i].point_cross(), tn) >= 0)
-                {
-                    front.push_back(ct.coplanarTriangles[i]);
-                }
-                else if(tree->back != nullptr)
-                {
-                    back.push_back(ct.coplanarTriangles[i]);
-                }
+                node = newSplitterNode(scratch.current);
+                if(node == NoIndex)
+                    continue;
+                setLink(entry.parent, entry.link, node);
             }
-            for(size_t i = 0; i < ct.frontTriangleCount; i++)
+            partitionPolygons(node, scratch);
+            size_t start = scratch.pending.size();
+            for(size_t i = 0; i < scratch.partCount; i++)
+                scratch.pending.append(scratch.parts[i].back);
+            if(scratch.pending.size() > start)
+                scratch.stack.push_back(BuildStackEntry{node, BackLink, start});
+            start = scratch.pending.size();
+            for(size_t i = 0; i < scratch.partCount; i++)
+                scratch.pending.append(scratch.parts[i].front);
+            if(scratch.pending.size() > start)
+                scratch.stack.push_back(BuildStackEntry{node, FrontLink, start});
+        }
+    }
+    /// the serialized format is little-endian no matter what machine it's written on
+    static constexpr const char *fileMagic()
+    {
+        return "lib3dBSP";
+    }
+    enum : uint32_t {FileVersion = 1};
+    struct HashSink final
+    {
+        uint64_t value = 14695981039346656037ULL;
+        void write(const uint8_t *bytes, size_t count)
+        {
+            for(size_t i = 0; i < count; i++)
             {
-                front.push_back(ct.frontTriangles[i]);
+                value ^= bytes[i];
+                value *= 1099511628211ULL;
             }
-            if(tree->back != nullptr)
+        }
+    };
+    struct StreamSink final
+    {
+        ostream &os;
+        explicit StreamSink(ostream &os)
+            : os(os)
+        {
+        }
+        void write(const uint8_t *bytes, size_t count)
+        {
+            os.write((const char *)bytes, count);
+        }
+    };
+    template <typename Sink>
+    static void writeUInt32(Sink &sink, uint32_t v)
+    {
+        uint8_t bytes[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+        sink.write(bytes, 4);
+    }
+    template <typename Sink>
+    static void writeFloat(Sink &sink, float v)
+    {
+        uint32_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        writeUInt32(sink, bits);
+    }
+    template <typename Sink>
+    void serialize(Sink &sink) const
+    {
+        sink.write((const uint8_t *)fileMagic(), 8);
+        writeUInt32(sink, FileVersion);
+        writeUInt32(sink, (uint32_t)nodes.size());
+        writeUInt32(sink, root);
+        for(const BSPNode &node : nodes)
+        {
+            writeFloat(sink, node.normal.x);
+            writeFloat(sink, node.normal.y);
+            writeFloat(sink, node.normal.z);
+            writeFloat(sink, node.d);
+            writeUInt32(sink, node.front);
+            writeUInt32(sink, node.back);
+            writeUInt32(sink, node.polygonCount);
+        }
+        for(const BSPNode &node : nodes)
+        {
+            for(uint32_t i = node.firstPolygon; i != NoIndex; i = nextPolygon[i])
             {
-                for(size_t i = 0; i < ct.backTriangleCount; i++)
+                const Vertex *vertices = polygons.polygon(i);
+                size_t vertexCount = polygons.polygonVertexCount(i);
+                writeUInt32(sink, (uint32_t)vertexCount);
+                for(size_t j = 0; j < vertexCount; j++)
                 {
-                    back.push_back(ct.backTriangles[i]);
+                    const Vertex &v = vertices[j];
+                    for(float f : {v.p.x, v.p.y, v.p.z, v.t.u, v.t.v, v.c.r, v.c.g, v.c.b, v.c.a, v.n.x, v.n.y, v.n.z})
+                        writeFloat(sink, f);
                 }
             }
         }
-        triangles = vector<Triangle>();
-        front = clipTriangles(std::move(front), tree->front);
-        if(tree->back != nullptr)
-            back = clipTriangles(std::move(back), tree->back);
-        else
-            back.clear();
-        front.insert(front.begin(), back.begin(), back.end());
-        return std::move(front);
-    }
-    static void clipTo(BSPNode *clipTree, const BSPNode *clipToTree)
-    {
-        if(clipTree == nullptr)
-            return;
-        clipTree->triangles = clipTriangles(std::move(clipTree->triangles), clipToTree);
-        clipTo(clipTree->front, clipToTree);
-        clipTo(clipTree->back, clipToTree);
     }
-    void merge(const BSPNode *tree)
+    static uint32_t readUInt32(istream &is)
     {
-        if(tree == nullptr)
-            return;
-        merge(tree->front);
-        insert(tree->triangles);
-        merge(tree->back);
+        uint8_t bytes[4];
+        if(!is.read((char *)bytes, 4))
+            throw BSPTreeLoadException("BSP tree file is truncated");
+        return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
     }
-    static void transform_helper(Transform tform, BSPNode *tree)
+    static float readFloat(istream &is)
     {
-        if(tree == nullptr)
-            return;
-        transform_helper(tform, tree->front);
-        transform_helper(tform, tree->back);
-        for(Triangle &tri : tree->triangles)
-        {
-            tri = transform(tform, tri);
-        }
-        VectorF p = transform(tform, tree->normal * -tree->d);
-        tree->normal = transformNormal(tform, tree->normal);
-        tree->d = -dot(tree->normal, p);
+        uint32_t bits = readUInt32(is);
+        float retval;
+        memcpy(&retval, &bits, sizeof(retval));
+        return retval;
     }
 public:
     BSPTree()
@@ -202,103 +578,322 @@ public:
     {
         insert(triangles);
     }
-    BSPTree(const BSPTree &rt)
-        : root(dupNode(rt.root))
+    /// welds the triangles first so splitting planes through nearly shared vertices don't cut the neighboring triangles
+    BSPTree(const vector<Triangle> &triangles, WeldTolerance tolerance)
     {
+        insert(weld(triangles, tolerance));
     }
+    BSPTree(const BSPTree &rt) = default;
     BSPTree(BSPTree &&rt)
-        : root(rt.root)
+        : nodes(std::move(rt.nodes)), polygons(std::move(rt.polygons)), nextPolygon(std::move(rt.nextPolygon)), root(rt.root), unusedPolygonCount(rt.unusedPolygonCount)
     {
-        rt.root = nullptr;
+        rt.clear();
     }
     void swap(BSPTree &rt)
     {
-        auto temp = root;
-        root = rt.root;
-        rt.root = temp;
-    }
-    const BSPTree &operator =(const BSPTree &rt)
-    {
-        if(rt.root == root)
-            return *this;
-        freeNode(root);
-        root = dupNode(rt.root);
-        return *this;
+        nodes.swap(rt.nodes);
+        std::swap(polygons, rt.polygons);
+        nextPolygon.swap(rt.nextPolygon);
+        std::swap(root, rt.root);
+        std::swap(unusedPolygonCount, rt.unusedPolygonCount);
     }
+    BSPTree &operator =(const BSPTree &rt) = default;
     const BSPTree &operator =(BSPTree &&rt)
     {
         swap(rt);
         return *this;
     }
-    ~BSPTree()
+    void clear()
     {
-        freeNode(root);
+        nodes.clear();
+        polygons.clear();
+        nextPolygon.clear();
+        root = NoIndex;
+        unusedPolygonCount = 0;
     }
-    void clear()
+    size_t nodeCount() const
     {
-        freeNode(root);
-        root = nullptr;
+        return nodes.size();
     }
-    void insert(Triangle tri)
+    size_t polygonCount() const
     {
-        insertTriangle(root, tri);
+        return polygons.size() - unusedPolygonCount;
     }
-    void insert(const vector<Triangle> &triangles)
+    /// the number of triangles getTriangles() returns
+    size_t triangleCount() const
     {
-        vector<size_t> order;
-        order.resize(triangles.size());
-        for(size_t i = 0; i < order.size(); i++)
-            order[i] = i;
-        default_random_engine rg;
-        uniform_int_distribution<size_t> d(0, order.size() - 1);
-        for(size_t &v : order)
+        size_t retval = 0;
+        for(const BSPNode &node : nodes)
         {
-            std::swap(v, order[d(rg)]);
+            for(uint32_t i = node.firstPolygon; i != NoIndex; i = nextPolygon[i])
+                retval += polygons.polygonVertexCount(i) - 2;
         }
-        for(size_t index : order)
+        return retval;
+    }
+    size_t depth() const
+    {
+        size_t retval = 0;
+        vector<pair<uint32_t, size_t>> stack;
+        stack.push_back(make_pair(root, (size_t)0));
+        while(!stack.empty())
         {
-            insert(triangles[index]);
+            pair<uint32_t, size_t> entry = stack.back();
+            stack.pop_back();
+            if(entry.first == NoIndex)
+                continue;
+            retval = max(retval, entry.second + 1);
+            stack.push_back(make_pair(nodes[entry.first].front, entry.second + 1));
+            stack.push_back(make_pair(nodes[entry.first].back, entry.second + 1));
         }
+        return retval;
+    }
+    /// moves every node's polygons next to each other and drops the ones clipTo() replaced
+    void compact()
+    {
+        PolygonList newPolygons;
+        vector<uint32_t> newNextPolygon;
+        newNextPolygon.reserve(polygonCount());
+        for(BSPNode &node : nodes)
+        {
+            uint32_t first = (uint32_t)newPolygons.size();
+            for(uint32_t i = node.firstPolygon; i != NoIndex; i = nextPolygon[i])
+            {
+                newPolygons.addPolygon(polygons.polygon(i), polygons.polygonVertexCount(i));
+                newNextPolygon.push_back((uint32_t)newPolygons.size());
+            }
+            if(node.polygonCount > 0)
+            {
+                newNextPolygon.back() = NoIndex;
+                node.firstPolygon = first;
+                node.lastPolygon = (uint32_t)newPolygons.size() - 1;
+            }
+        }
+        std::swap(polygons, newPolygons);
+        nextPolygon.swap(newNextPolygon);
+        unusedPolygonCount = 0;
+    }
+    void insert(Triangle tri)
+    {
+        BuildScratch scratch;
+        scratch.pending.addTriangle(tri);
+        insertPending(scratch);
+    }
+    void insert(const vector<Triangle> &triangles)
+    {
+        BuildScratch scratch;
+        for(const Triangle &tri : triangles)
+            scratch.pending.addTriangle(tri);
+        insertPending(scratch);
+    }
+    void insert(const PolygonList &source)
+    {
+        BuildScratch scratch;
+        scratch.pending.append(source);
+        insertPending(scratch);
     }
     vector<Triangle> getTriangles(vector<Triangle> buffer = vector<Triangle>()) const
     {
         buffer.clear();
-        getTriangles(buffer, root);
+        vector<TraversalEntry> stack;
+        forEachNode(root, stack, [](const BSPNode &)
+        {
+            return false;
+        }, [&](uint32_t node)
+        {
+            getNodeTriangles(buffer, node);
+        });
         return std::move(buffer);
     }
+    /// appends the triangles sorted by distance from viewPoint, which is what painter's algorithm needs
+    void getTriangles(vector<Triangle> &dest, VectorF viewPoint, DrawOrder order) const
+    {
+        bool frontToBack = (order == DrawOrder::FrontToBack);
+        vector<TraversalEntry> stack;
+        forEachNode(root, stack, [viewPoint, frontToBack](const BSPNode &node)
+        {
+            return (dot(viewPoint, node.normal) > -node.d) != frontToBack;
+        }, [&](uint32_t node)
+        {
+            getNodeTriangles(dest, node);
+        });
+    }
     vector<Triangle> getTriangles(VectorF viewPoint, vector<Triangle> buffer = vector<Triangle>()) const
     {
         buffer.clear();
-        getTriangles(buffer, root, viewPoint);
+        getTriangles(buffer, viewPoint, DrawOrder::BackToFront);
         return std::move(buffer);
     }
     void clipTo(const BSPTree &tree)
     {
-        clipTo(root, tree.root);
+        assert(&tree != this);
+        vector<ClipWork> work;
+        addClipWork(work, tree);
+        runClipWork(work);
+    }
+    /// same as a.clipTo(b); b.clipTo(a); but with both running at once
+    friend void clipToEachOther(BSPTree &a, BSPTree &b)
+    {
+        assert(&a != &b);
+        vector<ClipWork> work;
+        a.addClipWork(work, b);
+        b.addClipWork(work, a);
+        runClipWork(work);
     }
     void invert()
     {
-        if(root)
-            root->invert();
+        PolygonList *polygonList = &polygons;
+        parallelFor(polygons.size(), ParallelGrainSize, [polygonList](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+            {
+                Vertex *vertices = polygonList->polygon(i);
+                size_t vertexCount = polygonList->polygonVertexCount(i);
+                // keeps the first vertex first like reverse(Triangle)
+                std::reverse(vertices + 1, vertices + vertexCount);
+                for(size_t j = 0; j < vertexCount; j++)
+                    vertices[j].n = -vertices[j].n;
+            }
+        });
+        for(BSPNode &node : nodes)
+        {
+            node.normal = -node.normal;
+            node.d = -node.d;
+            std::swap(node.front, node.back);
+        }
     }
     void insert(const BSPTree &tree)
     {
-        merge(tree.root);
+        assert(&tree != this);
+        vector<TraversalEntry> stack;
+        BuildScratch scratch;
+        tree.forEachNode(tree.root, stack, [](const BSPNode &)
+        {
+            return false;
+        }, [&](uint32_t node)
+        {
+            scratch.pending.clear();
+            tree.getNodePolygons(scratch.pending, node);
+            insertPending(scratch);
+        });
     }
     void transform_helper(Transform tform)
     {
-        transform_helper(tform, root);
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        Vertex *vertices = polygons.vertexData();
+        parallelFor(polygons.vertexCount(), ParallelGrainSize, [vertices, &m, &normalTransform](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+            {
+                vertices[i].p = m.apply(vertices[i].p);
+                vertices[i].n = transformNormal(normalTransform, vertices[i].n);
+            }
+        });
+        for(BSPNode &node : nodes)
+        {
+            VectorF p = m.apply(node.normal * -node.d);
+            node.normal = transformNormal(normalTransform, node.normal);
+            node.d = -dot(node.normal, p);
+        }
     }
-    vector<Triangle> clipTriangles(vector<Triangle> triangles) const
+    /// hash of the serialized tree, for looking up results computed from it
+    uint64_t contentHash() const
+    {
+        HashSink sink;
+        serialize(sink);
+        return sink.value;
+    }
+    void write(ostream &os) const
+    {
+        StreamSink sink(os);
+        serialize(sink);
+    }
+    /// reads a tree written by write(), throwing BSPTreeLoadException if it's not valid
+    static BSPTree read(istream &is)
+    {
+        char magic[8];
+        if(!is.read(magic, sizeof(magic)) || memcmp(magic, fileMagic(), sizeof(magic)) != 0)
+            throw BSPTreeLoadException("not a BSP tree file");
+        if(readUInt32(is) != FileVersion)
+            throw BSPTreeLoadException("unsupported BSP tree file version");
+        BSPTree retval;
+        uint32_t nodeCount = readUInt32(is);
+        retval.root = readUInt32(is);
+        if(nodeCount == NoIndex || (retval.root == NoIndex) != (nodeCount == 0) || (retval.root != NoIndex && retval.root >= nodeCount))
+            throw BSPTreeLoadException("invalid BSP tree root");
+        vector<uint32_t> polygonCounts;
+        for(uint32_t i = 0; i < nodeCount; i++)
+        {
+            VectorF normal;
+            normal.x = readFloat(is);
+            normal.y = readFloat(is);
+            normal.z = readFloat(is);
+            float d = readFloat(is);
+            retval.nodes.push_back(BSPNode(normal, d));
+            retval.nodes.back().front = readUInt32(is);
+            retval.nodes.back().back = readUInt32(is);
+            polygonCounts.push_back(readUInt32(is));
+        }
+        // every node but the root has to have exactly one parent
+        vector<bool> hasParent(nodeCount, false);
+        for(const BSPNode &node : retval.nodes)
+        {
+            for(uint32_t child : {node.front, node.back})
+            {
+                if(child == NoIndex)
+                    continue;
+                if(child >= nodeCount || child == retval.root || hasParent[child])
+                    throw BSPTreeLoadException("invalid BSP tree node link");
+                hasParent[child] = true;
+            }
+        }
+        vector<Vertex> vertices;
+        for(uint32_t node = 0; node < nodeCount; node++)
+        {
+            for(uint32_t i = 0; i < polygonCounts[node]; i++)
+            {
+                uint32_t vertexCount = readUInt32(is);
+                if(vertexCount < 3 || vertexCount > 0x10000)
+                    throw BSPTreeLoadException("invalid BSP tree polygon");
+                vertices.clear();
+                for(uint32_t j = 0; j < vertexCount; j++)
+                {
+                    Vertex v;
+                    v.p.x = readFloat(is);
+                    v.p.y = readFloat(is);
+                    v.p.z = readFloat(is);
+                    v.t.u = readFloat(is);
+                    v.t.v = readFloat(is);
+                    v.c.r = readFloat(is);
+                    v.c.g = readFloat(is);
+                    v.c.b = readFloat(is);
+                    v.c.a = readFloat(is);
+                    v.n.x = readFloat(is);
+                    v.n.y = readFloat(is);
+                    v.n.z = readFloat(is);
+                    vertices.push_back(v);
+                }
+                retval.appendPolygon(node, vertices.data(), vertices.size());
+            }
+        }
+        return retval;
+    }
+    vector<Triangle> clipTriangles(const vector<Triangle> &triangles) const
     {
-        return clipTriangles(std::move(triangles), root);
+        PolygonList source, clipped;
+        for(const Triangle &tri : triangles)
+            source.addTriangle(tri);
+        ClipScratch scratch;
+        clipPolygons(source, clipped, scratch);
+        vector<Triangle> retval;
+        clipped.getTriangles(retval);
+        return retval;
     }
 };
 
 inline BSPTree csgUnion(BSPTree a, BSPTree b)
 {
-    a.clipTo(b);
-    b.clipTo(a);
+    clipToEachOther(a, b);
     b.invert();
     b.clipTo(a);
     b.invert();
@@ -311,8 +906,7 @@ inline BSPTree csgIntersection(BSPTree a, BSPTree b)
     a.invert();
     b.clipTo(a);
     b.invert();
-    a.clipTo(b);
-    b.clipTo(a);
+    clipToEachOther(a, b);
     a.insert(b);
     a.invert();
     return std::move(a);
@@ -321,8 +915,7 @@ inline BSPTree csgIntersection(BSPTree a, BSPTree b)
 inline BSPTree csgDifference(BSPTree a, BSPTree b)
 {
     a.invert();
-    a.clipTo(b);
-    b.clipTo(a);
+    clipToEachOther(a, b);
     b.invert();
     b.clipTo(a);
     b.invert();
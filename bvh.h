@@ -0,0 +1,745 @@
+#ifndef BVH_H_INCLUDED
+#define BVH_H_INCLUDED
+
+#include "mesh.h"
+#include "model.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+/// axis aligned bounding box; a default constructed box is empty
+struct BoundingBox
+{
+    VectorF minP, maxP;
+    BoundingBox()
+        : minP(numeric_limits<float>::infinity()), maxP(-numeric_limits<float>::infinity())
+    {
+    }
+    BoundingBox(VectorF minP, VectorF maxP)
+        : minP(minP), maxP(maxP)
+    {
+    }
+    explicit BoundingBox(const Triangle &tri)
+        : minP(tri.p1), maxP(tri.p1)
+    {
+        add(tri.p2);
+        add(tri.p3);
+    }
+    bool empty() const
+    {
+        return minP.x > maxP.x;
+    }
+    void add(VectorF p)
+    {
+        minP.x = min(minP.x, p.x);
+        minP.y = min(minP.y, p.y);
+        minP.z = min(minP.z, p.z);
+        maxP.x = max(maxP.x, p.x);
+        maxP.y = max(maxP.y, p.y);
+        maxP.z = max(maxP.z, p.z);
+    }
+    void add(const BoundingBox &box)
+    {
+        if(box.empty())
+            return;
+        add(box.minP);
+        add(box.maxP);
+    }
+    VectorF center() const
+    {
+        return 0.5f * (minP + maxP);
+    }
+    float surfaceArea() const
+    {
+        if(empty())
+            return 0;
+        VectorF size = maxP - minP;
+        return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+    bool overlaps(const BoundingBox &box) const
+    {
+        return minP.x <= box.maxP.x && box.minP.x <= maxP.x
+            && minP.y <= box.maxP.y && box.minP.y <= maxP.y
+            && minP.z <= box.maxP.z && box.minP.z <= maxP.z;
+    }
+};
+
+struct Ray
+{
+    VectorF origin, direction;
+    Ray(VectorF origin, VectorF direction)
+        : origin(origin), direction(direction)
+    {
+    }
+};
+
+/// the hit point is origin + t * direction and is (1 - u - v) * p1 + u * p2 + v * p3 of the triangle
+struct RayHit
+{
+    float t;
+    size_t triangle;
+    float u, v;
+};
+
+/** rays from one origin, stored a component at a time so the loops over them vectorize
+ *
+ * Each ray looks for the nearest hit in (tMin, tMax). A hit sets tMax to its
+ * distance and fills in triangle, u and v as in RayHit; rays with
+ * tMin >= tMax are skipped. If cullBackFaces is set only triangles whose
+ * vertices go counterclockwise as seen from the origin are hit, which are
+ * the ones the rasterizers draw.
+ */
+struct RayPacket
+{
+    static constexpr size_t Size = 16;
+    VectorF origin = VectorF(0);
+    bool cullBackFaces = false;
+    float directionX[Size], directionY[Size], directionZ[Size];
+    float tMin[Size], tMax[Size];
+    uint32_t triangle[Size];
+    float u[Size], v[Size];
+};
+
+/// the region a renderer can see, as planes that visible points are on the front side of
+struct Frustum
+{
+    VectorF normals[5];
+    float d[5];
+    /** the view of a renderer with the given scaleX() and scaleY()
+     *
+     * tform takes the space the queries are in to camera space.
+     */
+    Frustum(float scaleX, float scaleY, Transform tform)
+    {
+        const VectorF cameraNormals[5] =
+        {
+            VectorF(1, 0, -scaleX),
+            VectorF(-1, 0, -scaleX),
+            VectorF(0, 1, -scaleY),
+            VectorF(0, -1, -scaleY),
+            VectorF(0, 0, -1),
+        };
+        // a plane's distance is affine in the untransformed point, so read it off at the origin and the unit vectors
+        VectorF origin = transform(tform, VectorF(0));
+        VectorF xAxis = transform(tform, VectorF(1, 0, 0)) - origin;
+        VectorF yAxis = transform(tform, VectorF(0, 1, 0)) - origin;
+        VectorF zAxis = transform(tform, VectorF(0, 0, 1)) - origin;
+        for(size_t i = 0; i < 5; i++)
+        {
+            normals[i] = VectorF(dot(cameraNormals[i], xAxis), dot(cameraNormals[i], yAxis), dot(cameraNormals[i], zAxis));
+            d[i] = dot(cameraNormals[i], origin);
+        }
+    }
+    Frustum(const Renderer &renderer, Transform tform)
+        : Frustum(renderer.scaleX(), renderer.scaleY(), tform)
+    {
+    }
+    bool contains(VectorF p) const
+    {
+        for(size_t i = 0; i < 5; i++)
+            if(dot(normals[i], p) + d[i] < 0)
+                return false;
+        return true;
+    }
+};
+
+/** bounding volume hierarchy over a copy of a mesh's triangles
+ *
+ * Built with binned surface area heuristic splits, with big subtrees built
+ * in parallel. The triangles are reordered so every node covers a contiguous
+ * range of triangles(); originalIndex() maps back to the order they were
+ * given in. Queries report indices into triangles(). After the source
+ * triangles move, refit() updates the boxes without rebuilding the tree.
+ */
+class BVH final
+{
+    struct Node
+    {
+        BoundingBox box;
+        uint32_t firstTriangle, triangleCount;
+        /// 0 for leaves, else the children are firstChild and firstChild + 1
+        uint32_t firstChild;
+    };
+    vector<Node> nodes;
+    vector<Triangle> triangleList;
+    vector<uint32_t> originalIndices;
+    static constexpr size_t BinCount = 16;
+    static constexpr size_t MaxLeafSize = 4;
+    static constexpr float TraversalCost = 1;
+    /// queries use a fixed size stack, so deeper nodes are left as leaves
+    static constexpr size_t MaxDepth = 60;
+    static constexpr size_t StackSize = MaxDepth + 4;
+    static constexpr size_t ParallelSubtreeSize = 4096;
+    static float axisValue(VectorF v, size_t axis)
+    {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+    struct BuildRange
+    {
+        uint32_t node, first, last, depth;
+    };
+    /// kept in the order the tree is being built in so the build reads memory sequentially
+    struct BuildPrimitive
+    {
+        BoundingBox box;
+        VectorF centroid;
+        uint32_t index;
+    };
+    struct Bin
+    {
+        BoundingBox box;
+        size_t count = 0;
+    };
+    static size_t binIndex(float centroid, float low, float scale, size_t binCount)
+    {
+        return min<size_t>((size_t)((centroid - low) * scale), binCount - 1);
+    }
+    /// partitions primitives [first, last) and returns the split point, or first to make a leaf
+    static uint32_t split(vector<BuildPrimitive> &primitives, uint32_t first, uint32_t last, const BoundingBox &box, const BoundingBox &centroidBox)
+    {
+        size_t count = last - first;
+        if(count <= 1)
+            return first;
+        // small nodes don't need as many bins to find a good split
+        size_t binCount = min<size_t>(BinCount, max<size_t>(4, count / 2));
+        float low[3], scale[3];
+        for(size_t axis = 0; axis < 3; axis++)
+        {
+            low[axis] = axisValue(centroidBox.minP, axis);
+            float size = axisValue(centroidBox.maxP, axis) - low[axis];
+            scale[axis] = size > 0 ? binCount / size : 0;
+        }
+        // bin along all three axes in one pass
+        Bin bins[3][BinCount];
+        for(uint32_t i = first; i < last; i++)
+        {
+            const BuildPrimitive &primitive = primitives[i];
+            Bin &binX = bins[0][binIndex(primitive.centroid.x, low[0], scale[0], binCount)];
+            Bin &binY = bins[1][binIndex(primitive.centroid.y, low[1], scale[1], binCount)];
+            Bin &binZ = bins[2][binIndex(primitive.centroid.z, low[2], scale[2], binCount)];
+            binX.count++;
+            binX.box.add(primitive.box);
+            binY.count++;
+            binY.box.add(primitive.box);
+            binZ.count++;
+            binZ.box.add(primitive.box);
+        }
+        float bestCost = numeric_limits<float>::infinity();
+        size_t bestAxis = 3, bestBin = 0;
+        for(size_t axis = 0; axis < 3; axis++)
+        {
+            if(scale[axis] == 0)
+                continue;
+            float rightCost[BinCount];
+            BoundingBox rightBox;
+            size_t rightCount = 0;
+            for(size_t bin = binCount - 1; bin > 0; bin--)
+            {
+                rightBox.add(bins[axis][bin].box);
+                rightCount += bins[axis][bin].count;
+                rightCost[bin] = rightBox.surfaceArea() * rightCount;
+            }
+            BoundingBox leftBox;
+            size_t leftCount = 0;
+            for(size_t bin = 0; bin < binCount - 1; bin++)
+            {
+                leftBox.add(bins[axis][bin].box);
+                leftCount += bins[axis][bin].count;
+                if(leftCount == 0 || leftCount == count)
+                    continue;
+                float cost = leftBox.surfaceArea() * leftCount + rightCost[bin + 1];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+        if(bestAxis == 3)
+        {
+            // every centroid is in the same place
+            if(count <= MaxLeafSize)
+                return first;
+            return first + (uint32_t)(count / 2);
+        }
+        float area = box.surfaceArea();
+        if(count <= MaxLeafSize && TraversalCost * area + bestCost >= count * area)
+            return first;
+        float splitLow = low[bestAxis], splitScale = scale[bestAxis];
+        auto middle = std::partition(primitives.begin() + first, primitives.begin() + last, [=](const BuildPrimitive &primitive)
+        {
+            return binIndex(axisValue(primitive.centroid, bestAxis), splitLow, splitScale, binCount) <= bestBin;
+        });
+        return (uint32_t)(middle - primitives.begin());
+    }
+    /// builds the subtree for root into nodes, putting subtrees small enough to build on their own into deferred if it's not null
+    static void buildNodes(vector<Node> &nodes, vector<BuildPrimitive> &primitives, BuildRange root, vector<BuildRange> *deferred)
+    {
+        vector<BuildRange> stack;
+        stack.push_back(root);
+        while(!stack.empty())
+        {
+            BuildRange range = stack.back();
+            stack.pop_back();
+            if(deferred != nullptr && range.last - range.first <= ParallelSubtreeSize)
+            {
+                deferred->push_back(range);
+                continue;
+            }
+            BoundingBox box, centroidBox;
+            for(uint32_t i = range.first; i < range.last; i++)
+            {
+                box.add(primitives[i].box);
+                centroidBox.add(primitives[i].centroid);
+            }
+            Node &node = nodes[range.node];
+            node.box = box;
+            node.firstTriangle = range.first;
+            node.triangleCount = range.last - range.first;
+            node.firstChild = 0;
+            if(range.depth >= MaxDepth)
+                continue;
+            uint32_t middle = split(primitives, range.first, range.last, box, centroidBox);
+            if(middle == range.first)
+                continue;
+            uint32_t firstChild = (uint32_t)nodes.size();
+            node.firstChild = firstChild;
+            nodes.resize(nodes.size() + 2);
+            stack.push_back(BuildRange{firstChild + 1, middle, range.last, range.depth + 1});
+            stack.push_back(BuildRange{firstChild, range.first, middle, range.depth + 1});
+        }
+    }
+    void build(const vector<Triangle> &source)
+    {
+        assert(source.size() <= 0xFFFFFFFFU);
+        nodes.clear();
+        triangleList.clear();
+        originalIndices.clear();
+        if(source.empty())
+            return;
+        vector<BuildPrimitive> primitives(source.size());
+        parallelFor(source.size(), parallelMeshGrainSize, [&](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+            {
+                primitives[i].box = BoundingBox(source[i]);
+                primitives[i].centroid = primitives[i].box.center();
+                primitives[i].index = (uint32_t)i;
+            }
+        });
+        nodes.resize(1);
+        BuildRange root = BuildRange{0, 0, (uint32_t)source.size(), 0};
+        if(source.size() <= ParallelSubtreeSize)
+            buildNodes(nodes, primitives, root, nullptr);
+        else
+        {
+            vector<BuildRange> deferred;
+            buildNodes(nodes, primitives, root, &deferred);
+            vector<vector<Node>> subtrees(deferred.size());
+            parallelFor(deferred.size(), 1, [&](size_t start, size_t end)
+            {
+                for(size_t i = start; i < end; i++)
+                {
+                    BuildRange range = deferred[i];
+                    range.node = 0;
+                    subtrees[i].resize(1);
+                    buildNodes(subtrees[i], primitives, range, nullptr);
+                }
+            });
+            // subtree roots go where their placeholders are and the rest on the end, so children still come after their parents
+            for(size_t i = 0; i < deferred.size(); i++)
+            {
+                const vector<Node> &subtree = subtrees[i];
+                uint32_t base = (uint32_t)nodes.size() - 1;
+                for(size_t j = 0; j < subtree.size(); j++)
+                {
+                    Node node = subtree[j];
+                    if(node.firstChild != 0)
+                        node.firstChild += base;
+                    if(j == 0)
+                        nodes[deferred[i].node] = node;
+                    else
+                        nodes.push_back(node);
+                }
+            }
+        }
+        triangleList.resize(source.size());
+        parallelFor(source.size(), parallelMeshGrainSize, [&](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+                triangleList[i] = source[primitives[i].index];
+        });
+        originalIndices.resize(source.size());
+        for(size_t i = 0; i < source.size(); i++)
+            originalIndices[i] = primitives[i].index;
+    }
+    void refitBoxes()
+    {
+        Node *nodeData = nodes.data();
+        const Triangle *triangleData = triangleList.data();
+        parallelFor(nodes.size(), parallelMeshGrainSize, [nodeData, triangleData](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+            {
+                Node &node = nodeData[i];
+                if(node.firstChild != 0)
+                    continue;
+                node.box = BoundingBox();
+                for(size_t j = node.firstTriangle; j < node.firstTriangle + node.triangleCount; j++)
+                    node.box.add(BoundingBox(triangleData[j]));
+            }
+        });
+        for(size_t i = nodes.size(); i-- > 0;)
+        {
+            Node &node = nodes[i];
+            if(node.firstChild == 0)
+                continue;
+            node.box = nodes[node.firstChild].box;
+            node.box.add(nodes[node.firstChild + 1].box);
+        }
+    }
+    static bool intersectBox(const BoundingBox &box, VectorF origin, VectorF inverseDirection, float maxT, float &tNear)
+    {
+        float t1 = (box.minP.x - origin.x) * inverseDirection.x, t2 = (box.maxP.x - origin.x) * inverseDirection.x;
+        float tMin = min(t1, t2), tMax = max(t1, t2);
+        t1 = (box.minP.y - origin.y) * inverseDirection.y;
+        t2 = (box.maxP.y - origin.y) * inverseDirection.y;
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+        t1 = (box.minP.z - origin.z) * inverseDirection.z;
+        t2 = (box.maxP.z - origin.z) * inverseDirection.z;
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+        tNear = max(tMin, 0.0f);
+        return tMax >= tNear && tNear <= maxT;
+    }
+    static bool intersectTriangle(const Triangle &tri, const Ray &ray, float maxT, RayHit &hit)
+    {
+        VectorF edge1 = tri.p2 - tri.p1, edge2 = tri.p3 - tri.p1;
+        VectorF p = cross(ray.direction, edge2);
+        float determinant = dot(edge1, p);
+        if(std::fabs(determinant) < eps * eps * eps)
+            return false;
+        float inverseDeterminant = 1 / determinant;
+        VectorF offset = ray.origin - tri.p1;
+        float u = dot(offset, p) * inverseDeterminant;
+        if(u < 0 || u > 1)
+            return false;
+        VectorF q = cross(offset, edge1);
+        float v = dot(ray.direction, q) * inverseDeterminant;
+        if(v < 0 || u + v > 1)
+            return false;
+        float t = dot(edge2, q) * inverseDeterminant;
+        if(t < 0 || t >= maxT)
+            return false;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        return true;
+    }
+    struct PacketDirections
+    {
+        float inverseX[RayPacket::Size], inverseY[RayPacket::Size], inverseZ[RayPacket::Size];
+    };
+    /// returns if any ray in packet hits box, setting tNear to the nearest entry distance
+    static bool intersectBox(const BoundingBox &box, const RayPacket &packet, const PacketDirections &directions, float &tNear)
+    {
+        VectorF minP = box.minP - packet.origin, maxP = box.maxP - packet.origin;
+        float nearest = numeric_limits<float>::infinity();
+        for(size_t i = 0; i < RayPacket::Size; i++)
+        {
+            float t1 = minP.x * directions.inverseX[i], t2 = maxP.x * directions.inverseX[i];
+            float tMin = min(t1, t2), tMax = max(t1, t2);
+            t1 = minP.y * directions.inverseY[i];
+            t2 = maxP.y * directions.inverseY[i];
+            tMin = max(tMin, min(t1, t2));
+            tMax = min(tMax, max(t1, t2));
+            t1 = minP.z * directions.inverseZ[i];
+            t2 = maxP.z * directions.inverseZ[i];
+            tMin = max(tMin, min(t1, t2));
+            tMax = min(min(tMax, max(t1, t2)), packet.tMax[i]);
+            tMin = max(tMin, packet.tMin[i]);
+            nearest = min(nearest, tMin <= tMax ? tMin : numeric_limits<float>::infinity());
+        }
+        tNear = nearest;
+        return nearest != numeric_limits<float>::infinity();
+    }
+    static void intersectTriangle(const Triangle &tri, uint32_t index, RayPacket &packet)
+    {
+        VectorF edge1 = tri.p2 - tri.p1, edge2 = tri.p3 - tri.p1;
+        VectorF offset = packet.origin - tri.p1;
+        VectorF q = cross(offset, edge1);
+        float offsetDotEdge2 = dot(edge2, q);
+        // the determinant is positive for front faces
+        float minDeterminant = packet.cullBackFaces ? eps * eps * eps : -numeric_limits<float>::infinity();
+        for(size_t i = 0; i < RayPacket::Size; i++)
+        {
+            VectorF direction = VectorF(packet.directionX[i], packet.directionY[i], packet.directionZ[i]);
+            VectorF p = cross(direction, edge2);
+            float determinant = dot(edge1, p);
+            float inverseDeterminant = 1 / determinant;
+            float u = dot(offset, p) * inverseDeterminant;
+            float v = dot(direction, q) * inverseDeterminant;
+            float t = offsetDotEdge2 * inverseDeterminant;
+            bool hit = std::fabs(determinant) >= eps * eps * eps && determinant >= minDeterminant && u >= 0 && v >= 0 && u + v <= 1 && t > packet.tMin[i] && t < packet.tMax[i];
+            packet.tMax[i] = hit ? t : packet.tMax[i];
+            packet.u[i] = hit ? u : packet.u[i];
+            packet.v[i] = hit ? v : packet.v[i];
+            packet.triangle[i] = hit ? index : packet.triangle[i];
+        }
+    }
+    /// -1 if box is outside, 1 if it's inside and 0 if it's cut by a plane
+    static int classify(const Frustum &frustum, const BoundingBox &box)
+    {
+        int retval = 1;
+        for(size_t i = 0; i < 5; i++)
+        {
+            VectorF n = frustum.normals[i];
+            VectorF farthest = VectorF(n.x >= 0 ? box.maxP.x : box.minP.x, n.y >= 0 ? box.maxP.y : box.minP.y, n.z >= 0 ? box.maxP.z : box.minP.z);
+            if(dot(n, farthest) + frustum.d[i] < 0)
+                return -1;
+            VectorF nearest = VectorF(n.x >= 0 ? box.minP.x : box.maxP.x, n.y >= 0 ? box.minP.y : box.maxP.y, n.z >= 0 ? box.minP.z : box.maxP.z);
+            if(dot(n, nearest) + frustum.d[i] < 0)
+                retval = 0;
+        }
+        return retval;
+    }
+public:
+    BVH()
+    {
+    }
+    explicit BVH(const vector<Triangle> &triangles)
+    {
+        build(triangles);
+    }
+    explicit BVH(const Mesh &mesh)
+    {
+        build(mesh.triangles);
+    }
+    /// the triangles of every mesh in model, one after another
+    explicit BVH(const Model &model)
+    {
+        vector<Triangle> triangles;
+        triangles.reserve(model.triangleCount());
+        for(const pair<Material, Mesh> &mesh : model.meshes)
+            triangles.insert(triangles.end(), std::get<1>(mesh).triangles.begin(), std::get<1>(mesh).triangles.end());
+        build(triangles);
+    }
+    bool empty() const
+    {
+        return nodes.empty();
+    }
+    size_t nodeCount() const
+    {
+        return nodes.size();
+    }
+    const vector<Triangle> &triangles() const
+    {
+        return triangleList;
+    }
+    /// the index triangles()[index] had in the triangles the BVH was built from
+    size_t originalIndex(size_t index) const
+    {
+        return originalIndices[index];
+    }
+    BoundingBox bounds() const
+    {
+        if(nodes.empty())
+            return BoundingBox();
+        return nodes[0].box;
+    }
+    /// updates the tree for source, which has to be the triangles it was built from in their new positions
+    void refit(const vector<Triangle> &source)
+    {
+        assert(source.size() == triangleList.size());
+        Triangle *triangleData = triangleList.data();
+        const uint32_t *indices = originalIndices.data();
+        parallelFor(triangleList.size(), parallelMeshGrainSize, [triangleData, indices, &source](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+                triangleData[i] = source[indices[i]];
+        });
+        refitBoxes();
+    }
+    void refit(const Mesh &source)
+    {
+        refit(source.triangles);
+    }
+    /// moves every triangle by tform and updates the tree to match
+    void refit(Transform tform)
+    {
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        mapTrianglesInPlace(triangleList, [&m, &normalTransform](const Triangle &tri)
+        {
+            return transform(m, normalTransform, tri);
+        });
+        refitBoxes();
+    }
+    /// calls fn(first, last) for disjoint ranges of triangles() in increasing order that cover every triangle that might be visible
+    template <typename Fn>
+    void findVisible(const Frustum &frustum, Fn fn) const
+    {
+        if(nodes.empty())
+            return;
+        uint32_t stack[StackSize];
+        size_t stackSize = 0;
+        stack[stackSize++] = 0;
+        size_t rangeFirst = 0, rangeLast = 0;
+        while(stackSize > 0)
+        {
+            const Node &node = nodes[stack[--stackSize]];
+            int classification = classify(frustum, node.box);
+            if(classification < 0)
+                continue;
+            if(classification == 0 && node.firstChild != 0)
+            {
+                stack[stackSize++] = node.firstChild + 1;
+                stack[stackSize++] = node.firstChild;
+                continue;
+            }
+            if(node.firstTriangle != rangeLast)
+            {
+                if(rangeFirst != rangeLast)
+                    fn(rangeFirst, rangeLast);
+                rangeFirst = node.firstTriangle;
+            }
+            rangeLast = node.firstTriangle + node.triangleCount;
+        }
+        if(rangeFirst != rangeLast)
+            fn(rangeFirst, rangeLast);
+    }
+    /// appends the triangles that might be visible
+    void getVisibleTriangles(vector<Triangle> &dest, const Frustum &frustum) const
+    {
+        findVisible(frustum, [this, &dest](size_t first, size_t last)
+        {
+            dest.insert(dest.end(), triangleList.begin() + first, triangleList.begin() + last);
+        });
+    }
+    /// finds the nearest triangle hit by ray closer than maxT, from either side
+    bool intersect(const Ray &ray, RayHit &hit, float maxT = numeric_limits<float>::infinity()) const
+    {
+        if(nodes.empty())
+            return false;
+        VectorF inverseDirection = VectorF(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+        uint32_t stack[StackSize];
+        size_t stackSize = 0;
+        float tNear;
+        if(!intersectBox(nodes[0].box, ray.origin, inverseDirection, maxT, tNear))
+            return false;
+        stack[stackSize++] = 0;
+        bool found = false;
+        while(stackSize > 0)
+        {
+            const Node &node = nodes[stack[--stackSize]];
+            if(!intersectBox(node.box, ray.origin, inverseDirection, maxT, tNear))
+                continue;
+            if(node.firstChild == 0)
+            {
+                for(size_t i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++)
+                {
+                    if(intersectTriangle(triangleList[i], ray, maxT, hit))
+                    {
+                        hit.triangle = i;
+                        maxT = hit.t;
+                        found = true;
+                    }
+                }
+                continue;
+            }
+            float tNear1, tNear2;
+            bool hit1 = intersectBox(nodes[node.firstChild].box, ray.origin, inverseDirection, maxT, tNear1);
+            bool hit2 = intersectBox(nodes[node.firstChild + 1].box, ray.origin, inverseDirection, maxT, tNear2);
+            // push the farther child first so the nearer one is searched first and shrinks maxT
+            if(hit1 && hit2 && tNear2 < tNear1)
+            {
+                stack[stackSize++] = node.firstChild;
+                stack[stackSize++] = node.firstChild + 1;
+                continue;
+            }
+            if(hit2)
+                stack[stackSize++] = node.firstChild + 1;
+            if(hit1)
+                stack[stackSize++] = node.firstChild;
+        }
+        return found;
+    }
+    /// finds the nearest hit for every ray in packet, walking the tree once for all of them
+    void intersect(RayPacket &packet) const
+    {
+        if(nodes.empty())
+            return;
+        PacketDirections directions;
+        for(size_t i = 0; i < RayPacket::Size; i++)
+        {
+            directions.inverseX[i] = 1 / packet.directionX[i];
+            directions.inverseY[i] = 1 / packet.directionY[i];
+            directions.inverseZ[i] = 1 / packet.directionZ[i];
+        }
+        uint32_t stack[StackSize];
+        size_t stackSize = 0;
+        float tNear;
+        if(!intersectBox(nodes[0].box, packet, directions, tNear))
+            return;
+        stack[stackSize++] = 0;
+        while(stackSize > 0)
+        {
+            const Node &node = nodes[stack[--stackSize]];
+            if(node.firstChild == 0)
+            {
+                for(size_t i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++)
+                    intersectTriangle(triangleList[i], (uint32_t)i, packet);
+                continue;
+            }
+            float tNear1, tNear2;
+            bool hit1 = intersectBox(nodes[node.firstChild].box, packet, directions, tNear1);
+            bool hit2 = intersectBox(nodes[node.firstChild + 1].box, packet, directions, tNear2);
+            if(hit1 && hit2 && tNear2 < tNear1)
+            {
+                stack[stackSize++] = node.firstChild;
+                stack[stackSize++] = node.firstChild + 1;
+                continue;
+            }
+            if(hit2)
+                stack[stackSize++] = node.firstChild + 1;
+            if(hit1)
+                stack[stackSize++] = node.firstChild;
+        }
+    }
+    /// calls fn(index) for each triangle in triangles() whose bounding box overlaps box
+    template <typename Fn>
+    void findOverlapping(const BoundingBox &box, Fn fn) const
+    {
+        if(nodes.empty())
+            return;
+        uint32_t stack[StackSize];
+        size_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while(stackSize > 0)
+        {
+            const Node &node = nodes[stack[--stackSize]];
+            if(!node.box.overlaps(box))
+                continue;
+            if(node.firstChild != 0)
+            {
+                stack[stackSize++] = node.firstChild + 1;
+                stack[stackSize++] = node.firstChild;
+                continue;
+            }
+            for(size_t i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++)
+                if(BoundingBox(triangleList[i]).overlaps(box))
+                    fn(i);
+        }
+    }
+};
+
+#endif // BVH_H_INCLUDED
@@ -66,6 +66,14 @@ public:
     {
         imageRenderer->render(m);
     }
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override
+    {
+        return imageRenderer->createStaticMesh(m);
+    }
+    virtual void render(const StaticMesh &m, Transform tform) override
+    {
+        imageRenderer->render(m, tform);
+    }
     virtual void enableWriteDepth(bool v) override
     {
         imageRenderer->enableWriteDepth(v);
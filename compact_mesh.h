@@ -0,0 +1,231 @@
+#ifndef COMPACT_MESH_H_INCLUDED
+#define COMPACT_MESH_H_INCLUDED
+
+#include "mesh.h"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+using namespace std;
+
+/// unit normal in octahedral encoding, 8 bits per component
+struct PackedNormal
+{
+    int8_t x, y;
+};
+
+/// VectorF(0) is kept as a reserved code because shadeMesh uses it to mark unshaded vertices
+constexpr int8_t packedZeroNormal = -128;
+
+inline int8_t packNormalComponent(float v)
+{
+    return (int8_t)limit<int>((int)std::floor(v * 127 + 0.5f), -127, 127);
+}
+
+inline PackedNormal packNormal(VectorF n)
+{
+    PackedNormal retval;
+    float length1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if(length1 < eps)
+    {
+        retval.x = packedZeroNormal;
+        retval.y = packedZeroNormal;
+        return retval;
+    }
+    float x = n.x / length1, y = n.y / length1;
+    if(n.z < 0)
+    {
+        float foldedX = (1 - std::fabs(y)) * (x < 0 ? -1 : 1);
+        float foldedY = (1 - std::fabs(x)) * (y < 0 ? -1 : 1);
+        x = foldedX;
+        y = foldedY;
+    }
+    retval.x = packNormalComponent(x);
+    retval.y = packNormalComponent(y);
+    return retval;
+}
+
+inline VectorF unpackNormal(PackedNormal n)
+{
+    if(n.x == packedZeroNormal && n.y == packedZeroNormal)
+        return VectorF(0);
+    VectorF retval((float)n.x / 127, (float)n.y / 127, 0);
+    retval.z = 1 - std::fabs(retval.x) - std::fabs(retval.y);
+    if(retval.z < 0)
+    {
+        float t = -retval.z;
+        retval.x += (retval.x < 0 ? t : -t);
+        retval.y += (retval.y < 0 ? t : -t);
+    }
+    return normalizeNoThrow(retval);
+}
+
+/// everything but the position of a vertex : 10 bytes instead of 36
+struct CompactVertexAttributes
+{
+    ColorI c;
+    PackedNormal n;
+    uint16_t u, v;
+};
+
+struct QuantizedPosition
+{
+    uint16_t x, y, z;
+};
+
+/** read-only storage for large static meshes
+ *
+ * Colors are stored as RGBA8, normals octahedrally encoded in 16 bits and
+ * texture coordinates as 16 bits each relative to the range used by the mesh.
+ * If quantizePositions is set positions are also stored as 16 bits per axis
+ * relative to the mesh's bounding box, giving 48 bytes per triangle instead
+ * of the 144 bytes of a Triangle. The conversion is lossy, so keep the Mesh
+ * around if it's going to be modified.
+ */
+class CompactMesh final
+{
+    vector<CompactVertexAttributes> attributes;
+    vector<VectorF> positions;
+    vector<QuantizedPosition> quantizedPositions;
+    VectorF positionOrigin = VectorF(0), positionScale = VectorF(0);
+    float textureOriginU = 0, textureOriginV = 0, textureScaleU = 0, textureScaleV = 0;
+    static uint16_t quantize(float v, float origin, float scale)
+    {
+        if(scale == 0)
+            return 0;
+        return (uint16_t)limit<float>(std::floor((v - origin) / scale + 0.5f), 0, 0xFFFF);
+    }
+    static float quantizationScale(float minV, float maxV)
+    {
+        return (maxV - minV) / 0xFFFF;
+    }
+public:
+    shared_ptr<Texture> image;
+    CompactMesh()
+    {
+    }
+    explicit CompactMesh(const Mesh &mesh, bool quantizePositions = false)
+        : image(mesh.image)
+    {
+        size_t vertexCount = mesh.triangles.size() * 3;
+        if(vertexCount == 0)
+            return;
+        pair<VectorF, VectorF> extents = mesh.getExtents();
+        float minU = mesh.triangles[0].t1.u, maxU = minU;
+        float minV = mesh.triangles[0].t1.v, maxV = minV;
+        for(const Triangle &tri : mesh.triangles)
+        {
+            for(TextureCoord t : {tri.t1, tri.t2, tri.t3})
+            {
+                minU = min(minU, t.u);
+                maxU = max(maxU, t.u);
+                minV = min(minV, t.v);
+                maxV = max(maxV, t.v);
+            }
+        }
+        textureOriginU = minU;
+        textureOriginV = minV;
+        textureScaleU = quantizationScale(minU, maxU);
+        textureScaleV = quantizationScale(minV, maxV);
+        attributes.reserve(vertexCount);
+        if(quantizePositions)
+        {
+            positionOrigin = extents.first;
+            positionScale = VectorF(quantizationScale(extents.first.x, extents.second.x),
+                                    quantizationScale(extents.first.y, extents.second.y),
+                                    quantizationScale(extents.first.z, extents.second.z));
+            quantizedPositions.reserve(vertexCount);
+        }
+        else
+            positions.reserve(vertexCount);
+        for(const Triangle &tri : mesh.triangles)
+        {
+            for(Vertex v : {tri.v1(), tri.v2(), tri.v3()})
+            {
+                CompactVertexAttributes a;
+                a.c = (ColorI)v.c;
+                a.n = packNormal(v.n);
+                a.u = quantize(v.t.u, textureOriginU, textureScaleU);
+                a.v = quantize(v.t.v, textureOriginV, textureScaleV);
+                attributes.push_back(a);
+                if(quantizePositions)
+                {
+                    QuantizedPosition p;
+                    p.x = quantize(v.p.x, positionOrigin.x, positionScale.x);
+                    p.y = quantize(v.p.y, positionOrigin.y, positionScale.y);
+                    p.z = quantize(v.p.z, positionOrigin.z, positionScale.z);
+                    quantizedPositions.push_back(p);
+                }
+                else
+                    positions.push_back(v.p);
+            }
+        }
+    }
+    size_t triangleCount() const
+    {
+        return attributes.size() / 3;
+    }
+    bool hasQuantizedPositions() const
+    {
+        return !quantizedPositions.empty();
+    }
+    size_t memoryUsage() const
+    {
+        return attributes.size() * sizeof(CompactVertexAttributes)
+            + positions.size() * sizeof(VectorF)
+            + quantizedPositions.size() * sizeof(QuantizedPosition);
+    }
+    VectorF position(size_t vertexIndex) const
+    {
+        if(quantizedPositions.empty())
+            return positions[vertexIndex];
+        QuantizedPosition p = quantizedPositions[vertexIndex];
+        return VectorF(positionOrigin.x + p.x * positionScale.x,
+                       positionOrigin.y + p.y * positionScale.y,
+                       positionOrigin.z + p.z * positionScale.z);
+    }
+    TextureCoord textureCoord(size_t vertexIndex) const
+    {
+        const CompactVertexAttributes &a = attributes[vertexIndex];
+        return TextureCoord(textureOriginU + a.u * textureScaleU, textureOriginV + a.v * textureScaleV);
+    }
+    ColorF color(size_t vertexIndex) const
+    {
+        return ColorF(attributes[vertexIndex].c);
+    }
+    VectorF normal(size_t vertexIndex) const
+    {
+        return unpackNormal(attributes[vertexIndex].n);
+    }
+    Vertex vertex(size_t vertexIndex) const
+    {
+        return Vertex(position(vertexIndex), textureCoord(vertexIndex), color(vertexIndex), normal(vertexIndex));
+    }
+    Triangle triangle(size_t index) const
+    {
+        return Triangle(vertex(index * 3), vertex(index * 3 + 1), vertex(index * 3 + 2));
+    }
+    void unpack(Mesh &dest, Transform tform) const
+    {
+        dest.triangles.clear();
+        dest.image = image;
+        dest.triangles.resize(triangleCount());
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        Triangle *destTriangles = dest.triangles.data();
+        parallelFor(triangleCount(), parallelMeshGrainSize, [this, destTriangles, &m, &normalTransform](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+                destTriangles[i] = transform(m, normalTransform, triangle(i));
+        });
+    }
+    Mesh unpack() const
+    {
+        Mesh retval;
+        unpack(retval, Transform(Matrix::identity()));
+        return retval;
+    }
+};
+
+#endif // COMPACT_MESH_H_INCLUDED
@@ -0,0 +1,92 @@
+#include "csg_cache.h"
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <unistd.h>
+
+using namespace std;
+
+string getDefaultCSGCacheDirectory()
+{
+    const char * str = getenv("LIB3D_CSG_CACHE");
+    if(str == nullptr)
+        return "";
+    return str;
+}
+
+uint64_t CSGCache::makeKey(const char *operation, const BSPTree &a, const BSPTree &b)
+{
+    uint64_t retval = 14695981039346656037ULL;
+    for(int i = 0; i < 32; i += 8)
+    {
+        retval ^= (uint8_t)(ResultVersion >> i);
+        retval *= 1099511628211ULL;
+    }
+    for(const char *p = operation; *p; p++)
+    {
+        retval ^= (uint8_t)*p;
+        retval *= 1099511628211ULL;
+    }
+    for(uint64_t v : {a.contentHash(), b.contentHash()})
+    {
+        for(int i = 0; i < 64; i += 8)
+        {
+            retval ^= (uint8_t)(v >> i);
+            retval *= 1099511628211ULL;
+        }
+    }
+    return retval;
+}
+
+string CSGCache::getPath(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bsp", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+bool CSGCache::load(uint64_t key, BSPTree &tree) const
+{
+    ifstream is(getPath(key).c_str(), ios::binary);
+    if(!is)
+        return false;
+    try
+    {
+        tree = BSPTree::read(is);
+        return true;
+    }
+    catch(BSPTreeLoadException &)
+    {
+        return false;
+    }
+}
+
+void CSGCache::store(uint64_t key, const BSPTree &tree) const
+{
+    static atomic<unsigned> tempCounter(0);
+    string path = getPath(key);
+    // a name no other process or thread uses, as they may be storing the same result at the same time
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long)getpid(), tempCounter++);
+    string tempPath = path + suffix;
+    {
+        ofstream os(tempPath.c_str(), ios::binary);
+        if(!os)
+            return;
+        tree.write(os);
+        os.close();
+        if(!os)
+        {
+            remove(tempPath.c_str());
+            return;
+        }
+    }
+    // write then rename so other processes never see a partial file
+    if(rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        remove(path.c_str());
+        if(rename(tempPath.c_str(), path.c_str()) != 0)
+            remove(tempPath.c_str());
+    }
+}
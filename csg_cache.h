@@ -0,0 +1,66 @@
+#ifndef CSG_CACHE_H_INCLUDED
+#define CSG_CACHE_H_INCLUDED
+
+#include "bsp_tree.h"
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+/// the directory named by the LIB3D_CSG_CACHE environment variable, or "" if it's not set
+string getDefaultCSGCacheDirectory();
+
+/** on-disk cache of CSG results
+ *
+ * Results are stored in the cache directory under a hash of the operation
+ * and of both operand trees, so a solid built from unchanged inputs is read
+ * back instead of recomputed. The directory has to exist already; if the
+ * directory is "" or a file can't be read or written the result is just
+ * computed as usual.
+ */
+class CSGCache final
+{
+    /// part of every key, bump it whenever csgUnion(), csgIntersection(), csgDifference() or the file format change what they produce, so old results are no longer found
+    static constexpr uint32_t ResultVersion = 1;
+    string directory;
+    static uint64_t makeKey(const char *operation, const BSPTree &a, const BSPTree &b);
+    string getPath(uint64_t key) const;
+    bool load(uint64_t key, BSPTree &tree) const;
+    void store(uint64_t key, const BSPTree &tree) const;
+    template <typename Fn>
+    BSPTree get(const char *operation, BSPTree a, BSPTree b, Fn fn) const
+    {
+        if(directory.empty())
+            return fn(std::move(a), std::move(b));
+        uint64_t key = makeKey(operation, a, b);
+        BSPTree retval;
+        if(load(key, retval))
+            return retval;
+        retval = fn(std::move(a), std::move(b));
+        store(key, retval);
+        return retval;
+    }
+public:
+    explicit CSGCache(string directory = getDefaultCSGCacheDirectory())
+        : directory(std::move(directory))
+    {
+    }
+    bool enabled() const
+    {
+        return !directory.empty();
+    }
+    BSPTree csgUnion(BSPTree a, BSPTree b) const
+    {
+        return get("union", std::move(a), std::move(b), ::csgUnion);
+    }
+    BSPTree csgIntersection(BSPTree a, BSPTree b) const
+    {
+        return get("intersection", std::move(a), std::move(b), ::csgIntersection);
+    }
+    BSPTree csgDifference(BSPTree a, BSPTree b) const
+    {
+        return get("difference", std::move(a), std::move(b), ::csgDifference);
+    }
+};
+
+#endif // CSG_CACHE_H_INCLUDED
@@ -0,0 +1,533 @@
+#ifndef DECIMATE_H_INCLUDED
+#define DECIMATE_H_INCLUDED
+
+#include "mesh.h"
+#include "weld.h"
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+#include <limits>
+
+using namespace std;
+
+namespace decimate_internal
+{
+/// sum of squared distances to a set of weighted planes, as the symmetric 4x4 matrix of the plane equations
+struct Quadric
+{
+    double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+    double a11 = 0, a12 = 0, a13 = 0;
+    double a22 = 0, a23 = 0;
+    double a33 = 0;
+    double weight = 0;
+    Quadric()
+    {
+    }
+    /// the plane dot(normal, p) + d = 0 with normal of unit length
+    Quadric(VectorF normal, float d, double weight)
+        : a00(weight * normal.x * normal.x), a01(weight * normal.x * normal.y), a02(weight * normal.x * normal.z), a03(weight * normal.x * d),
+          a11(weight * normal.y * normal.y), a12(weight * normal.y * normal.z), a13(weight * normal.y * d),
+          a22(weight * normal.z * normal.z), a23(weight * normal.z * d),
+          a33(weight * d * d), weight(weight)
+    {
+    }
+    Quadric &operator +=(const Quadric &rt)
+    {
+        a00 += rt.a00;
+        a01 += rt.a01;
+        a02 += rt.a02;
+        a03 += rt.a03;
+        a11 += rt.a11;
+        a12 += rt.a12;
+        a13 += rt.a13;
+        a22 += rt.a22;
+        a23 += rt.a23;
+        a33 += rt.a33;
+        weight += rt.weight;
+        return *this;
+    }
+    friend Quadric operator +(Quadric a, const Quadric &b)
+    {
+        return a += b;
+    }
+    /// the weighted mean squared distance from p to the planes
+    double error(VectorF p) const
+    {
+        if(weight <= 0)
+            return 0;
+        double x = p.x, y = p.y, z = p.z;
+        double retval = x * (a00 * x + 2 * (a01 * y + a02 * z + a03))
+                      + y * (a11 * y + 2 * (a12 * z + a13))
+                      + z * (a22 * z + 2 * a23)
+                      + a33;
+        return std::max(0.0, retval / weight);
+    }
+};
+
+enum class VertexKind : uint8_t
+{
+    /// every triangle around it has the same attributes, can collapse into any neighbor
+    Manifold,
+    /// on an open edge, can only slide along the open edges
+    Border,
+    /// where two attribute regions meet, like a UV seam, can only slide along the seam
+    Seam,
+    /// can't move
+    Locked
+};
+
+/// open edges and seams are held in place by planes through them this many times as strong as the surface
+constexpr double BorderWeight = 10;
+
+struct Collapse
+{
+    uint32_t from, to;
+    double cost;
+    bool operator <(const Collapse &rt) const
+    {
+        return cost < rt.cost;
+    }
+};
+}
+
+/** reduces a mesh to about targetTriangleCount triangles by collapsing edges in order of quadric error
+ *
+ * Each collapse moves a vertex onto one of its neighbors, so every vertex
+ * left keeps its own texture coordinate, color and normal. Vertices where
+ * the attributes change, like UV seams, only move along the seam and open
+ * edges only move along themselves, so the outline and the texture mapping
+ * stay put. Triangles that would flip are never made. If errorOut isn't
+ * null it gets the largest distance any collapse moved the surface, measured
+ * as the root mean square distance to the planes of the original triangles
+ * around the vertex. Meshes whose triangles don't share vertices, like
+ * meshes with a normal per face, mostly can't be reduced.
+ */
+inline vector<Triangle> decimate(const vector<Triangle> &meshTriangles, size_t targetTriangleCount, float *errorOut = nullptr)
+{
+    using namespace decimate_internal;
+    constexpr size_t verticesPerTriangle = 3;
+    typedef array<uint32_t, verticesPerTriangle> IndexedTriangle;
+    assert(meshTriangles.size() * verticesPerTriangle <= 0xFFFFFFFFU);
+    if(errorOut != nullptr)
+        *errorOut = 0;
+    if(meshTriangles.size() <= targetTriangleCount)
+        return meshTriangles;
+
+    // corners with all attributes equal share a wedge, wedges with equal positions share a vertex
+    vector<Vertex> corners;
+    corners.reserve(meshTriangles.size() * verticesPerTriangle);
+    for(const Triangle &tri : meshTriangles)
+    {
+        corners.push_back(tri.v1());
+        corners.push_back(tri.v2());
+        corners.push_back(tri.v3());
+    }
+    vector<uint32_t> cornerWedges;
+    vector<Vertex> wedges = weldVertices(corners, WeldTolerance(), cornerWedges);
+    corners.clear();
+    corners.shrink_to_fit();
+    vector<uint32_t> wedgeVertices;
+    const float any = numeric_limits<float>::infinity();
+    vector<VectorF> positions;
+    for(const Vertex &v : weldVertices(wedges, WeldTolerance(0, any, any, any), wedgeVertices))
+        positions.push_back(v.p);
+    size_t vertexCount = positions.size();
+
+    vector<IndexedTriangle> triangles;
+    triangles.reserve(meshTriangles.size());
+    for(size_t i = 0; i < meshTriangles.size(); i++)
+    {
+        IndexedTriangle triangle = {{cornerWedges[3 * i], cornerWedges[3 * i + 1], cornerWedges[3 * i + 2]}};
+        uint32_t v1 = wedgeVertices[triangle[0]], v2 = wedgeVertices[triangle[1]], v3 = wedgeVertices[triangle[2]];
+        if(v1 != v2 && v2 != v3 && v3 != v1)
+            triangles.push_back(triangle);
+    }
+    cornerWedges.clear();
+    cornerWedges.shrink_to_fit();
+
+    // the wedges of each vertex as a circular list
+    vector<uint32_t> nextWedge(wedges.size());
+    {
+        const uint32_t NoWedge = ~(uint32_t)0;
+        vector<uint32_t> lastWedge(vertexCount, NoWedge), firstWedge(vertexCount, NoWedge);
+        for(uint32_t wedge = 0; wedge < wedges.size(); wedge++)
+        {
+            uint32_t vertex = wedgeVertices[wedge];
+            if(lastWedge[vertex] == NoWedge)
+                firstWedge[vertex] = wedge;
+            else
+                nextWedge[lastWedge[vertex]] = wedge;
+            lastWedge[vertex] = wedge;
+        }
+        for(uint32_t vertex = 0; vertex < vertexCount; vertex++)
+            nextWedge[lastWedge[vertex]] = firstWedge[vertex];
+    }
+
+    // directed edges as the start vertex in the high half and the end vertex in the low half, sorted, along with which triangle corner they start at
+    vector<pair<uint64_t, uint32_t>> edges;
+    auto buildEdges = [&]()
+    {
+        edges.clear();
+        for(uint32_t i = 0; i < triangles.size(); i++)
+        {
+            for(uint32_t j = 0; j < verticesPerTriangle; j++)
+            {
+                uint64_t start = wedgeVertices[triangles[i][j]], end = wedgeVertices[triangles[i][(j + 1) % verticesPerTriangle]];
+                edges.push_back(make_pair(start << 32 | end, i * verticesPerTriangle + j));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+    };
+    auto findEdge = [&](uint32_t start, uint32_t end)->const pair<uint64_t, uint32_t> *
+    {
+        uint64_t key = (uint64_t)start << 32 | end;
+        auto iter = lower_bound(edges.begin(), edges.end(), make_pair(key, (uint32_t)0));
+        if(iter == edges.end() || iter->first != key)
+            return nullptr;
+        return &*iter;
+    };
+    auto wedgeAt = [&](uint32_t corner)
+    {
+        return triangles[corner / verticesPerTriangle][corner % verticesPerTriangle];
+    };
+    auto wedgeAfter = [&](uint32_t corner)
+    {
+        return triangles[corner / verticesPerTriangle][(corner + 1) % verticesPerTriangle];
+    };
+    // the edge is a seam if the triangles on each side use different wedges at either end
+    auto isSeamEdge = [&](uint32_t a, uint32_t b)
+    {
+        const pair<uint64_t, uint32_t> *forward = findEdge(a, b), *backward = findEdge(b, a);
+        if(forward == nullptr || backward == nullptr)
+            return false;
+        return wedgeAt(forward->second) != wedgeAfter(backward->second) || wedgeAfter(forward->second) != wedgeAt(backward->second);
+    };
+    auto isOpenEdge = [&](uint32_t a, uint32_t b)
+    {
+        return (findEdge(a, b) == nullptr) != (findEdge(b, a) == nullptr);
+    };
+
+    buildEdges();
+    vector<VertexKind> kinds(vertexCount, VertexKind::Manifold);
+    {
+        vector<bool> border(vertexCount, false), nonManifold(vertexCount, false);
+        for(size_t i = 0; i < edges.size(); i++)
+        {
+            uint32_t start = (uint32_t)(edges[i].first >> 32), end = (uint32_t)edges[i].first;
+            if(i > 0 && edges[i - 1].first == edges[i].first)
+                nonManifold[start] = nonManifold[end] = true;
+            else if(findEdge(end, start) == nullptr)
+                border[start] = border[end] = true;
+        }
+        vector<uint32_t> wedgeCounts(vertexCount, 0);
+        for(uint32_t wedge = 0; wedge < wedges.size(); wedge++)
+            wedgeCounts[wedgeVertices[wedge]]++;
+        for(uint32_t vertex = 0; vertex < vertexCount; vertex++)
+        {
+            if(nonManifold[vertex] || wedgeCounts[vertex] > 2 || (border[vertex] && wedgeCounts[vertex] > 1))
+                kinds[vertex] = VertexKind::Locked;
+            else if(border[vertex])
+                kinds[vertex] = VertexKind::Border;
+            else if(wedgeCounts[vertex] == 2)
+                kinds[vertex] = VertexKind::Seam;
+        }
+    }
+
+    vector<Quadric> quadrics(vertexCount);
+    for(const IndexedTriangle &triangle : triangles)
+    {
+        VectorF p1 = positions[wedgeVertices[triangle[0]]], p2 = positions[wedgeVertices[triangle[1]]], p3 = positions[wedgeVertices[triangle[2]]];
+        VectorF normal = cross(p2 - p1, p3 - p1);
+        float area = abs(normal);
+        if(area == 0)
+            continue;
+        normal /= area;
+        Quadric q(normal, -dot(normal, p1), area * 0.5);
+        for(uint32_t wedge : triangle)
+            quadrics[wedgeVertices[wedge]] += q;
+    }
+    for(const pair<uint64_t, uint32_t> &edge : edges)
+    {
+        uint32_t start = (uint32_t)(edge.first >> 32), end = (uint32_t)edge.first;
+        if(!isOpenEdge(start, end) && !(start < end && isSeamEdge(start, end)))
+            continue;
+        // a plane through the edge at right angles to the triangle
+        const IndexedTriangle &triangle = triangles[edge.second / verticesPerTriangle];
+        VectorF p1 = positions[wedgeVertices[triangle[0]]], p2 = positions[wedgeVertices[triangle[1]]], p3 = positions[wedgeVertices[triangle[2]]];
+        VectorF edgeVector = positions[end] - positions[start];
+        VectorF normal = cross(edgeVector, cross(p2 - p1, p3 - p1));
+        float length = abs(normal);
+        if(length == 0)
+            continue;
+        normal /= length;
+        Quadric q(normal, -dot(normal, positions[start]), absSquared(edgeVector) * BorderWeight);
+        quadrics[start] += q;
+        quadrics[end] += q;
+    }
+
+    auto canCollapse = [&](uint32_t from, uint32_t to)
+    {
+        switch(kinds[from])
+        {
+        case VertexKind::Manifold:
+            return true;
+        case VertexKind::Border:
+            return kinds[to] == VertexKind::Border && isOpenEdge(from, to);
+        case VertexKind::Seam:
+            return kinds[to] == VertexKind::Seam && isSeamEdge(from, to);
+        case VertexKind::Locked:
+            break;
+        }
+        return false;
+    };
+
+    vector<uint32_t> adjacencyStart, adjacency;
+    vector<Collapse> collapses;
+    vector<uint32_t> vertexRemap(vertexCount), wedgeRemap(wedges.size());
+    vector<bool> touched(vertexCount);
+    double maxError = 0;
+    while(triangles.size() > targetTriangleCount)
+    {
+        // the triangles using each vertex as compressed rows
+        adjacencyStart.assign(vertexCount + 1, 0);
+        for(const IndexedTriangle &triangle : triangles)
+            for(uint32_t wedge : triangle)
+                adjacencyStart[wedgeVertices[wedge] + 1]++;
+        for(size_t i = 1; i < adjacencyStart.size(); i++)
+            adjacencyStart[i] += adjacencyStart[i - 1];
+        adjacency.resize(adjacencyStart.back());
+        for(size_t i = 0; i < triangles.size(); i++)
+            for(uint32_t wedge : triangles[i])
+                adjacency[adjacencyStart[wedgeVertices[wedge]]++] = (uint32_t)i;
+        for(size_t i = adjacencyStart.size() - 1; i > 0; i--)
+            adjacencyStart[i] = adjacencyStart[i - 1];
+        adjacencyStart[0] = 0;
+
+        // each edge once, in the cheaper direction it can collapse
+        collapses.clear();
+        for(const pair<uint64_t, uint32_t> &edge : edges)
+        {
+            uint32_t a = (uint32_t)(edge.first >> 32), b = (uint32_t)edge.first;
+            if(a > b && findEdge(b, a) != nullptr)
+                continue;
+            Quadric q = quadrics[a] + quadrics[b];
+            Collapse collapse = {0, 0, numeric_limits<double>::infinity()};
+            if(canCollapse(a, b))
+                collapse = Collapse{a, b, q.error(positions[b])};
+            if(canCollapse(b, a))
+            {
+                double cost = q.error(positions[a]);
+                if(cost < collapse.cost)
+                    collapse = Collapse{b, a, cost};
+            }
+            if(collapse.cost != numeric_limits<double>::infinity())
+                collapses.push_back(collapse);
+        }
+        if(collapses.empty())
+            break;
+        std::sort(collapses.begin(), collapses.end());
+
+        // interior collapses remove 2 triangles, so about half as many collapses as triangles to remove are needed
+        size_t goal = triangles.size() - targetTriangleCount;
+        // skip collapses much worse than the ones that would be done if none were blocked
+        double costLimit = collapses[std::min(collapses.size() - 1, goal / 2)].cost * 1.5;
+        for(uint32_t i = 0; i < vertexCount; i++)
+            vertexRemap[i] = i;
+        for(uint32_t i = 0; i < wedges.size(); i++)
+            wedgeRemap[i] = i;
+        touched.assign(vertexCount, false);
+        size_t removedCount = 0, collapseCount = 0;
+        for(const Collapse &collapse : collapses)
+        {
+            if(removedCount >= goal || collapse.cost > costLimit)
+                break;
+            uint32_t from = collapse.from, to = collapse.to;
+            if(touched[from] || touched[to])
+                continue;
+            VectorF newPosition = positions[to];
+            bool flips = false;
+            size_t removedTriangles = 0;
+            for(uint32_t adjacencyIndex = adjacencyStart[from]; adjacencyIndex < adjacencyStart[from + 1] && !flips; adjacencyIndex++)
+            {
+                const IndexedTriangle &triangle = triangles[adjacency[adjacencyIndex]];
+                uint32_t v[verticesPerTriangle];
+                for(size_t j = 0; j < verticesPerTriangle; j++)
+                    v[j] = vertexRemap[wedgeVertices[triangle[j]]];
+                if(v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
+                    continue;
+                if(v[0] == to || v[1] == to || v[2] == to)
+                {
+                    removedTriangles++;
+                    continue;
+                }
+                VectorF p[verticesPerTriangle], newP[verticesPerTriangle];
+                for(size_t j = 0; j < verticesPerTriangle; j++)
+                {
+                    p[j] = positions[v[j]];
+                    newP[j] = v[j] == from ? newPosition : p[j];
+                }
+                VectorF oldNormal = cross(p[1] - p[0], p[2] - p[0]);
+                VectorF newNormal = cross(newP[1] - newP[0], newP[2] - newP[0]);
+                flips = dot(oldNormal, newNormal) <= 0;
+            }
+            if(flips)
+                continue;
+
+            // each wedge at from becomes the wedge at to on the same side of the collapsed edge
+            bool matched = true;
+            uint32_t firstWedge = ~(uint32_t)0;
+            for(uint32_t adjacencyIndex = adjacencyStart[from]; adjacencyIndex < adjacencyStart[from + 1]; adjacencyIndex++)
+            {
+                const IndexedTriangle &triangle = triangles[adjacency[adjacencyIndex]];
+                for(size_t j = 0; j < verticesPerTriangle; j++)
+                {
+                    if(wedgeVertices[triangle[j]] != from)
+                        continue;
+                    firstWedge = triangle[j];
+                    for(size_t k = 0; k < verticesPerTriangle; k++)
+                        if(wedgeVertices[triangle[k]] == to)
+                            wedgeRemap[triangle[j]] = triangle[k];
+                }
+            }
+            uint32_t wedge = firstWedge;
+            do
+            {
+                if(wedgeRemap[wedge] == wedge)
+                    matched = false;
+                wedge = nextWedge[wedge];
+            }
+            while(wedge != firstWedge);
+            if(!matched)
+            {
+                do
+                {
+                    wedgeRemap[wedge] = wedge;
+                    wedge = nextWedge[wedge];
+                }
+                while(wedge != firstWedge);
+                continue;
+            }
+            vertexRemap[from] = to;
+            quadrics[to] += quadrics[from];
+            touched[from] = touched[to] = true;
+            removedCount += removedTriangles;
+            collapseCount++;
+            maxError = std::max(maxError, collapse.cost);
+        }
+        if(collapseCount == 0)
+            break;
+
+        size_t newTriangleCount = 0;
+        for(const IndexedTriangle &triangle : triangles)
+        {
+            IndexedTriangle newTriangle;
+            for(size_t j = 0; j < verticesPerTriangle; j++)
+                newTriangle[j] = wedgeRemap[triangle[j]];
+            uint32_t v1 = wedgeVertices[newTriangle[0]], v2 = wedgeVertices[newTriangle[1]], v3 = wedgeVertices[newTriangle[2]];
+            if(v1 != v2 && v2 != v3 && v3 != v1)
+                triangles[newTriangleCount++] = newTriangle;
+        }
+        triangles.resize(newTriangleCount);
+        buildEdges();
+    }
+
+    if(errorOut != nullptr)
+        *errorOut = (float)std::sqrt(maxError);
+    vector<Triangle> retval;
+    retval.reserve(triangles.size());
+    for(const IndexedTriangle &triangle : triangles)
+        retval.push_back(Triangle(wedges[triangle[0]], wedges[triangle[1]], wedges[triangle[2]]));
+    return retval;
+}
+
+inline Mesh decimate(const Mesh &mesh, size_t targetTriangleCount, float *errorOut = nullptr)
+{
+    return Mesh(decimate(mesh.triangles, targetTriangleCount, errorOut), mesh.image);
+}
+
+/** decimated versions of a mesh for drawing it far away
+ *
+ * Only the decimated levels are kept, the mesh itself is level 0 and stays
+ * with whoever owns it. Each level has about reductionFactor times as many
+ * triangles as the one before, stopping at minTriangleCount or when the
+ * mesh can't be reduced any more. select() picks the coarsest level whose
+ * error still looks smaller than maxScreenError, as a fraction of the view
+ * height, from where the mesh is on screen.
+ */
+class LODSet final
+{
+public:
+    struct Level
+    {
+        Mesh mesh;
+        /// how far this level's surface can be from the original's
+        float error;
+    };
+private:
+    /// level i + 1
+    vector<Level> levels;
+    VectorF center = VectorF(0);
+    float radius = 0;
+public:
+    explicit LODSet(const Mesh &mesh, float reductionFactor = 0.25f, size_t minTriangleCount = 1000)
+    {
+        pair<VectorF, VectorF> extents = mesh.getExtents();
+        center = 0.5f * (get<0>(extents) + get<1>(extents));
+        for(const Triangle &tri : mesh.triangles)
+            radius = std::max(radius, std::sqrt(std::max(absSquared(tri.p1 - center), std::max(absSquared(tri.p2 - center), absSquared(tri.p3 - center)))));
+        const Mesh *previous = &mesh;
+        float previousError = 0;
+        while(previous->triangleCount() > minTriangleCount)
+        {
+            size_t target = std::max(minTriangleCount, (size_t)(previous->triangleCount() * reductionFactor));
+            float error;
+            Mesh decimated = decimate(*previous, target, &error);
+            // stop when most of what's left is locked in place
+            if(decimated.triangleCount() > previous->triangleCount() * (1 + reductionFactor) * 0.5f)
+                break;
+            levels.push_back(Level{std::move(decimated), previousError + error});
+            previous = &levels.back().mesh;
+            previousError = levels.back().error;
+        }
+    }
+    /// the decimated levels, starting at level 1
+    const vector<Level> &getLevels() const
+    {
+        return levels;
+    }
+    vector<Level> &getLevels()
+    {
+        return levels;
+    }
+    /// the error of the coarsest level, or 0 when there are no decimated levels
+    float getMaxError() const
+    {
+        if(levels.empty())
+            return 0;
+        return levels.back().error;
+    }
+    /// returns 0 for the mesh itself or i for getLevels()[i - 1]
+    size_t select(Transform localToCamera, float scaleY, float maxScreenError = 1.0f / 1000) const
+    {
+        VectorF cameraCenter = transform(localToCamera, center);
+        // the most the transform stretches any direction
+        VectorF origin = transform(localToCamera, VectorF(0));
+        float scale = std::sqrt(std::max(absSquared(transform(localToCamera, VectorF(1, 0, 0)) - origin),
+                                std::max(absSquared(transform(localToCamera, VectorF(0, 1, 0)) - origin),
+                                         absSquared(transform(localToCamera, VectorF(0, 0, 1)) - origin))));
+        float distance = abs(cameraCenter) - radius * scale;
+        if(distance <= 0)
+            return 0;
+        // the view is 2 * scaleY high at a distance of 1
+        float errorScale = scale / (distance * 2 * scaleY);
+        size_t level = 0;
+        while(level < levels.size() && levels[level].error * errorScale <= maxScreenError)
+            level++;
+        return level;
+    }
+};
+
+#endif // DECIMATE_H_INCLUDED
@@ -19,7 +19,10 @@
 #define GENERATE_H_INCLUDED
 
 #include "mesh.h"
+#include "arena.h"
 #include "image.h"
+#include "weld.h"
+#include "shade_batch.h"
 #include <utility>
 #include <functional>
 #include <tuple>
@@ -27,53 +30,184 @@
 #include <cwchar>
 #include <string>
 #include <cmath>
-#include <deque>
-#include <unordered_map>
 #include <array>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
 #include <list>
+#include <unordered_map>
+#include <memory>
 
 using namespace std;
 
 inline Mesh reverse(const Mesh & meshIn)
 {
-    vector<Triangle> triangles = meshIn.triangles;
-    for(Triangle & tri : triangles)
+    vector<Triangle> triangles;
+    appendMappedTriangles(triangles, meshIn.triangles, [](const Triangle & tri)->Triangle
     {
-        tri = reverse(tri);
-    }
+        return reverse(tri);
+    });
     return Mesh(std::move(triangles), meshIn.image);
 }
 
 inline Mesh reverse(Mesh && meshIn)
 {
     vector<Triangle> triangles = std::move(meshIn.triangles);
-    for(Triangle & tri : triangles)
+    mapTrianglesInPlace(triangles, [](const Triangle & tri)->Triangle
     {
-        tri = reverse(tri);
-    }
+        return reverse(tri);
+    });
     return Mesh(std::move(triangles), std::move(meshIn.image));
 }
 
+inline Mesh &reverse(FrameArena &arena, const Mesh &meshIn)
+{
+    Mesh &retval = arena.allocate(meshIn.image);
+    appendMappedTriangles(retval.triangles, meshIn.triangles, [](const Triangle & tri)->Triangle
+    {
+        return reverse(tri);
+    });
+    return retval;
+}
+
+/// shadeFn may be called from several render threads at once
 template <typename Fn>
-inline Mesh shadeMesh(const Mesh &meshIn, Fn shadeFn)
+inline Triangle shadeTriangle(Triangle tri, Fn &shadeFn)
 {
-    vector<Triangle> triangles;
-    triangles.reserve(meshIn.triangles.size());
+    if(tri.n1 == VectorF(0) || tri.n2 == VectorF(0) || tri.n3 == VectorF(0))
+    {
+        return tri;
+    }
 
-    for(Triangle tri : meshIn.triangles)
+    tri.c1 = shadeFn(tri.c1, tri.n1, tri.p1);
+    tri.c2 = shadeFn(tri.c2, tri.n2, tri.p2);
+    tri.c3 = shadeFn(tri.c3, tri.n3, tri.p3);
+    return tri;
+}
+
+namespace shade_internal
+{
+inline bool hasNormals(const Triangle &tri)
+{
+    return tri.n1 != VectorF(0) && tri.n2 != VectorF(0) && tri.n3 != VectorF(0);
+}
+
+inline void getCorner(const Triangle &tri, size_t corner, ColorF &color, VectorF &normal, VectorF &position)
+{
+    switch(corner)
     {
-        if(tri.n1 == VectorF(0) || tri.n2 == VectorF(0) || tri.n3 == VectorF(0))
-        {
-            triangles.push_back(tri);
+    case 0:
+        color = tri.c1;
+        normal = tri.n1;
+        position = tri.p1;
+        break;
+    case 1:
+        color = tri.c2;
+        normal = tri.n2;
+        position = tri.p2;
+        break;
+    default:
+        color = tri.c3;
+        normal = tri.n3;
+        position = tri.p3;
+        break;
+    }
+}
+
+inline ColorF &cornerColor(Triangle &tri, size_t corner)
+{
+    return corner == 0 ? tri.c1 : corner == 1 ? tri.c2 : tri.c3;
+}
+
+template <typename Fn, typename TransformCorner, typename SetColor>
+inline void shadeCorners(const Triangle *triangles, size_t start, size_t end, Fn &shadeFn, TransformCorner &transformCorner, SetColor &setColor, false_type)
+{
+    for(size_t i = start; i < end; i++)
+    {
+        if(!hasNormals(triangles[i]))
             continue;
+        for(size_t corner = 0; corner < 3; corner++)
+        {
+            ColorF color;
+            VectorF normal, position;
+            getCorner(triangles[i], corner, color, normal, position);
+            transformCorner(normal, position);
+            setColor(i, corner, shadeFn(color, normal, position));
         }
+    }
+}
 
-        tri.c1 = shadeFn(tri.c1, tri.n1, tri.p1);
-        tri.c2 = shadeFn(tri.c2, tri.n2, tri.p2);
-        tri.c3 = shadeFn(tri.c3, tri.n3, tri.p3);
-        triangles.push_back(tri);
+template <typename Fn, typename TransformCorner, typename SetColor>
+inline void shadeCorners(const Triangle *triangles, size_t start, size_t end, Fn &shadeFn, TransformCorner &transformCorner, SetColor &setColor, true_type)
+{
+    ShadeBatch batch;
+    size_t laneCorners[ShadeBatchSize];
+    auto flush = [&]()
+    {
+        batch.pad();
+        shadeFn.shadeBatch(batch);
+        for(size_t lane = 0; lane < batch.count; lane++)
+            setColor(laneCorners[lane] / 3, laneCorners[lane] % 3, batch.color.get(lane));
+        batch.count = 0;
+    };
+    for(size_t i = start; i < end; i++)
+    {
+        if(!hasNormals(triangles[i]))
+            continue;
+        for(size_t corner = 0; corner < 3; corner++)
+        {
+            ColorF color;
+            VectorF normal, position;
+            getCorner(triangles[i], corner, color, normal, position);
+            transformCorner(normal, position);
+            batch.color.set(batch.count, color);
+            batch.normal.set(batch.count, normal);
+            batch.position.set(batch.count, position);
+            laneCorners[batch.count++] = i * 3 + corner;
+            if(batch.count == ShadeBatchSize)
+                flush();
+        }
     }
+    if(batch.count > 0)
+        flush();
+}
+}
 
+/** shades the corners of triangles[start .. end) that have normals, like shadeTriangle()
+ *
+ * transformCorner(normal, position) moves each corner to where it's shaded
+ * and setColor(triangleIndex, corner, color) stores the result. Shading
+ * functions with a shadeBatch() member get the corners a ShadeBatch at a
+ * time instead of one at a time.
+ */
+template <typename Fn, typename TransformCorner, typename SetColor>
+inline void shadeTriangleCorners(const Triangle *triangles, size_t start, size_t end, Fn &shadeFn, TransformCorner transformCorner, SetColor setColor)
+{
+    shade_internal::shadeCorners(triangles, start, end, shadeFn, transformCorner, setColor, integral_constant<bool, HasShadeBatch<typename decay<Fn>::type>::value>());
+}
+
+/// dest and source can be the same
+template <typename Fn>
+inline void shadeTriangles(Triangle *dest, const Triangle *source, size_t count, Fn &shadeFn)
+{
+    parallelFor(count, parallelMeshGrainSize, [dest, source, &shadeFn](size_t start, size_t end)
+    {
+        if(dest != source)
+            std::copy(source + start, source + end, dest + start);
+        shadeTriangleCorners(source, start, end, shadeFn, [](VectorF &, VectorF &)
+        {
+        }, [dest](size_t triangleIndex, size_t corner, ColorF color)
+        {
+            shade_internal::cornerColor(dest[triangleIndex], corner) = color;
+        });
+    });
+}
+
+template <typename Fn>
+inline Mesh shadeMesh(const Mesh &meshIn, Fn shadeFn)
+{
+    vector<Triangle> triangles(meshIn.triangles.size());
+    shadeTriangles(triangles.data(), meshIn.triangles.data(), triangles.size(), shadeFn);
     return Mesh(std::move(triangles), meshIn.image);
 }
 
@@ -81,20 +215,60 @@ template <typename Fn>
 inline Mesh shadeMesh(Mesh &&meshIn, Fn shadeFn)
 {
     vector<Triangle> triangles = std::move(meshIn.triangles);
+    shadeTriangles(triangles.data(), triangles.data(), triangles.size(), shadeFn);
+    return Mesh(std::move(triangles), std::move(meshIn.image));
+}
 
-    for(Triangle &tri : triangles)
+template <typename Fn>
+inline Mesh &shadeMesh(FrameArena &arena, const Mesh &meshIn, Fn shadeFn)
+{
+    Mesh &retval = arena.allocate(meshIn.image);
+    retval.triangles.resize(meshIn.triangles.size());
+    shadeTriangles(retval.triangles.data(), meshIn.triangles.data(), meshIn.triangles.size(), shadeFn);
+    return retval;
+}
+
+/** transforms meshIn by shadeTransform, shades it and then applies outputTransform
+ *
+ * Does the same as
+ * <code>transform(outputTransform, shadeMesh(transform(shadeTransform, meshIn), shadeFn))</code>
+ * but reads every source triangle once and writes every result once, using
+ * concatenated matrices and normal matrices computed once per call.
+ */
+template <typename Fn>
+inline Mesh &transformShadeMesh(Mesh &dest, const Mesh &meshIn, Transform shadeTransform, Fn shadeFn, Transform outputTransform)
+{
+    assert(&dest != &meshIn);
+    Transform fullTransform = transform(outputTransform, shadeTransform);
+    const Matrix shadeMatrix = shadeTransform.get();
+    const Matrix fullMatrix = fullTransform.get();
+    const NormalTransform shadeNormalTransform(shadeTransform);
+    const NormalTransform fullNormalTransform(fullTransform);
+    dest.triangles.clear();
+    dest.image = meshIn.image;
+    dest.triangles.resize(meshIn.triangles.size());
+    Triangle *destTriangles = dest.triangles.data();
+    const Triangle *sourceTriangles = meshIn.triangles.data();
+    parallelFor(meshIn.triangles.size(), parallelMeshGrainSize, [&](size_t start, size_t end)
     {
-        if(tri.n1 == VectorF(0) || tri.n2 == VectorF(0) || tri.n3 == VectorF(0))
+        for(size_t i = start; i < end; i++)
+            destTriangles[i] = transform(fullMatrix, fullNormalTransform, sourceTriangles[i]);
+        shadeTriangleCorners(sourceTriangles, start, end, shadeFn, [&](VectorF &normal, VectorF &position)
         {
-            continue;
-        }
-
-        tri.c1 = shadeFn(tri.c1, tri.n1, tri.p1);
-        tri.c2 = shadeFn(tri.c2, tri.n2, tri.p2);
-        tri.c3 = shadeFn(tri.c3, tri.n3, tri.p3);
-    }
+            normal = transformNormal(shadeNormalTransform, normal);
+            position = shadeMatrix.apply(position);
+        }, [destTriangles](size_t triangleIndex, size_t corner, ColorF color)
+        {
+            shade_internal::cornerColor(destTriangles[triangleIndex], corner) = color;
+        });
+    });
+    return dest;
+}
 
-    return Mesh(std::move(triangles), std::move(meshIn.image));
+template <typename Fn>
+inline Mesh &transformShadeMesh(FrameArena &arena, const Mesh &meshIn, Transform shadeTransform, Fn shadeFn, Transform outputTransform)
+{
+    return transformShadeMesh(arena.allocate(), meshIn, shadeTransform, shadeFn, outputTransform);
 }
 
 struct CutMesh
@@ -109,33 +283,70 @@ struct CutMesh
     }
 };
 
+inline void cutTriangles(CutMesh &dest, const Triangle *triangles, size_t triangleCount, VectorF planeNormal, float planeD)
+{
+    for(size_t i = 0; i < triangleCount; i++)
+    {
+        CutTriangle ct = cut(triangles[i], planeNormal, planeD);
+        for(size_t j = 0; j < ct.frontTriangleCount; j++)
+            dest.front.append(ct.frontTriangles[j]);
+        for(size_t j = 0; j < ct.coplanarTriangleCount; j++)
+            dest.coplanar.append(ct.coplanarTriangles[j]);
+        for(size_t j = 0; j < ct.backTriangleCount; j++)
+            dest.back.append(ct.backTriangles[j]);
+    }
+}
+
 inline CutMesh cut(const Mesh &mesh, VectorF planeNormal, float planeD)
 {
-    Mesh front, coplanar, back;
-    front.reserve(mesh.triangleCount() * 2);
-    coplanar.reserve(mesh.triangleCount() * 2);
-    back.reserve(mesh.triangleCount() * 2);
-    front.image = mesh.image;
-    coplanar.image = mesh.image;
-    back.image = mesh.image;
-    for(Triangle tri : mesh.triangles)
+    CutMesh retval;
+    retval.front.image = mesh.image;
+    retval.coplanar.image = mesh.image;
+    retval.back.image = mesh.image;
+    size_t triangleCount = mesh.triangleCount();
+    if(triangleCount <= parallelMeshGrainSize)
     {
-        CutTriangle ct = cut(tri, planeNormal, planeD);
-        for(size_t i = 0; i < ct.frontTriangleCount; i++)
-            front.append(ct.frontTriangles[i]);
-        for(size_t i = 0; i < ct.coplanarTriangleCount; i++)
-            coplanar.append(ct.coplanarTriangles[i]);
-        for(size_t i = 0; i < ct.backTriangleCount; i++)
-            back.append(ct.backTriangles[i]);
+        retval.front.reserve(triangleCount * 2);
+        retval.coplanar.reserve(triangleCount * 2);
+        retval.back.reserve(triangleCount * 2);
+        cutTriangles(retval, mesh.triangles.data(), triangleCount, planeNormal, planeD);
+        return retval;
+    }
+    // cut each range into its own parts then join them in order so the output
+    // doesn't depend on which thread finished first
+    vector<CutMesh> parts((triangleCount + parallelMeshGrainSize - 1) / parallelMeshGrainSize);
+    parallelFor(triangleCount, parallelMeshGrainSize, [&](size_t start, size_t end)
+    {
+        CutMesh &part = parts[start / parallelMeshGrainSize];
+        part.front.reserve((end - start) * 2);
+        part.coplanar.reserve((end - start) * 2);
+        part.back.reserve((end - start) * 2);
+        cutTriangles(part, &mesh.triangles[start], end - start, planeNormal, planeD);
+    });
+    size_t frontSize = 0, coplanarSize = 0, backSize = 0;
+    for(const CutMesh &part : parts)
+    {
+        frontSize += part.front.triangleCount();
+        coplanarSize += part.coplanar.triangleCount();
+        backSize += part.back.triangleCount();
+    }
+    retval.front.reserve(frontSize);
+    retval.coplanar.reserve(coplanarSize);
+    retval.back.reserve(backSize);
+    for(const CutMesh &part : parts)
+    {
+        retval.front.append(part.front);
+        retval.coplanar.append(part.coplanar);
+        retval.back.append(part.back);
     }
-    return CutMesh(std::move(front), std::move(coplanar), std::move(back));
+    return retval;
 }
 
 inline Mesh cutAndGetFront(Mesh mesh, VectorF planeNormal, float planeD)
 {
     static thread_local vector<Triangle> triangles;
-    triangles = std::move(mesh.triangles);
-    mesh.triangles.clear();
+    triangles.clear();
+    triangles.swap(mesh.triangles); // swap so neither buffer loses its capacity
     mesh.reserve(triangles.size());
     for(Triangle tri : triangles)
     {
@@ -151,8 +362,8 @@ inline Mesh cutAndGetFront(Mesh mesh, VectorF planeNormal, float planeD)
 inline Mesh cutAndGetBack(Mesh mesh, VectorF planeNormal, float planeD)
 {
     static thread_local vector<Triangle> triangles;
-    triangles = std::move(mesh.triangles);
-    mesh.triangles.clear();
+    triangles.clear();
+    triangles.swap(mesh.triangles);
     mesh.reserve(triangles.size());
     for(Triangle tri : triangles)
     {
@@ -165,64 +376,264 @@ inline Mesh cutAndGetBack(Mesh mesh, VectorF planeNormal, float planeD)
     return std::move(mesh);
 }
 
-constexpr const float simplifyDefaultEps = 1e-6;
+/// up to MaxCount planes to clip to, keeping the side where dot(p, normal) + d >= 0 for all of them
+struct ClipPlanes final
+{
+    static constexpr size_t MaxCount = 8;
+    VectorF normals[MaxCount];
+    float d[MaxCount];
+    size_t count = 0;
+    ClipPlanes()
+    {
+    }
+    ClipPlanes(VectorF normal, float planeD)
+    {
+        add(normal, planeD);
+    }
+    ClipPlanes &add(VectorF normal, float planeD)
+    {
+        assert(count < MaxCount);
+        normals[count] = normal;
+        d[count++] = planeD;
+        return *this;
+    }
+    /// the inside of the box from minP to maxP
+    static ClipPlanes box(VectorF minP, VectorF maxP)
+    {
+        ClipPlanes retval;
+        retval.add(VectorF(1, 0, 0), -minP.x).add(VectorF(-1, 0, 0), maxP.x);
+        retval.add(VectorF(0, 1, 0), -minP.y).add(VectorF(0, -1, 0), maxP.y);
+        retval.add(VectorF(0, 0, 1), -minP.z).add(VectorF(0, 0, -1), maxP.z);
+        return retval;
+    }
+};
 
-inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNormalEps = simplifyDefaultEps, float distanceEps = simplifyDefaultEps, float vertexNormalEps = simplifyDefaultEps, float vertexTextureEps = simplifyDefaultEps, float vertexColorEps = simplifyDefaultEps)
+/** appends what's in front of all the planes, like calling cutAndGetFront() for each plane
+ *
+ * Each triangle is clipped to all the planes it crosses as one polygon on
+ * the stack, so only the final pieces are written out. Triangles that don't
+ * cross any plane are copied as they are.
+ */
+inline void clipTriangles(vector<Triangle> &dest, const Triangle *triangles, size_t triangleCount, const ClipPlanes &planes)
 {
-    vector<Vertex> vertexList;
-    unordered_map<Vertex, size_t> vertexMap;
-    constexpr size_t verticesPerTriangle = 3;
-    typedef tuple<array<size_t, verticesPerTriangle>, VectorF> SimpTriangle;
-    typedef list<SimpTriangle> STList;
-    vector<vector<STList::iterator>> trianglesMap;
-    STList triangles;
-    deque<STList::iterator> changedQueue;
-    for(Triangle tri : meshTriangles)
-    {
-        STList::iterator triangleIter = triangles.insert(triangles.end(), SimpTriangle());
-        changedQueue.push_back(triangleIter);
-        SimpTriangle &triangle = triangles.back();
-        array<Vertex, verticesPerTriangle> vertices = {tri.v1(), tri.v2(), tri.v3()};
-        for(size_t i = 0; i < verticesPerTriangle; i++)
-        {
-            Vertex vertex = vertices[i];
-            size_t vertexIndex;
+    constexpr size_t MaxPolygonSize = 3 + ClipPlanes::MaxCount;
+    for(size_t triangleIndex = 0; triangleIndex < triangleCount; triangleIndex++)
+    {
+        const Triangle &tri = triangles[triangleIndex];
+        unsigned crossedPlanes = 0;
+        bool outside = false;
+        for(size_t plane = 0; plane < planes.count && !outside; plane++)
+        {
+            float d1 = dot(tri.p1, planes.normals[plane]) + planes.d[plane];
+            float d2 = dot(tri.p2, planes.normals[plane]) + planes.d[plane];
+            float d3 = dot(tri.p3, planes.normals[plane]) + planes.d[plane];
+            bool anyFront = d1 > eps || d2 > eps || d3 > eps;
+            bool anyBack = d1 < -eps || d2 < -eps || d3 < -eps;
+            // a triangle touching the plane from behind is dropped, as in CutTriangle
+            outside = anyBack && !anyFront;
+            if(anyBack && anyFront)
+                crossedPlanes |= 1U << plane;
+        }
+        if(outside)
+            continue;
+        if(crossedPlanes == 0)
+        {
+            dest.push_back(tri);
+            continue;
+        }
+        Vertex buffers[2][MaxPolygonSize];
+        Vertex *polygon = buffers[0], *clipped = buffers[1];
+        polygon[0] = tri.v1();
+        polygon[1] = tri.v2();
+        polygon[2] = tri.v3();
+        size_t vertexCount = 3;
+        for(size_t plane = 0; plane < planes.count && vertexCount >= 3; plane++)
+        {
+            if((crossedPlanes & (1U << plane)) == 0)
+                continue;
+            VectorF normal = planes.normals[plane];
+            float planeD = planes.d[plane];
+            float distances[MaxPolygonSize];
+            bool anyFront = false, anyBack = false;
+            for(size_t i = 0; i < vertexCount; i++)
             {
-                auto iter = vertexMap.find(vertex);
-                if(iter == vertexMap.end())
-                {
-                    vertexIndex = vertexList.size();
-                    vertexMap[vertex] = vertexList.size();
-                    vertexList.push_back(vertex);
-                    trianglesMap.push_back(vector<STList::iterator>{triangleIter});
-                }
-                else
+                distances[i] = dot(polygon[i].p, normal) + planeD;
+                anyFront = anyFront || distances[i] > eps;
+                anyBack = anyBack || distances[i] < -eps;
+            }
+            if(!anyBack)
+                continue;
+            if(!anyFront)
+            {
+                vertexCount = 0;
+                break;
+            }
+            size_t clippedCount = 0;
+            for(size_t i = 0, j = 1; i < vertexCount; i++, j++, j %= vertexCount)
+            {
+                bool isFrontI = distances[i] >= -eps, isFrontJ = distances[j] >= -eps;
+                if(isFrontI && clippedCount < MaxPolygonSize)
+                    clipped[clippedCount++] = polygon[i];
+                if(isFrontI != isFrontJ && clippedCount < MaxPolygonSize)
                 {
-                    vertexIndex = std::get<1>(*iter);
-                    trianglesMap[vertexIndex].push_back(triangleIter);
+                    float divisor = dot(polygon[j].p - polygon[i].p, normal);
+                    if(abs(divisor) >= eps * eps)
+                        clipped[clippedCount++] = interpolate(-distances[i] / divisor, polygon[i], polygon[j]);
                 }
             }
-            std::get<0>(triangle)[i] = vertexIndex;
+            std::swap(polygon, clipped);
+            vertexCount = clippedCount;
         }
-        std::get<1>(triangle) = tri.normal();
+        for(size_t j = 1, k = 2; k < vertexCount; j++, k++)
+            dest.push_back(Triangle(polygon[0], polygon[j], polygon[k]));
+    }
+}
+
+/// clips meshIn into dest, splitting the work across the render threads
+inline Mesh &clip(Mesh &dest, const Mesh &meshIn, const ClipPlanes &planes)
+{
+    assert(&dest != &meshIn);
+    dest.triangles.clear();
+    dest.image = meshIn.image;
+    size_t triangleCount = meshIn.triangleCount();
+    if(triangleCount <= parallelMeshGrainSize)
+    {
+        clipTriangles(dest.triangles, meshIn.triangles.data(), triangleCount, planes);
+        return dest;
     }
-    while(!changedQueue.empty())
+    // clip each range into its own part then join them in order, keeping the parts between calls so they stop allocating
+    static thread_local vector<vector<Triangle>> parts;
+    size_t partCount = (triangleCount + parallelMeshGrainSize - 1) / parallelMeshGrainSize;
+    if(parts.size() < partCount)
+        parts.resize(partCount);
+    vector<Triangle> *pParts = parts.data();
+    parallelFor(triangleCount, parallelMeshGrainSize, [&](size_t start, size_t end)
     {
-        STList::iterator triangleIter = changedQueue.front();
-        changedQueue.pop_front();
-        if(std::get<1>(*triangleIter) == VectorF(0))
+        vector<Triangle> &part = pParts[start / parallelMeshGrainSize];
+        part.clear();
+        clipTriangles(part, &meshIn.triangles[start], end - start, planes);
+    });
+    size_t totalSize = 0;
+    for(size_t i = 0; i < partCount; i++)
+        totalSize += parts[i].size();
+    dest.triangles.reserve(totalSize);
+    for(size_t i = 0; i < partCount; i++)
+        dest.triangles.insert(dest.triangles.end(), parts[i].begin(), parts[i].end());
+    return dest;
+}
+
+inline Mesh &clip(FrameArena &arena, const Mesh &meshIn, const ClipPlanes &planes)
+{
+    return clip(arena.allocate(), meshIn, planes);
+}
+
+inline Mesh clip(const Mesh &meshIn, const ClipPlanes &planes)
+{
+    Mesh retval;
+    clip(retval, meshIn, planes);
+    return retval;
+}
+
+constexpr const float simplifyDefaultEps = 1e-6;
+
+namespace simplify_internal
+{
+constexpr size_t verticesPerTriangle = 3;
+
+/// kept between calls so simplify() stops allocating once these have grown to fit
+struct Scratch
+{
+    vector<Vertex> corners;
+    vector<uint32_t> cornerVertices;
+    vector<Vertex> vertices;
+    vector<array<uint32_t, verticesPerTriangle>> triangles;
+    vector<VectorF> normals;
+    vector<bool> deleted;
+    vector<uint32_t> adjacencyStart;
+    vector<uint32_t> adjacency;
+    vector<uint32_t> changedQueue;
+};
+}
+
+inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNormalEps = simplifyDefaultEps, float distanceEps = simplifyDefaultEps, float vertexNormalEps = simplifyDefaultEps, float vertexTextureEps = simplifyDefaultEps, float vertexColorEps = simplifyDefaultEps)
+{
+    using namespace simplify_internal;
+    static thread_local Scratch scratch;
+    size_t triangleCount = meshTriangles.size();
+    assert(triangleCount * verticesPerTriangle <= 0xFFFFFFFFU);
+    vector<Vertex> &corners = scratch.corners;
+    vector<uint32_t> &cornerVertices = scratch.cornerVertices;
+    vector<Vertex> &vertices = scratch.vertices;
+    vector<array<uint32_t, verticesPerTriangle>> &triangles = scratch.triangles;
+    vector<VectorF> &normals = scratch.normals;
+    vector<bool> &deleted = scratch.deleted;
+    vector<uint32_t> &adjacencyStart = scratch.adjacencyStart;
+    vector<uint32_t> &adjacency = scratch.adjacency;
+    vector<uint32_t> &changedQueue = scratch.changedQueue;
+    corners.clear();
+    normals.clear();
+    deleted.clear();
+    for(const Triangle &tri : meshTriangles)
+    {
+        corners.push_back(tri.v1());
+        corners.push_back(tri.v2());
+        corners.push_back(tri.v3());
+        normals.push_back(tri.normal());
+        // degenerate triangles have no normal and are dropped
+        deleted.push_back(normals.back() == VectorF(0));
+    }
+
+    // weld vertices that are within the tolerances, so vertices made by cutting that are off by rounding are still shared
+    vertices = weldVertices(corners, WeldTolerance(distanceEps, vertexTextureEps, vertexColorEps, vertexNormalEps), cornerVertices);
+    triangles.resize(triangleCount);
+    for(size_t i = 0; i < triangleCount; i++)
+    {
+        for(size_t j = 0; j < verticesPerTriangle; j++)
+            triangles[i][j] = cornerVertices[i * verticesPerTriangle + j];
+        if(triangles[i][0] == triangles[i][1] || triangles[i][1] == triangles[i][2] || triangles[i][2] == triangles[i][0])
+            deleted[i] = true;
+    }
+
+    // the triangles using each vertex, in order, as compressed rows
+    adjacencyStart.assign(vertices.size() + 1, 0);
+    for(const array<uint32_t, verticesPerTriangle> &triangle : triangles)
+        for(uint32_t vertex : triangle)
+            adjacencyStart[vertex + 1]++;
+    for(size_t i = 1; i < adjacencyStart.size(); i++)
+        adjacencyStart[i] += adjacencyStart[i - 1];
+    adjacency.resize(adjacencyStart.back());
+    for(size_t i = 0; i < triangleCount; i++)
+        for(uint32_t vertex : triangles[i])
+            adjacency[adjacencyStart[vertex]++] = (uint32_t)i;
+    for(size_t i = adjacencyStart.size() - 1; i > 0; i--)
+        adjacencyStart[i] = adjacencyStart[i - 1];
+    adjacencyStart[0] = 0;
+
+    // every merge deletes a triangle, so the queue never holds more than twice the triangle count
+    changedQueue.clear();
+    changedQueue.reserve(2 * triangleCount);
+    for(size_t i = 0; i < triangleCount; i++)
+        changedQueue.push_back((uint32_t)i);
+    for(size_t queueHead = 0; queueHead < changedQueue.size(); queueHead++)
+    {
+        uint32_t triangleIndex = changedQueue[queueHead];
+        if(deleted[triangleIndex])
             continue;
+        array<uint32_t, verticesPerTriangle> &triangle = triangles[triangleIndex];
         bool done = false;
-        for(size_t i = 0; i < verticesPerTriangle; i++)
+        for(size_t i = 0; i < verticesPerTriangle && !done; i++)
         {
-            for(STList::iterator secondTriangle : trianglesMap[std::get<0>(*triangleIter)[i]])
+            uint32_t vertex = triangle[i];
+            for(uint32_t adjacencyIndex = adjacencyStart[vertex]; adjacencyIndex < adjacencyStart[vertex + 1]; adjacencyIndex++)
             {
-                if(secondTriangle == triangleIter)
+                uint32_t secondTriangleIndex = adjacency[adjacencyIndex];
+                if(secondTriangleIndex == triangleIndex)
                     continue;
-                if(std::get<1>(*secondTriangle) == VectorF(0))
+                if(deleted[secondTriangleIndex])
                     continue;
-                if(absSquared(std::get<1>(*triangleIter) - std::get<1>(*secondTriangle)) > faceNormalEps * faceNormalEps)
+                if(absSquared(normals[triangleIndex] - normals[secondTriangleIndex]) > faceNormalEps * faceNormalEps)
                     continue;
+                const array<uint32_t, verticesPerTriangle> &secondTriangle = triangles[secondTriangleIndex];
                 array<int, verticesPerTriangle> matchIndices;
                 array<bool, verticesPerTriangle> used;
                 for(bool &v : used)
@@ -233,7 +644,7 @@ inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNorma
                     matchIndices[j] = -1;
                     for(size_t k = 0; k < verticesPerTriangle; k++)
                     {
-                        if(std::get<0>(*triangleIter)[j] == std::get<0>(*secondTriangle)[k])
+                        if(triangle[j] == secondTriangle[k])
                         {
                             matchIndices[j] = k;
                             used[k] = true;
@@ -244,8 +655,9 @@ inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNorma
                 }
                 if(matchCount >= 3)
                 {
-                    std::get<1>(*triangleIter) = VectorF(0); // delete duplicates
-                    continue;
+                    deleted[triangleIndex] = true; // delete duplicates
+                    done = true;
+                    break;
                 }
                 if(matchCount < 2)
                     continue;
@@ -266,16 +678,16 @@ inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNorma
                         break;
                     }
                 }
-                array<size_t, verticesPerTriangle> tri1, tri2;
+                array<uint32_t, verticesPerTriangle> tri1, tri2;
                 for(size_t j = 0, k = firstTriangleNonTouchingIndex; j < verticesPerTriangle; j++, k = (k >= verticesPerTriangle - 1 ? k + 1 - verticesPerTriangle : k + 1))
                 {
-                    tri1[j] = std::get<0>(*triangleIter)[k];
+                    tri1[j] = triangle[k];
                 }
                 for(size_t j = 0, k = secondTriangleNonTouchingIndex; j < verticesPerTriangle; j++, k = (k >= verticesPerTriangle - 1 ? k + 1 - verticesPerTriangle : k + 1))
                 {
-                    tri2[j] = std::get<0>(*secondTriangle)[k];
+                    tri2[j] = secondTriangle[k];
                 }
-                Vertex lineStartVertex = vertexList[tri1[0]], lineEndVertex = vertexList[tri2[0]];
+                const Vertex &lineStartVertex = vertices[tri1[0]], &lineEndVertex = vertices[tri2[0]];
                 VectorF deltaPosition = lineEndVertex.p - lineStartVertex.p;
                 float planeD = -dot(deltaPosition, lineStartVertex.p);
                 if(absSquared(deltaPosition) < distanceEps * distanceEps)
@@ -283,7 +695,7 @@ inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNorma
                 size_t removeVertex = 0;
                 for(size_t j = 1; j < verticesPerTriangle; j++)
                 {
-                    Vertex middleVertex = vertexList[tri1[j]];
+                    const Vertex &middleVertex = vertices[tri1[j]];
                     float t = (dot(middleVertex.p, deltaPosition) + planeD) / absSquared(deltaPosition);
                     Vertex calculatedMiddleVertex = interpolate(t, lineStartVertex, lineEndVertex);
                     if(absSquared(calculatedMiddleVertex.p - middleVertex.p) > distanceEps * distanceEps)
@@ -307,33 +719,31 @@ inline vector<Triangle> simplify(vector<Triangle> meshTriangles, float faceNorma
                 }
                 if(removeVertex == 0)
                     continue;
-                std::get<1>(*secondTriangle) = VectorF(0); // remove second triangle
+                deleted[secondTriangleIndex] = true; // remove second triangle
                 if(removeVertex == 1)
                 {
-                    std::get<0>(*triangleIter)[0] = tri1[0];
-                    std::get<0>(*triangleIter)[1] = tri2[0];
-                    std::get<0>(*triangleIter)[2] = tri1[2];
+                    triangle[0] = tri1[0];
+                    triangle[1] = tri2[0];
+                    triangle[2] = tri1[2];
                 }
                 else
                 {
-                    std::get<0>(*triangleIter)[0] = tri1[0];
-                    std::get<0>(*triangleIter)[1] = tri1[1];
-                    std::get<0>(*triangleIter)[2] = tri2[0];
+                    triangle[0] = tri1[0];
+                    triangle[1] = tri1[1];
+                    triangle[2] = tri2[0];
                 }
-                changedQueue.push_back(triangleIter);
+                changedQueue.push_back(triangleIndex);
                 done = true;
                 break;
             }
-            if(done)
-                break;
         }
     }
     meshTriangles.clear();
-    for(const SimpTriangle &triangle : triangles)
+    for(size_t i = 0; i < triangleCount; i++)
     {
-        if(std::get<1>(triangle) == VectorF(0))
+        if(deleted[i])
             continue;
-        meshTriangles.push_back(Triangle(vertexList[std::get<0>(triangle)[0]], vertexList[std::get<0>(triangle)[1]], vertexList[std::get<0>(triangle)[2]]));
+        meshTriangles.push_back(Triangle(vertices[triangles[i][0]], vertices[triangles[i][1]], vertices[triangles[i][2]]));
     }
     return std::move(meshTriangles);
 }
@@ -344,6 +754,132 @@ inline Mesh simplify(Mesh mesh, float faceNormalEps = simplifyDefaultEps, float
     return std::move(mesh);
 }
 
+enum class TriangleOrder
+{
+    Morton,
+    Hilbert
+};
+
+inline uint32_t spreadMortonBits(uint32_t v)
+{
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/// x, y and z are 10 bits each
+inline uint32_t mortonIndex(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (spreadMortonBits(x) << 2) | (spreadMortonBits(y) << 1) | spreadMortonBits(z);
+}
+
+/// x, y and z are 10 bits each; uses Skilling's transposed Hilbert index
+inline uint32_t hilbertIndex(uint32_t x, uint32_t y, uint32_t z)
+{
+    constexpr int bits = 10;
+    uint32_t axes[3] = {x, y, z};
+    for(uint32_t q = 1 << (bits - 1); q > 1; q >>= 1)
+    {
+        uint32_t p = q - 1;
+        for(int i = 0; i < 3; i++)
+        {
+            if(axes[i] & q)
+                axes[0] ^= p;
+            else
+            {
+                uint32_t t = (axes[0] ^ axes[i]) & p;
+                axes[0] ^= t;
+                axes[i] ^= t;
+            }
+        }
+    }
+    axes[1] ^= axes[0];
+    axes[2] ^= axes[1];
+    uint32_t t = 0;
+    for(uint32_t q = 1 << (bits - 1); q > 1; q >>= 1)
+    {
+        if(axes[2] & q)
+            t ^= q - 1;
+    }
+    uint32_t retval = 0;
+    for(int bit = bits - 1; bit >= 0; bit--)
+    {
+        for(int i = 0; i < 3; i++)
+            retval = (retval << 1) | (((axes[i] ^ t) >> bit) & 1);
+    }
+    return retval;
+}
+
+/** sorts triangles along a space-filling curve through their centroids
+ *
+ * Triangles that are next to each other in space end up next to each other
+ * in the list, so the renderer touches the same parts of the z-buffer and
+ * image while drawing consecutive triangles. With groupByNormal set the
+ * triangles are first split into six groups by the dominant axis of their
+ * face normal, so that triangles facing the same way (and so mostly
+ * occluding or occluded together) are drawn together.
+ */
+inline vector<Triangle> reorderTriangles(vector<Triangle> triangles, TriangleOrder order = TriangleOrder::Hilbert, bool groupByNormal = false)
+{
+    if(triangles.size() < 2)
+        return std::move(triangles);
+    VectorF minP = (triangles[0].p1 + triangles[0].p2 + triangles[0].p3) / 3, maxP = minP;
+    for(const Triangle &tri : triangles)
+    {
+        VectorF centroid = (tri.p1 + tri.p2 + tri.p3) / 3;
+        minP.x = min(minP.x, centroid.x);
+        minP.y = min(minP.y, centroid.y);
+        minP.z = min(minP.z, centroid.z);
+        maxP.x = max(maxP.x, centroid.x);
+        maxP.y = max(maxP.y, centroid.y);
+        maxP.z = max(maxP.z, centroid.z);
+    }
+    VectorF scale = maxP - minP;
+    scale.x = (scale.x > eps ? 1023 / scale.x : 0);
+    scale.y = (scale.y > eps ? 1023 / scale.y : 0);
+    scale.z = (scale.z > eps ? 1023 / scale.z : 0);
+    vector<pair<uint64_t, size_t>> keys;
+    keys.reserve(triangles.size());
+    for(size_t i = 0; i < triangles.size(); i++)
+    {
+        const Triangle &tri = triangles[i];
+        VectorF centroid = (tri.p1 + tri.p2 + tri.p3) / 3;
+        uint32_t x = limit<uint32_t>((uint32_t)((centroid.x - minP.x) * scale.x), 0, 1023);
+        uint32_t y = limit<uint32_t>((uint32_t)((centroid.y - minP.y) * scale.y), 0, 1023);
+        uint32_t z = limit<uint32_t>((uint32_t)((centroid.z - minP.z) * scale.z), 0, 1023);
+        uint64_t key = (order == TriangleOrder::Morton ? mortonIndex(x, y, z) : hilbertIndex(x, y, z));
+        if(groupByNormal)
+        {
+            VectorF n = tri.point_cross();
+            uint32_t group;
+            if(std::fabs(n.x) >= std::fabs(n.y) && std::fabs(n.x) >= std::fabs(n.z))
+                group = (n.x < 0 ? 0 : 1);
+            else if(std::fabs(n.y) >= std::fabs(n.z))
+                group = (n.y < 0 ? 2 : 3);
+            else
+                group = (n.z < 0 ? 4 : 5);
+            // the curve index takes the low 30 bits
+            key |= (uint64_t)group << 30;
+        }
+        keys.push_back(make_pair(key, i));
+    }
+    sort(keys.begin(), keys.end());
+    vector<Triangle> retval;
+    retval.reserve(triangles.size());
+    for(const pair<uint64_t, size_t> &key : keys)
+        retval.push_back(triangles[key.second]);
+    return retval;
+}
+
+inline Mesh reorderTriangles(Mesh mesh, TriangleOrder order = TriangleOrder::Hilbert, bool groupByNormal = false)
+{
+    mesh.triangles = reorderTriangles(std::move(mesh.triangles), order, groupByNormal);
+    return std::move(mesh);
+}
+
 namespace Generate
 {
 	inline Mesh quadrilateral(TextureDescriptor texture, VectorF p1, ColorF c1, VectorF p2, ColorF c2, VectorF p3, ColorF c3, VectorF p4, ColorF c4)
@@ -355,6 +891,21 @@ namespace Generate
 		return Mesh(vector<Triangle>{Triangle(p1, c1, t1, p2, c2, t2, p3, c3, t3), Triangle(p3, c3, t3, p4, c4, t4, p1, c1, t1)}, texture.image);
 	}
 
+	/// appends to dest instead of building a new Mesh
+	inline Mesh &quadrilateral(Mesh &dest, const TextureDescriptor &texture, VectorF p1, ColorF c1, VectorF p2, ColorF c2, VectorF p3, ColorF c3, VectorF p4, ColorF c4)
+	{
+		assert(texture.image == nullptr || dest.image == nullptr || dest.image == texture.image);
+		if(texture.image != nullptr)
+            dest.image = texture.image;
+		const TextureCoord t1 = TextureCoord(texture.minU, texture.minV);
+		const TextureCoord t2 = TextureCoord(texture.maxU, texture.minV);
+		const TextureCoord t3 = TextureCoord(texture.maxU, texture.maxV);
+		const TextureCoord t4 = TextureCoord(texture.minU, texture.maxV);
+		dest.append(Triangle(p1, c1, t1, p2, c2, t2, p3, c3, t3));
+		dest.append(Triangle(p3, c3, t3, p4, c4, t4, p1, c1, t1));
+		return dest;
+	}
+
 	inline Mesh convexPolygon(shared_ptr<Texture> texture, const vector<tuple<VectorF, ColorF, TextureCoord, VectorF>> &vertices)
 	{
 	    if(vertices.size() < 3)
@@ -421,8 +972,22 @@ namespace Generate
         return Mesh(std::move(triangles), texture);
 	}
 
-	/// make a box from <0, 0, 0> to <1, 1, 1>
-	inline Mesh unitBox(TextureDescriptor nx, TextureDescriptor px, TextureDescriptor ny, TextureDescriptor py, TextureDescriptor nz, TextureDescriptor pz)
+	/// appends to dest instead of building a new Mesh
+	inline Mesh &convexPolygon(Mesh &dest, const vector<Vertex> &vertices)
+	{
+	    if(vertices.size() < 3)
+            return dest;
+        dest.reserve(dest.triangleCount() + vertices.size() - 2);
+        Vertex v1 = vertices[0];
+        for(size_t i = 1, j = 2; j < vertices.size(); i++, j++)
+        {
+            dest.append(Triangle(v1, vertices[i], vertices[j]));
+        }
+        return dest;
+	}
+
+	/// appends a box from <0, 0, 0> to <1, 1, 1> to dest
+	inline Mesh &unitBox(Mesh &dest, const TextureDescriptor &nx, const TextureDescriptor &px, const TextureDescriptor &ny, const TextureDescriptor &py, const TextureDescriptor &nz, const TextureDescriptor &pz)
 	{
 		const VectorF p0 = VectorF(0, 0, 0);
 		const VectorF p1 = VectorF(1, 0, 0);
@@ -432,62 +997,69 @@ namespace Generate
 		const VectorF p5 = VectorF(1, 0, 1);
 		const VectorF p6 = VectorF(0, 1, 1);
 		const VectorF p7 = VectorF(1, 1, 1);
-		Mesh retval;
 		const ColorF c = RGBAF(1, 1, 1, 1);
 		if(nx)
 		{
-			retval.append(quadrilateral(nx,
+			quadrilateral(dest, nx,
 									 p0, c,
 									 p4, c,
 									 p6, c,
 									 p2, c
-									 ));
+									 );
 		}
 		if(px)
 		{
-			retval.append(quadrilateral(px,
+			quadrilateral(dest, px,
 									 p5, c,
 									 p1, c,
 									 p3, c,
 									 p7, c
-									 ));
+									 );
 		}
 		if(ny)
 		{
-			retval.append(quadrilateral(ny,
+			quadrilateral(dest, ny,
 									 p0, c,
 									 p1, c,
 									 p5, c,
 									 p4, c
-									 ));
+									 );
 		}
 		if(py)
 		{
-			retval.append(quadrilateral(py,
+			quadrilateral(dest, py,
 									 p6, c,
 									 p7, c,
 									 p3, c,
 									 p2, c
-									 ));
+									 );
 		}
 		if(nz)
 		{
-			retval.append(quadrilateral(nz,
+			quadrilateral(dest, nz,
 									 p1, c,
 									 p0, c,
 									 p2, c,
 									 p3, c
-									 ));
+									 );
 		}
 		if(pz)
 		{
-			retval.append(quadrilateral(pz,
+			quadrilateral(dest, pz,
 									 p4, c,
 									 p5, c,
 									 p7, c,
 									 p6, c
-									 ));
+									 );
 		}
+		return dest;
+	}
+
+	/// make a box from <0, 0, 0> to <1, 1, 1>
+	inline Mesh unitBox(TextureDescriptor nx, TextureDescriptor px, TextureDescriptor ny, TextureDescriptor py, TextureDescriptor nz, TextureDescriptor pz)
+	{
+		Mesh retval;
+		unitBox(retval, nx, px, ny, py, nz, pz);
 		return std::move(retval);
 	}
 
@@ -496,6 +1068,78 @@ namespace Generate
         float tabWidth = 8;
     };
 
+    /** the quads of a font's characters, looked up once and then copied into place for each character drawn
+     *
+     * The table isn't locked, so get() keeps one per thread.
+     */
+    class GlyphTable final
+    {
+        shared_ptr<Texture> fontTexture;
+        static constexpr unsigned AsciiCount = 0x80;
+        /// the quad for each character from <0, 0, 0> to <1, 1, 0>
+        Triangle asciiGlyphs[AsciiCount][2];
+        unordered_map<unsigned, array<Triangle, 2>> otherGlyphs;
+        static void makeGlyph(Triangle (&glyph)[2], unsigned ch, const shared_ptr<Texture> &fontTexture)
+        {
+            Mesh quad = quadrilateral(getTextFontCharacterTextureDescriptor(ch, fontTexture),
+                                      VectorF(0, 0, 0), GrayscaleF(1),
+                                      VectorF(1, 0, 0), GrayscaleF(1),
+                                      VectorF(1, 1, 0), GrayscaleF(1),
+                                      VectorF(0, 1, 0), GrayscaleF(1));
+            glyph[0] = quad.triangles[0];
+            glyph[1] = quad.triangles[1];
+        }
+    public:
+        explicit GlyphTable(shared_ptr<Texture> fontTexture)
+            : fontTexture(fontTexture)
+        {
+            for(unsigned ch = 0; ch < AsciiCount; ch++)
+                makeGlyph(asciiGlyphs[ch], ch, fontTexture);
+        }
+        const shared_ptr<Texture> &font() const
+        {
+            return fontTexture;
+        }
+        const Triangle *glyph(unsigned ch)
+        {
+            if(ch < AsciiCount)
+                return asciiGlyphs[ch];
+            auto iter = otherGlyphs.find(ch);
+            if(iter == otherGlyphs.end())
+            {
+                Triangle glyph[2];
+                makeGlyph(glyph, ch, fontTexture);
+                iter = otherGlyphs.insert(make_pair(ch, array<Triangle, 2>{{glyph[0], glyph[1]}})).first;
+            }
+            return iter->second.data();
+        }
+        void appendGlyph(Mesh &dest, unsigned ch, float x, float y, ColorF c)
+        {
+            if(fontTexture != nullptr)
+                dest.image = fontTexture;
+            const Triangle *glyphTriangles = glyph(ch);
+            VectorF offset(x, y, 0);
+            for(size_t i = 0; i < 2; i++)
+            {
+                Triangle tri = glyphTriangles[i];
+                tri.p1 += offset;
+                tri.p2 += offset;
+                tri.p3 += offset;
+                tri.c1 = tri.c2 = tri.c3 = c;
+                dest.append(tri);
+            }
+        }
+        static GlyphTable &get(const shared_ptr<Texture> &fontTexture)
+        {
+            static thread_local vector<unique_ptr<GlyphTable>> tables;
+            for(const unique_ptr<GlyphTable> &table : tables)
+                if(table->fontTexture == fontTexture)
+                    return *table;
+            tables.push_back(unique_ptr<GlyphTable>(new GlyphTable(fontTexture)));
+            return *tables.back();
+        }
+    };
+
 	class Text final
 	{
 	    Text() = delete;
@@ -503,15 +1147,9 @@ namespace Generate
 	    void operator =(const Text &) = delete;
         static void renderChar(Mesh &dest, float x, float y, unsigned ch, ColorF c, const std::shared_ptr<Texture> &fontTexture)
         {
-            TextureDescriptor td = getTextFontCharacterTextureDescriptor(ch, fontTexture);
-            dest.append(quadrilateral(td,
-                                      VectorF(0 + x, 0 + y, 0), c,
-                                      VectorF(1 + x, 0 + y, 0), c,
-                                      VectorF(1 + x, 1 + y, 0), c,
-                                      VectorF(0 + x, 1 + y, 0), c
-                                      ));
+            GlyphTable::get(fontTexture).appendGlyph(dest, ch, x, y, c);
         }
-        static void renderEngine(Mesh *dest, float &x, float &y, float &w, float &h, std::wstring str, ColorF c, const TextProperties &tp, const std::shared_ptr<Texture> &fontTexture = nullptr)
+        static void renderEngine(Mesh *dest, float &x, float &y, float &w, float &h, const std::wstring &str, ColorF c, const TextProperties &tp, const std::shared_ptr<Texture> &fontTexture = nullptr)
         {
             float wholeHeight = 0;
             if(dest)
@@ -568,43 +1206,125 @@ namespace Generate
             y = h - y - 1;
         }
 	public:
-        static float width(std::wstring str, const TextProperties &tp = TextProperties())
+        static float width(const std::wstring &str, const TextProperties &tp = TextProperties())
         {
             float x, y, w, h;
             renderEngine(nullptr, x, y, w, h, str, ColorF(), tp);
             return w;
         }
-        static float height(std::wstring str, const TextProperties &tp = TextProperties())
+        static float height(const std::wstring &str, const TextProperties &tp = TextProperties())
         {
             float x, y, w, h;
             renderEngine(nullptr, x, y, w, h, str, ColorF(), tp);
             return h;
         }
-        static float x(std::wstring str, const TextProperties &tp = TextProperties())
+        static float x(const std::wstring &str, const TextProperties &tp = TextProperties())
         {
             float x, y, w, h;
             renderEngine(nullptr, x, y, w, h, str, ColorF(), tp);
             return x;
         }
-        static float y(std::wstring str, const TextProperties &tp = TextProperties())
+        static float y(const std::wstring &str, const TextProperties &tp = TextProperties())
         {
             float x, y, w, h;
             renderEngine(nullptr, x, y, w, h, str, ColorF(), tp);
             return y;
         }
-        static Mesh &mesh(Mesh &dest, std::wstring str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
+        static Mesh &mesh(Mesh &dest, const std::wstring &str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
         {
             float x, y, w, h;
             renderEngine(&dest, x, y, w, h, str, c, tp, fontTexture);
             return dest;
         }
-        static Mesh mesh(std::wstring str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
+        static Mesh mesh(const std::wstring &str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
         {
             Mesh dest;
             mesh(dest, str, fontTexture, c, tp);
             return std::move(dest);
         }
+        static Mesh &mesh(FrameArena &arena, const std::wstring &str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
+        {
+            return mesh(arena.allocate(), str, fontTexture, c, tp);
+        }
+        /// like mesh() but returns the mesh from a per thread TextCache, for labels that don't change every frame
+        static const Mesh &cachedMesh(const std::wstring &str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties());
 	};
+
+    /** the meshes of the most recently used strings, so labels that stay the same aren't laid out again every frame
+     *
+     * Meshes are kept by string, font, color and TextProperties. A returned
+     * mesh stays valid until capacity other strings have been looked up.
+     */
+    class TextCache final
+    {
+        struct Key final
+        {
+            std::wstring str;
+            shared_ptr<Texture> fontTexture;
+            ColorF c;
+            float tabWidth;
+            bool operator ==(const Key &rt) const
+            {
+                return str == rt.str && fontTexture == rt.fontTexture && c == rt.c && tabWidth == rt.tabWidth;
+            }
+        };
+        struct KeyHasher final
+        {
+            size_t operator ()(const Key &key) const
+            {
+                size_t retval = hash<std::wstring>()(key.str);
+                retval = retval * 31 + hash<shared_ptr<Texture>>()(key.fontTexture);
+                retval = retval * 31 + hash<ColorF>()(key.c);
+                retval = retval * 31 + hash<float>()(key.tabWidth);
+                return retval;
+            }
+        };
+        /// most recently used first
+        list<pair<Key, Mesh>> entries;
+        unordered_map<Key, list<pair<Key, Mesh>>::iterator, KeyHasher> index;
+        size_t capacity;
+    public:
+        explicit TextCache(size_t capacity = 256)
+            : capacity(std::max<size_t>(capacity, 1))
+        {
+        }
+        TextCache(const TextCache &) = delete;
+        void operator =(const TextCache &) = delete;
+        const Mesh &mesh(const std::wstring &str, std::shared_ptr<Texture> fontTexture = nullptr, ColorF c = GrayscaleF(1), const TextProperties &tp = TextProperties())
+        {
+            Key key{str, fontTexture, c, tp.tabWidth};
+            auto iter = index.find(key);
+            if(iter != index.end())
+            {
+                entries.splice(entries.begin(), entries, iter->second);
+                return entries.front().second;
+            }
+            if(entries.size() >= capacity)
+            {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+            entries.push_front(make_pair(key, Mesh()));
+            Text::mesh(entries.front().second, str, fontTexture, c, tp);
+            index[key] = entries.begin();
+            return entries.front().second;
+        }
+        size_t size() const
+        {
+            return entries.size();
+        }
+        void clear()
+        {
+            index.clear();
+            entries.clear();
+        }
+    };
+
+    inline const Mesh &Text::cachedMesh(const std::wstring &str, std::shared_ptr<Texture> fontTexture, ColorF c, const TextProperties &tp)
+    {
+        static thread_local TextCache cache;
+        return cache.mesh(str, fontTexture, c, tp);
+    }
 }
 
 #endif // GENERATE_H_INCLUDED
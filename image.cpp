@@ -1,6 +1,11 @@
 #include "image.h"
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include "image_load_internal.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -564,6 +569,139 @@ TextureDescriptor getTextFontCharacterTextureDescriptor(unsigned ch, shared_ptr<
     return TextureDescriptor(texture, minU, maxU, minV, maxV);
 }
 
+namespace
+{
+/// the pixels ch covers in each row of its glyph from the top, with the leftmost pixel in bit 0
+void getTextFontGlyphRows(unsigned ch, uint8_t (&rows)[textFontCharacterSize])
+{
+    unsigned position = convertToCP437(ch);
+    size_t xPos = position % 16 * textFontCharacterSize, yPos = position / 16 * textFontCharacterSize;
+    for(int row = 0; row < textFontCharacterSize; row++) // a set bit in the font is a transparent pixel
+        rows[row] = ~ffmpegOpenGLRendererFontPixels[((yPos + row) * ffmpegOpenGLRendererFont.w + xPos) / 8];
+}
+
+/// blends a constant color over pixels, with compose() worked out ahead of time for every channel value
+struct TextBlender
+{
+    ColorI color;
+    uint32_t colorBits;
+    bool opaque;
+    uint8_t r[0x100], g[0x100], b[0x100], a[0x100];
+    explicit TextBlender(ColorI color)
+        : color(color), opaque(color.a == 0xFF)
+    {
+        static_assert(sizeof(ColorI) == sizeof(uint32_t), "ColorI must be packed into 32 bits");
+        memcpy(&colorBits, &color, sizeof(colorBits));
+        if(opaque)
+            return;
+        for(unsigned v = 0; v < 0x100; v++)
+        {
+            ColorI blended = compose(color, RGBAI(v, v, v, v));
+            r[v] = blended.r;
+            g[v] = blended.g;
+            b[v] = blended.b;
+            a[v] = blended.a;
+        }
+    }
+    void blend(ColorI &pixel) const
+    {
+        if(opaque)
+            pixel = color;
+        else
+            pixel = RGBAI(r[pixel.r], g[pixel.g], b[pixel.b], a[pixel.a]);
+    }
+    /// blends over the pixels of pixels[0 .. 8) that have their bit set in mask
+    void blendRow(ColorI *pixels, uint8_t mask) const
+    {
+#ifdef __SSE2__
+        if(opaque)
+        {
+            const __m128i lowBits = _mm_setr_epi32(0x1, 0x2, 0x4, 0x8);
+            const __m128i highBits = _mm_setr_epi32(0x10, 0x20, 0x40, 0x80);
+            __m128i maskVector = _mm_set1_epi32(mask);
+            __m128i colorVector = _mm_set1_epi32((int32_t)colorBits);
+            __m128i selectLow = _mm_cmpeq_epi32(_mm_and_si128(maskVector, lowBits), lowBits);
+            __m128i selectHigh = _mm_cmpeq_epi32(_mm_and_si128(maskVector, highBits), highBits);
+            __m128i *low = reinterpret_cast<__m128i *>(pixels), *high = reinterpret_cast<__m128i *>(pixels + 4);
+            _mm_storeu_si128(low, _mm_or_si128(_mm_and_si128(selectLow, colorVector), _mm_andnot_si128(selectLow, _mm_loadu_si128(low))));
+            _mm_storeu_si128(high, _mm_or_si128(_mm_and_si128(selectHigh, colorVector), _mm_andnot_si128(selectHigh, _mm_loadu_si128(high))));
+            return;
+        }
+#endif
+        for(int i = 0; i < textFontCharacterSize; i++)
+            if(mask & (1 << i))
+                blend(pixels[i]);
+    }
+};
+
+void drawGlyph(Image &image, int left, int top, unsigned ch, const TextBlender &blender)
+{
+    const int w = image.w, h = image.h;
+    if(left >= w || top >= h || left <= -textFontCharacterSize || top <= -textFontCharacterSize)
+        return;
+    uint8_t rows[textFontCharacterSize];
+    getTextFontGlyphRows(ch, rows);
+    bool clipped = left < 0 || left + textFontCharacterSize > w;
+    unsigned columnMask = 0xFF;
+    if(left < 0)
+        columnMask &= 0xFF << -left;
+    if(left + textFontCharacterSize > w)
+        columnMask &= 0xFF >> (left + textFontCharacterSize - w);
+    for(int row = max(0, -top); row < textFontCharacterSize && top + row < h; row++)
+    {
+        uint8_t mask = rows[row] & columnMask;
+        if(mask == 0)
+            continue;
+        ColorI *line = image.getLineAddress(top + row);
+        if(!clipped)
+        {
+            blender.blendRow(line + left, mask);
+            continue;
+        }
+        for(int i = 0; i < textFontCharacterSize; i++)
+            if(mask & (1 << i))
+                blender.blend(line[left + i]);
+    }
+}
+}
+
+void drawText(Image &image, int x, int y, const wstring &str, ColorI color)
+{
+    if(color.a == 0)
+        return;
+    constexpr int tabWidth = 8;
+    TextBlender blender(color);
+    int column = 0, line = 0;
+    for(wchar_t ch : str)
+    {
+        switch(ch)
+        {
+        case '\r':
+            column = 0;
+            break;
+        case '\n':
+            column = 0;
+            line++;
+            break;
+        case '\t':
+            column = (column / tabWidth + 1) * tabWidth;
+            break;
+        case '\b':
+            if(column > 0)
+                column--;
+            break;
+        case '\0':
+        case ' ':
+            column++;
+            break;
+        default:
+            drawGlyph(image, x + column * textFontCharacterSize, y + line * textFontCharacterSize, (unsigned)ch, blender);
+            column++;
+            break;
+        }
+    }
+}
+
 namespace
 {
 struct StaticImageRef
@@ -857,4 +857,15 @@ struct TextureDescriptor
 shared_ptr<Texture> loadTextFontTexture();
 TextureDescriptor getTextFontCharacterTextureDescriptor(unsigned ch, shared_ptr<Texture> texture);
 
+/// the width and height in pixels of each character in the text font
+constexpr int textFontCharacterSize = 8;
+
+/** draws str straight into image with the top left of the first character at (x, y)
+ *
+ * Lines and tabs are laid out like Generate::Text, a character per
+ * textFontCharacterSize pixels, and color is blended over the pixels the
+ * characters cover. Anything outside of image is clipped.
+ */
+void drawText(Image &image, int x, int y, const wstring &str, ColorI color);
+
 #endif // IMAGE_H_INCLUDED
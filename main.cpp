@@ -11,6 +11,7 @@
 #include <cwchar>
 #include "model.h"
 #include "bsp_tree.h"
+#include "csg_cache.h"
 
 using namespace std;
 
@@ -172,26 +173,27 @@ int main(int argc, char **argv)
             model->preloadTextures(renderer);
             modelExtents = model->getExtents();
             modelContainingSphereRadius = max(abs(get<0>(modelExtents)), abs(get<1>(modelExtents)));
-            for(auto &m : model->meshes)
-            {
-                get<1>(m).append(reverse(get<1>(m)));
-            }
+            // before the back faces are added, since decimating needs each edge shared by only two triangles
+            model->generateLODs();
+            model->appendBackFaces();
         }
         static Mesh m3;
+        static BSPTree containerTree;
         if(!model)
         {
+            Mesh container(m2, RGBAF(1, 1, 1, 0.5));
+            container.append(reverse(container));
+            containerTree = BSPTree(container.triangles);
             m3 = makeSphereMesh(20, 10, 12 * 0.9, nullptr, RGBF(1, 0, 1));
             TextureDescriptor td(testTexture);
             BSPTree csgObject = BSPTree(((Mesh)transform(Matrix::translate(VectorF(-0.5)).concat(Matrix::scale(2 * 10 * 0.9)), Generate::unitBox(td, td, td, td, td, td))).triangles);
             BSPTree t = BSPTree(m3.triangles);
             BSPTree cylinder = BSPTree(makeCylinderMesh(10, 4 * 0.9, 20, RGBF(1, 1, 0)).triangles);
-            t = csgIntersection(std::move(t), std::move(csgObject));
-            t = BSPTree(simplify(t.getTriangles()));
-            t = csgDifference(std::move(t), cylinder);
-            t = BSPTree(simplify(t.getTriangles()));
-            t = csgDifference(std::move(t), transform(Matrix::rotateZ(M_PI / 2), cylinder));
-            t = BSPTree(simplify(t.getTriangles()));
-            t = csgDifference(std::move(t), transform(Matrix::rotateX(M_PI / 2), std::move(cylinder)));
+            CSGCache csgCache;
+            t = csgCache.csgIntersection(std::move(t), std::move(csgObject));
+            t = csgCache.csgDifference(std::move(t), cylinder);
+            t = csgCache.csgDifference(std::move(t), transform(Matrix::rotateZ(M_PI / 2), cylinder));
+            t = csgCache.csgDifference(std::move(t), transform(Matrix::rotateX(M_PI / 2), std::move(cylinder)));
             m3 = Mesh(t.getTriangles(std::move(m3.triangles)), m3.image);
             cout << "model has " << m3.triangleCount() << " triangles." << endl;
             m3 = simplify(std::move(m3));
@@ -234,16 +236,18 @@ int main(int argc, char **argv)
             {
                 tform = (Matrix::rotateY((time - startTime) / 5 * M_PI)).concat(Matrix::rotateX((time - startTime) / 15 * M_PI));
                 Matrix tform2 = Matrix::translate(0, 0, -30);
-                VectorF viewPoint = inverse(tform2).apply(VectorF(0));
-                Mesh containerMesh = shadeMesh(colorize(RGBAF(1, 1, 1, 0.5), transform(tform.concat(tform2), m2)), shadeFn);
-                renderer->render(reverse(containerMesh));
-                Mesh preCutMesh = transform(tform, m3);
-                renderer->render(shadeMesh(transform(tform2, preCutMesh), shadeFn));
+                FrameArena &arena = renderer->frameArena();
+                Mesh &preCutMesh = transform(arena, tform, m3);
+                renderer->render(shadeMesh(arena, transform(arena, tform2, preCutMesh), shadeFn));
                 //CutMesh cutMesh = cut(preCutMesh, (Matrix::rotateY(-M_PI / 16 * (sin((time - startTime) / 1 * M_PI)))).concat(Matrix::rotateZ((time - startTime) / 4 * M_PI)).apply(VectorF(-1, 0, 0)), 0);
                 //cutMesh.front.append(cutMesh.coplanar);
                 //renderer->render(shadeMesh(transform(tform2, cutMesh.front), shadeFn));
                 //renderer->render(shadeMesh(shadeMesh(transform(tform2, cutMesh.back), SetColorShadeFn(HSBAF((time - startTime) / 3, 1, 0.5, 0.25))), shadeFn));
-                renderer->render(containerMesh);
+                // the container is see-through, so draw it last in back to front order
+                Transform containerTransform = tform.concat(tform2);
+                Mesh &containerMesh = arena.allocate(m2.image);
+                containerTree.getTriangles(containerMesh.triangles, transform(inverse(containerTransform), VectorF(0)), DrawOrder::BackToFront);
+                renderer->render(transformShadeMesh(arena, containerMesh, containerTransform, shadeFn, Transform(Matrix::identity())));
             }
 #endif
             wostringstream ss;
@@ -251,7 +255,7 @@ int main(int argc, char **argv)
             //float textWidth = Generate::Text::width(ss.str());
             float textHeight = Generate::Text::height(ss.str());
             float textScale = 1 / 6.0;
-            renderer->render(transform(Matrix::scale(textScale).concat(Matrix::translate(-renderer->scaleX(), renderer->scaleY() - textHeight * textScale, -1)), Generate::Text::mesh(ss.str(), fontTexture, RGBF(1, 0.5, 1))));
+            renderer->render(transform(Matrix::scale(textScale).concat(Matrix::translate(-renderer->scaleX(), renderer->scaleY() - textHeight * textScale, -1)), Generate::Text::mesh(renderer->frameArena(), ss.str(), fontTexture, RGBF(1, 0.5, 1))));
             renderer->flip();
         }
 #ifdef __EMSCRIPTEN__
@@ -3,30 +3,168 @@
 
 #include "image.h"
 #include "vector.h"
+#include "shade_batch.h"
 #include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
 #include <functional> // std::hash
 
 using namespace std;
 
+/** a light shining on vertices
+ *
+ * Directional lights reach everything. Point and spot lights fade out to
+ * nothing at their range, and spot lights only shine inside a cone, so
+ * they don't affect the vertices they can't reach at all and can be culled
+ * against bounding spheres with reaches().
+ */
 struct Light
 {
+    enum Type
+    {
+        Directional,
+        Point,
+        Spot
+    };
+    Type type = Directional;
+    /// towards a directional light, or the way a spot light shines
     VectorF direction;
     ColorF color;
+    VectorF position = VectorF(0);
+    float range = 0;
+    float inverseRangeSquared = 0;
+    /// the cosine of the angle from direction where a spot light ends, less than -1 for point lights
+    float outerCos = -2;
+    /// how fast a spot light fades in past outerCos
+    float fadeScale = 1;
     Light(VectorF direction = VectorF(0), ColorF color = GrayscaleF(1))
         : direction(normalizeNoThrow(direction)), color(color)
     {
     }
-    ColorF evalLight(VectorF vertexNormal, VectorF /*vertexPosition*/) const
+    /// a light at position that fades out to nothing at range
+    static Light point(VectorF position, float range, ColorF color = GrayscaleF(1))
+    {
+        Light retval(VectorF(0), color);
+        retval.type = Point;
+        retval.position = position;
+        retval.range = range;
+        retval.inverseRangeSquared = 1 / (range * range);
+        return retval;
+    }
+    /// a point light that only shines within outerAngle of direction, fading in until innerAngle. the angles are in radians
+    static Light spot(VectorF position, VectorF direction, float range, float outerAngle, float innerAngle = 0, ColorF color = GrayscaleF(1))
+    {
+        Light retval = point(position, range, color);
+        retval.type = Spot;
+        retval.direction = normalizeNoThrow(direction);
+        retval.outerCos = std::cos(outerAngle);
+        float innerCos = std::cos(std::min(innerAngle, outerAngle));
+        retval.fadeScale = innerCos > retval.outerCos ? 1 / (innerCos - retval.outerCos) : numeric_limits<float>::max();
+        return retval;
+    }
+private:
+    /// shared by the single vertex and the batch versions of evalLight() so they give the same colors
+    bool evalBounded(float toLightX, float toLightY, float toLightZ, float normalX, float normalY, float normalZ, float &factor) const
+    {
+        float distanceSquared = toLightX * toLightX + toLightY * toLightY + toLightZ * toLightZ;
+        float inverseDistance = distanceSquared > 0 ? 1 / std::sqrt(distanceSquared) : 0;
+        float v = (toLightX * normalX + toLightY * normalY + toLightZ * normalZ) * inverseDistance;
+        v = v < 0 ? 0 : v;
+        float falloff = 1 - distanceSquared * inverseRangeSquared;
+        falloff = falloff < 0 ? 0 : falloff;
+        float along = -(toLightX * direction.x + toLightY * direction.y + toLightZ * direction.z) * inverseDistance;
+        float fade = (along - outerCos) * fadeScale;
+        fade = fade < 0 ? 0 : (fade < 1 ? fade : 1);
+        factor = v * falloff * falloff * (fade * fade * (3 - 2 * fade));
+        return distanceSquared * inverseRangeSquared < 1 && along > outerCos;
+    }
+public:
+    /// reached is set to if the light gets to the vertex at all
+    ColorF evalLight(VectorF vertexNormal, VectorF vertexPosition, bool &reached) const
     {
+        reached = true;
+        if(type != Directional)
+        {
+            float factor;
+            reached = evalBounded(position.x - vertexPosition.x, position.y - vertexPosition.y, position.z - vertexPosition.z, vertexNormal.x, vertexNormal.y, vertexNormal.z, factor);
+            return scaleF(factor, color);
+        }
         float v = dot(direction, vertexNormal);
         if(v < 0)
             v = 0;
         return scaleF(v, color);
     }
+    ColorF evalLight(VectorF vertexNormal, VectorF vertexPosition) const
+    {
+        bool reached;
+        return evalLight(vertexNormal, vertexPosition, reached);
+    }
+    void evalLight(LightBatch &dest, const VectorBatch &vertexNormal, const VectorBatch &vertexPosition) const
+    {
+        if(type != Directional)
+        {
+            const Light light = *this; // a copy can't alias dest, so the loop vectorizes
+            for(size_t i = 0; i < ShadeBatchSize; i++)
+            {
+                float factor;
+                dest.reached[i] = light.evalBounded(light.position.x - vertexPosition.x[i], light.position.y - vertexPosition.y[i], light.position.z - vertexPosition.z[i], vertexNormal.x[i], vertexNormal.y[i], vertexNormal.z[i], factor);
+                dest.color.r[i] = factor * light.color.r;
+                dest.color.g[i] = factor * light.color.g;
+                dest.color.b[i] = factor * light.color.b;
+                dest.color.a[i] = light.color.a;
+            }
+            return;
+        }
+        for(size_t i = 0; i < ShadeBatchSize; i++)
+        {
+            float v = direction.x * vertexNormal.x[i] + direction.y * vertexNormal.y[i] + direction.z * vertexNormal.z[i];
+            v = v < 0 ? 0 : v;
+            dest.reached[i] = true;
+            dest.color.r[i] = v * color.r;
+            dest.color.g[i] = v * color.g;
+            dest.color.b[i] = v * color.b;
+            dest.color.a[i] = color.a;
+        }
+    }
+    /// if the light might reach anything inside the sphere. it never misses a vertex evalLight() says it reaches
+    bool reaches(VectorF center, float radius) const
+    {
+        if(type == Directional)
+            return true;
+        // vertices are shaded after being transformed and rounded, so allow a little more
+        radius += (range + radius + std::fabs(center.x) + std::fabs(center.y) + std::fabs(center.z)
+                   + std::fabs(position.x) + std::fabs(position.y) + std::fabs(position.z)) * 1e-4f;
+        VectorF fromLight = center - position;
+        float distanceSquared = absSquared(fromLight);
+        if(distanceSquared >= (range + radius) * (range + radius))
+            return false;
+        if(outerCos <= 0)
+            return true;
+        // the sphere against the cone, which is narrower than a half space here
+        float along = dot(fromLight, direction);
+        if(along < -radius)
+            return false;
+        float outerSin = std::sqrt(1 - outerCos * outerCos);
+        return outerCos * std::sqrt(std::max(0.0f, distanceSquared - along * along)) - along * outerSin <= radius;
+    }
+    bool operator ==(const Light &rt) const
+    {
+        return type == rt.type && direction == rt.direction && color == rt.color && position == rt.position
+            && range == rt.range && outerCos == rt.outerCos && fadeScale == rt.fadeScale;
+    }
+    bool operator !=(const Light &rt) const
+    {
+        return !operator ==(rt);
+    }
 };
 
-//template <typename ...Args>
-//struct LightListLiteral;
+template <typename ...Args>
+struct LightListLiteral;
+
+template <typename ...Args>
+struct MaskedLightList;
 
 struct Material
 {
@@ -50,6 +188,26 @@ struct Material
         retval.b = min(1.0f, retval.b);
         return retval;
     }
+    void evalGlobal(ColorBatch &dest, const VectorBatch &/*vertexNormal*/, const VectorBatch &/*vertexPosition*/) const
+    {
+        dest.fill(ambient);
+    }
+    /// only the lanes lightVal reaches are changed
+    void evalCombine(ColorBatch &retval, const LightBatch &lightVal) const
+    {
+        add(retval, lightVal);
+    }
+    void evalFinalize(ColorBatch &retval, const ColorBatch &vertexColor) const
+    {
+        for(size_t i = 0; i < ShadeBatchSize; i++)
+        {
+            float r = vertexColor.r[i] * retval.r[i], g = vertexColor.g[i] * retval.g[i], b = vertexColor.b[i] * retval.b[i];
+            retval.r[i] = r < 1.0f ? r : 1.0f;
+            retval.g[i] = g < 1.0f ? g : 1.0f;
+            retval.b[i] = b < 1.0f ? b : 1.0f;
+            retval.a[i] = vertexColor.a[i] * opacity;
+        }
+    }
     Material(ColorF ambient, ColorF diffuse, float opacity, shared_ptr<Texture> texture = nullptr)
         : ambient(ambient), diffuse(diffuse), opacity(opacity), texture(texture)
     {
@@ -58,20 +216,63 @@ struct Material
         : ambient(ambient), diffuse(diffuse), opacity(diffuse.a), texture(texture)
     {
     }
-//    template <typename ...Args>
-//    ColorF eval(const LightListLiteral<Args...> &lights, ColorF vertexColor, VectorF vertexNormal, VectorF vertexPosition) const
-//    {
-//        return evalFinalize(lights.eval(*this, vertexNormal, vertexPosition), vertexColor);
-//    }
+    template <typename ...Args>
+    ColorF eval(const LightListLiteral<Args...> &lights, ColorF vertexColor, VectorF vertexNormal, VectorF vertexPosition) const
+    {
+        return evalFinalize(lights.eval(*this, vertexNormal, vertexPosition), vertexColor);
+    }
+    template <typename ...Args>
+    void eval(const LightListLiteral<Args...> &lights, ShadeBatch &batch) const
+    {
+        ColorBatch retval;
+        lights.eval(retval, *this, batch.normal, batch.position);
+        evalFinalize(retval, batch.color);
+        batch.color = retval;
+    }
+    template <typename ...Args>
+    ColorF eval(const MaskedLightList<Args...> &lights, ColorF vertexColor, VectorF vertexNormal, VectorF vertexPosition) const
+    {
+        return evalFinalize(lights.lights.eval(*this, vertexNormal, vertexPosition, lights.enabled), vertexColor);
+    }
+    template <typename ...Args>
+    void eval(const MaskedLightList<Args...> &lights, ShadeBatch &batch) const
+    {
+        ColorBatch retval;
+        lights.lights.eval(retval, *this, batch.normal, batch.position, lights.enabled);
+        evalFinalize(retval, batch.color);
+        batch.color = retval;
+    }
     ColorF eval(const vector<Light> &lights, ColorF vertexColor, VectorF vertexNormal, VectorF vertexPosition) const
     {
         ColorF retval = evalGlobal(vertexNormal, vertexPosition);
         for(const Light &light : lights)
         {
-            retval = evalCombine(retval, light.evalLight(vertexNormal, vertexPosition));
+            bool reached;
+            ColorF lightVal = light.evalLight(vertexNormal, vertexPosition, reached);
+            if(reached)
+                retval = evalCombine(retval, lightVal);
         }
         return evalFinalize(retval, vertexColor);
     }
+    /// the same as eval() for each vertex of batch, skipping the lights that can't reach any of them
+    void eval(const vector<Light> &lights, ShadeBatch &batch) const
+    {
+        ColorBatch retval;
+        LightBatch lightVal;
+        VectorF center;
+        float radius;
+        batch.position.getBoundingSphere(center, radius);
+        evalGlobal(retval, batch.normal, batch.position);
+        for(const Light &light : lights)
+        {
+            if(!light.reaches(center, radius))
+                continue;
+            light.evalLight(lightVal, batch.normal, batch.position);
+            evalCombine(retval, lightVal);
+        }
+        evalFinalize(retval, batch.color);
+        batch.color = retval;
+    }
     explicit Material(ColorF c, shared_ptr<Texture> texture = nullptr)
         : ambient(scaleF(0.35, c)), diffuse(scaleF(0.65, c)), opacity(c.a), texture(texture)
     {
@@ -116,17 +317,32 @@ public:
 };
 }
 
-#if 0
+/** a fixed list of lights, for shading that the compiler can unroll
+ *
+ * The lights are combined in the same order as Material::eval() does with
+ * a vector<Light>, so both give the same colors.
+ */
 template <>
 struct LightListLiteral<>
 {
     constexpr LightListLiteral()
     {
     }
-    ColorF eval(const Material &material, VectorF vertexNormal, VectorF vertexPosition) const
+    ColorF eval(const Material &material, VectorF vertexNormal, VectorF vertexPosition, uint64_t = ~(uint64_t)0) const
     {
         return material.evalGlobal(vertexNormal, vertexPosition);
     }
+    ColorF combine(const Material &, ColorF retval, VectorF, VectorF, uint64_t = ~(uint64_t)0) const
+    {
+        return retval;
+    }
+    void eval(ColorBatch &dest, const Material &material, const VectorBatch &vertexNormal, const VectorBatch &vertexPosition, uint64_t = ~(uint64_t)0) const
+    {
+        material.evalGlobal(dest, vertexNormal, vertexPosition);
+    }
+    void combine(ColorBatch &, const Material &, LightBatch &, const VectorBatch &, const VectorBatch &, uint64_t = ~(uint64_t)0) const
+    {
+    }
 };
 
 template <typename ...Args>
@@ -138,18 +354,83 @@ struct LightListLiteral<Light, Args...>
         : first(first), rest(rest...)
     {
     }
-    ColorF eval(const Material &material, VectorF vertexNormal, VectorF vertexPosition) const
+    /// only the lights with their bit set in enabled are used, starting from the low bit for first
+    ColorF eval(const Material &material, VectorF vertexNormal, VectorF vertexPosition, uint64_t enabled = ~(uint64_t)0) const
+    {
+        return combine(material, material.evalGlobal(vertexNormal, vertexPosition), vertexNormal, vertexPosition, enabled);
+    }
+    ColorF combine(const Material &material, ColorF retval, VectorF vertexNormal, VectorF vertexPosition, uint64_t enabled = ~(uint64_t)0) const
+    {
+        if(enabled & 1)
+        {
+            bool reached;
+            ColorF lightVal = first.evalLight(vertexNormal, vertexPosition, reached);
+            if(reached)
+                retval = material.evalCombine(retval, lightVal);
+        }
+        return rest.combine(material, retval, vertexNormal, vertexPosition, enabled >> 1);
+    }
+    void eval(ColorBatch &dest, const Material &material, const VectorBatch &vertexNormal, const VectorBatch &vertexPosition, uint64_t enabled = ~(uint64_t)0) const
+    {
+        LightBatch lightVal;
+        material.evalGlobal(dest, vertexNormal, vertexPosition);
+        combine(dest, material, lightVal, vertexNormal, vertexPosition, enabled);
+    }
+    /// lightVal is scratch space
+    void combine(ColorBatch &retval, const Material &material, LightBatch &lightVal, const VectorBatch &vertexNormal, const VectorBatch &vertexPosition, uint64_t enabled = ~(uint64_t)0) const
     {
-        return material.evalCombine(rest.eval(material, vertexNormal, vertexPosition), first.evalLight(vertexNormal, vertexPosition));
+        if(enabled & 1)
+        {
+            first.evalLight(lightVal, vertexNormal, vertexPosition);
+            material.evalCombine(retval, lightVal);
+        }
+        rest.combine(retval, material, lightVal, vertexNormal, vertexPosition, enabled >> 1);
     }
 };
-#endif
+
+/** a LightListLiteral that only uses the lights with their bit set in enabled
+ *
+ * For leaving out the lights that can't reach a mesh while keeping the
+ * unrolled shading of a LightListLiteral.
+ */
+template <typename ...Args>
+struct MaskedLightList
+{
+    static_assert(sizeof...(Args) <= 64, "the mask only has room for 64 lights");
+    LightListLiteral<Args...> lights;
+    uint64_t enabled;
+    MaskedLightList(const LightListLiteral<Args...> &lights, uint64_t enabled)
+        : lights(lights), enabled(enabled)
+    {
+    }
+};
+
+/// Light for every argument type, so anything that converts to a Light can go in a LightListLiteral
+template <typename T>
+using LightListArgument = Light;
+
+template <typename ...Args>
+inline LightListLiteral<LightListArgument<Args>...> make_light_list_literal(Args ...args)
+{
+    return LightListLiteral<LightListArgument<Args>...>(args...);
+}
+
 template <typename ...Args>
 inline vector<Light> make_light_list(Args ...args)
 {
     return vector<Light>{args...};
 }
 
+/// like make_light_list but reuses dest's storage
+template <typename ...Args>
+inline vector<Light> &fill_light_list(vector<Light> &dest, Args ...args)
+{
+    dest.clear();
+    int expander[] = {0, (dest.push_back(args), 0)...};
+    (void)expander;
+    return dest;
+}
+
 template <typename T>
 struct LitMaterial
 {
@@ -163,6 +444,10 @@ struct LitMaterial
     {
         return material.eval(lights, vertexColor, vertexNormal, vertexPosition);
     }
+    void shadeBatch(ShadeBatch &batch) const
+    {
+        material.eval(lights, batch);
+    }
     void setMaterial(const Material &material)
     {
         this->material = material;
@@ -170,9 +455,9 @@ struct LitMaterial
 };
 
 template <typename ...Args>
-inline LitMaterial<vector<Light>> light_material(const Material &material, Args ...args)
+inline LitMaterial<LightListLiteral<LightListArgument<Args>...>> light_material(const Material &material, Args ...args)
 {
-    return LitMaterial<vector<Light>>(material, make_light_list(args...));
+    return LitMaterial<LightListLiteral<LightListArgument<Args>...>>(material, make_light_list_literal(args...));
 }
 
 inline LitMaterial<vector<Light>> light_material(const Material &material, const vector<Light> &lights)
@@ -395,9 +395,29 @@ inline VectorF transform(const Transform &m, VectorF v)
     return m.get().apply(v);
 }
 
+/// the inverse transpose of a transform, computed once for transforming many normals
+class NormalTransform final
+{
+    Matrix m;
+public:
+    explicit NormalTransform(const Transform &tform)
+        : m(transpose(tform.getInverse()))
+    {
+    }
+    VectorF apply(VectorF v) const
+    {
+        return normalizeNoThrow(m.applyNoTranslate(v));
+    }
+};
+
+inline VectorF transformNormal(const NormalTransform &m, VectorF v)
+{
+    return m.apply(v);
+}
+
 inline VectorF transformNormal(const Transform &m, VectorF v)
 {
-    return normalizeNoThrow(transpose(m.getInverse()).applyNoTranslate(v));
+    return transformNormal(NormalTransform(m), v);
 }
 
 inline Transform transform(const Transform & a, const Transform & b)
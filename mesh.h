@@ -3,6 +3,7 @@
 
 #include "triangle.h"
 #include "matrix.h"
+#include "thread_pool.h"
 #include <vector>
 #include <cassert>
 #include <utility>
@@ -123,6 +124,35 @@ struct ColorizedTransformedMeshRRef
     operator shared_ptr<Mesh>() &&;
 };
 
+/// meshes with more triangles than this are split across the render threads
+constexpr size_t parallelMeshGrainSize = 4096;
+
+template <typename Fn>
+inline void appendMappedTriangles(vector<Triangle> &dest, const vector<Triangle> &source, const Fn &fn)
+{
+    assert(&dest != &source);
+    size_t offset = dest.size();
+    dest.resize(offset + source.size());
+    Triangle *destTriangles = dest.data() + offset;
+    const Triangle *sourceTriangles = source.data();
+    parallelFor(source.size(), parallelMeshGrainSize, [destTriangles, sourceTriangles, &fn](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+            destTriangles[i] = fn(sourceTriangles[i]);
+    });
+}
+
+template <typename Fn>
+inline void mapTrianglesInPlace(vector<Triangle> &triangles, const Fn &fn)
+{
+    Triangle *pTriangles = triangles.data();
+    parallelFor(triangles.size(), parallelMeshGrainSize, [pTriangles, &fn](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+            pTriangles[i] = fn(pTriangles[i]);
+    });
+}
+
 struct Mesh
 {
     vector<Triangle> triangles;
@@ -138,26 +168,28 @@ struct Mesh
     Mesh(const Mesh & rt, Transform tform)
         : image(rt.image)
     {
-        triangles.reserve(rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&tform](const Triangle & t)->Triangle
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        appendMappedTriangles(triangles, rt.triangles, [&m, &normalTransform](const Triangle & t)->Triangle
         {
-            return transform(tform, t);
+            return transform(m, normalTransform, t);
         });
     }
     Mesh(Mesh && rt, Transform tform)
         : image(rt.image)
     {
         triangles = std::move(rt.triangles);
-        for(Triangle &tri : triangles)
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        mapTrianglesInPlace(triangles, [&m, &normalTransform](const Triangle & tri)->Triangle
         {
-            tri = transform(tform, tri);
-        }
+            return transform(m, normalTransform, tri);
+        });
     }
     Mesh(const Mesh & rt, ColorF color)
         : image(rt.image)
     {
-        triangles.reserve(rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&color](const Triangle & t)->Triangle
+        appendMappedTriangles(triangles, rt.triangles, [&color](const Triangle & t)->Triangle
         {
             return colorize(color, t);
         });
@@ -166,28 +198,31 @@ struct Mesh
         : image(rt.image)
     {
         triangles = std::move(rt.triangles);
-        for(Triangle &tri : triangles)
+        mapTrianglesInPlace(triangles, [&color](const Triangle & tri)->Triangle
         {
-            tri = colorize(color, tri);
-        }
+            return colorize(color, tri);
+        });
     }
     Mesh(const Mesh & rt, ColorF color, Transform tform)
         : image(rt.image)
     {
-        triangles.reserve(rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&color, &tform](const Triangle & t)->Triangle
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        appendMappedTriangles(triangles, rt.triangles, [&color, &m, &normalTransform](const Triangle & t)->Triangle
         {
-            return colorize(color, transform(tform, t));
+            return colorize(color, transform(m, normalTransform, t));
         });
     }
     Mesh(Mesh && rt, ColorF color, Transform tform)
         : image(rt.image)
     {
         triangles = std::move(rt.triangles);
-        for(Triangle &tri : triangles)
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        mapTrianglesInPlace(triangles, [&color, &m, &normalTransform](const Triangle & tri)->Triangle
         {
-            tri = colorize(color, transform(tform, tri));
-        }
+            return colorize(color, transform(m, normalTransform, tri));
+        });
     }
     Mesh(TransformedMesh mesh)
         : Mesh(*mesh.mesh, mesh.tform)
@@ -242,10 +277,11 @@ struct Mesh
         assert(rt.image == nullptr || image == nullptr || image == rt.image);
         if(rt.image != nullptr)
             image = rt.image;
-        triangles.reserve(triangles.size() + rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&tform](const Triangle & t)->Triangle
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        appendMappedTriangles(triangles, rt.triangles, [&m, &normalTransform](const Triangle & t)->Triangle
         {
-            return transform(tform, t);
+            return transform(m, normalTransform, t);
         });
     }
     void append(const Mesh & rt, ColorF color)
@@ -253,8 +289,7 @@ struct Mesh
         assert(rt.image == nullptr || image == nullptr || image == rt.image);
         if(rt.image != nullptr)
             image = rt.image;
-        triangles.reserve(triangles.size() + rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&color](const Triangle & t)->Triangle
+        appendMappedTriangles(triangles, rt.triangles, [&color](const Triangle & t)->Triangle
         {
             return colorize(color, t);
         });
@@ -264,10 +299,11 @@ struct Mesh
         assert(rt.image == nullptr || image == nullptr || image == rt.image);
         if(rt.image != nullptr)
             image = rt.image;
-        triangles.reserve(triangles.size() + rt.triangles.size());
-        std::transform(rt.triangles.begin(), rt.triangles.end(), back_inserter(triangles), [&color, &tform](const Triangle & t)->Triangle
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        appendMappedTriangles(triangles, rt.triangles, [&color, &m, &normalTransform](const Triangle & t)->Triangle
         {
-            return colorize(color, transform(tform, t));
+            return colorize(color, transform(m, normalTransform, t));
         });
     }
     void append(shared_ptr<Mesh> rt)
@@ -5,31 +5,270 @@
 #include "mesh.h"
 #include "renderer.h"
 #include "generate.h"
+#include "decimate.h"
 #include <vector>
 #include <tuple>
 #include <stdexcept>
+#include <mutex>
 
 using namespace std;
 
 struct Model
 {
     vector<pair<Material, Mesh>> meshes;
-    template <typename ...Lights>
-    void render(shared_ptr<Renderer> renderer, Transform globalToCameraTransform, Transform localToGlobalTransform, Lights ...lights) const
+    /// either empty or one for each mesh, see generateLODs()
+    vector<LODSet> lodSets;
+    /// how much of the view height the error of a far away mesh's level of detail may cover
+    float lodScreenError = 1.0f / 1000;
+private:
+    /// the lit vertex colors of a mesh, for as long as its material, the lights, the local to global transform and the mesh revision stay the same
+    struct LightingCache
+    {
+        /// the LightingCaches::meshRevision these were made for
+        size_t meshRevision = 0;
+        Material material;
+        vector<Light> lights;
+        Matrix localToGlobal = Matrix::identity();
+        /// three colors per triangle for each level of detail, or just for the mesh without them. empty until drawn
+        vector<vector<ColorF>> levelColors;
+        /// a sphere around the mesh and all of its levels of detail, in local coordinates. the radius is negative until drawn
+        VectorF center = VectorF(0);
+        float radius = -1;
+    };
+    /// render() is const, so drawing one model from several threads has to work. copies start out empty
+    struct LightingCaches
+    {
+        vector<LightingCache> caches;
+        /// bumped by invalidateLighting()
+        size_t meshRevision = 0;
+        mutex lock;
+        LightingCaches()
+        {
+        }
+        LightingCaches(const LightingCaches &)
+        {
+        }
+        LightingCaches &operator =(const LightingCaches &)
+        {
+            lock_guard<mutex> lockIt(lock);
+            caches.clear();
+            return *this;
+        }
+    };
+    mutable LightingCaches lightingCaches;
+    template <typename Fn>
+    static void shadeColors(vector<ColorF> &colors, const Mesh &mesh, Transform shadeTransform, Fn shadeFn)
+    {
+        colors.resize(mesh.triangles.size() * 3);
+        const Matrix shadeMatrix = shadeTransform.get();
+        const NormalTransform shadeNormalTransform(shadeTransform);
+        ColorF *destColors = colors.data();
+        const Triangle *triangles = mesh.triangles.data();
+        parallelFor(mesh.triangles.size(), parallelMeshGrainSize, [&](size_t start, size_t end)
+        {
+            // like transformShadeMesh(), triangles without normals keep their colors
+            for(size_t i = start; i < end; i++)
+            {
+                destColors[i * 3] = triangles[i].c1;
+                destColors[i * 3 + 1] = triangles[i].c2;
+                destColors[i * 3 + 2] = triangles[i].c3;
+            }
+            shadeTriangleCorners(triangles, start, end, shadeFn, [&](VectorF &normal, VectorF &position)
+            {
+                normal = transformNormal(shadeNormalTransform, normal);
+                position = shadeMatrix.apply(position);
+            }, [destColors](size_t triangleIndex, size_t corner, ColorF color)
+            {
+                destColors[triangleIndex * 3 + corner] = color;
+            });
+        });
+    }
+    static Mesh &transformLitMesh(Mesh &dest, const Mesh &mesh, const vector<ColorF> &colors, Transform tform)
+    {
+        const Matrix matrix = tform.get();
+        const NormalTransform normalTransform(tform);
+        dest.triangles.resize(mesh.triangles.size());
+        dest.image = mesh.image;
+        Triangle *destTriangles = dest.triangles.data();
+        const Triangle *triangles = mesh.triangles.data();
+        const ColorF *litColors = colors.data();
+        parallelFor(mesh.triangles.size(), parallelMeshGrainSize, [&](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+            {
+                Triangle result = transform(matrix, normalTransform, triangles[i]);
+                result.c1 = litColors[i * 3];
+                result.c2 = litColors[i * 3 + 1];
+                result.c3 = litColors[i * 3 + 2];
+                destTriangles[i] = result;
+            }
+        });
+        return dest;
+    }
+    void getBoundingSphere(size_t meshIndex, VectorF &center, float &radius) const
+    {
+        const Mesh &mesh = std::get<1>(meshes[meshIndex]);
+        pair<VectorF, VectorF> extents = mesh.getExtents();
+        center = 0.5f * (std::get<0>(extents) + std::get<1>(extents));
+        radius = 0;
+        for(const Triangle &tri : mesh.triangles)
+            radius = std::max(radius, std::sqrt(std::max(absSquared(tri.p1 - center), std::max(absSquared(tri.p2 - center), absSquared(tri.p3 - center)))));
+        // the coarser levels are within their error of the mesh
+        if(meshIndex < lodSets.size())
+            radius += lodSets[meshIndex].getMaxError();
+    }
+    /// like LitMaterial, but without copying the lights
+    template <typename T>
+    struct LightingShader
+    {
+        const Material &material;
+        const T &lights;
+        LightingShader(const Material &material, const T &lights)
+            : material(material), lights(lights)
+        {
+        }
+        ColorF operator ()(ColorF vertexColor, VectorF vertexNormal, VectorF vertexPosition) const
+        {
+            return material.eval(lights, vertexColor, vertexNormal, vertexPosition);
+        }
+        void shadeBatch(ShadeBatch &batch) const
+        {
+            material.eval(lights, batch);
+        }
+    };
+    /** draws the meshes, culling lights against each one
+     *
+     * shadeMesh(colors, mesh, material, meshLights, enabled) fills in the lit
+     * colors of mesh, where meshLights are the lights that reach it and the
+     * bits of enabled say which of the first 64 of lights those are.
+     */
+    template <typename ShadeMesh>
+    void renderLit(shared_ptr<Renderer> renderer, Transform globalToCameraTransform, Transform localToGlobalTransform, const vector<Light> &lights, ShadeMesh shadeMesh) const
     {
         if(meshes.empty())
             return;
-        Mesh temp;
-        auto lighting = light_material(std::get<0>(meshes[0]), make_light_list(lights...));
-        for(const pair<Material, Mesh> &mesh : meshes)
+        FrameArena &arena = renderer->frameArena();
+        FrameArenaScope scope(arena);
+        Mesh &temp = arena.allocate();
+        static thread_local vector<Light> meshLights;
+        lock_guard<mutex> lockIt(lightingCaches.lock);
+        vector<LightingCache> &caches = lightingCaches.caches;
+        Transform localToCameraTransform = localToGlobalTransform.concat(globalToCameraTransform);
+        Matrix localToGlobalMatrix = localToGlobalTransform.get();
+        // the most localToGlobalTransform stretches any direction
+        float scale = std::sqrt(std::max(absSquared(localToGlobalMatrix.applyNoTranslate(VectorF(1, 0, 0))),
+                                std::max(absSquared(localToGlobalMatrix.applyNoTranslate(VectorF(0, 1, 0))),
+                                         absSquared(localToGlobalMatrix.applyNoTranslate(VectorF(0, 0, 1))))));
+        caches.resize(meshes.size());
+        for(size_t i = 0; i < meshes.size(); i++)
         {
-            temp.assign(std::get<1>(mesh));
-            Mesh m = transform(localToGlobalTransform, std::move(temp));
-            lighting.setMaterial(std::get<0>(mesh));
-            temp = transform(globalToCameraTransform, shadeMesh(std::move(m), lighting));
-            renderer->render(temp);
+            const Material &material = std::get<0>(meshes[i]);
+            LightingCache &cache = caches[i];
+            if(cache.meshRevision != lightingCaches.meshRevision)
+            {
+                cache = LightingCache();
+                cache.meshRevision = lightingCaches.meshRevision;
+            }
+            if(cache.radius < 0)
+                getBoundingSphere(i, cache.center, cache.radius);
+            VectorF globalCenter = localToGlobalMatrix.apply(cache.center);
+            meshLights.clear();
+            uint64_t enabled = 0;
+            for(size_t j = 0; j < lights.size(); j++)
+            {
+                if(!lights[j].reaches(globalCenter, cache.radius * scale))
+                    continue;
+                meshLights.push_back(lights[j]);
+                if(j < 64)
+                    enabled |= (uint64_t)1 << j;
+            }
+            if(cache.material != material || cache.lights != meshLights || cache.localToGlobal != localToGlobalMatrix)
+            {
+                cache.material = material;
+                cache.lights = meshLights;
+                cache.localToGlobal = localToGlobalMatrix;
+                for(vector<ColorF> &colors : cache.levelColors)
+                    colors.clear();
+            }
+            const Mesh *mesh = &std::get<1>(meshes[i]);
+            size_t level = 0;
+            if(i < lodSets.size())
+            {
+                level = lodSets[i].select(localToCameraTransform, renderer->scaleY(), lodScreenError);
+                if(level > 0)
+                    mesh = &lodSets[i].getLevels()[level - 1].mesh;
+            }
+            if(cache.levelColors.size() <= level)
+                cache.levelColors.resize(level + 1);
+            vector<ColorF> &colors = cache.levelColors[level];
+            if(colors.empty())
+                shadeMesh(colors, *mesh, material, meshLights, enabled);
+            renderer->render(transformLitMesh(temp, *mesh, colors, localToCameraTransform));
         }
     }
+public:
+    /** draws the meshes lit by lights
+     *
+     * The lit vertex colors are kept between calls, so when only
+     * globalToCameraTransform changes the meshes are just transformed.
+     * Changes to the meshes or their levels of detail aren't noticed, so
+     * call invalidateLighting() after any of them. Several threads can draw
+     * the same model, but they take turns, and none may change it
+     * meanwhile. Each mesh is only shaded with the lights that reach its
+     * bounding sphere, so lights far from a mesh cost next to nothing and
+     * moving them doesn't make it get shaded again. The shading is unrolled
+     * over the lights with a LightListLiteral, with the culled lights
+     * masked off.
+     */
+    template <typename ...Lights>
+    void render(shared_ptr<Renderer> renderer, Transform globalToCameraTransform, Transform localToGlobalTransform, Lights ...lights) const
+    {
+        static thread_local vector<Light> lightList;
+        typedef MaskedLightList<LightListArgument<Lights>...> MeshLights;
+        const LightListLiteral<LightListArgument<Lights>...> lightListLiteral = make_light_list_literal(lights...);
+        renderLit(renderer, globalToCameraTransform, localToGlobalTransform, fill_light_list(lightList, lights...), [&](vector<ColorF> &colors, const Mesh &mesh, const Material &material, const vector<Light> &, uint64_t enabled)
+        {
+            MeshLights meshLights(lightListLiteral, enabled);
+            shadeColors(colors, mesh, localToGlobalTransform, LightingShader<MeshLights>(material, meshLights));
+        });
+    }
+    /** draws the meshes lit by lights only known at run time, or too many for a LightListLiteral
+     *
+     * Besides culling the lights against each mesh, each batch of vertices
+     * is only shaded with the lights that reach it.
+     */
+    void render(shared_ptr<Renderer> renderer, Transform globalToCameraTransform, Transform localToGlobalTransform, const vector<Light> &lights) const
+    {
+        renderLit(renderer, globalToCameraTransform, localToGlobalTransform, lights, [&](vector<ColorF> &colors, const Mesh &mesh, const Material &material, const vector<Light> &meshLights, uint64_t)
+        {
+            shadeColors(colors, mesh, localToGlobalTransform, LightingShader<vector<Light>>(material, meshLights));
+        });
+    }
+    /// makes render() shade every mesh again, for after the meshes are changed
+    void invalidateLighting()
+    {
+        lock_guard<mutex> lockIt(lightingCaches.lock);
+        lightingCaches.meshRevision++;
+    }
+    /// makes render() draw meshes with fewer triangles the smaller they are on screen
+    void generateLODs(float reductionFactor = 0.25f, size_t minTriangleCount = 1000)
+    {
+        invalidateLighting();
+        lodSets.clear();
+        lodSets.reserve(meshes.size());
+        for(const pair<Material, Mesh> &mesh : meshes)
+            lodSets.push_back(LODSet(std::get<1>(mesh), reductionFactor, minTriangleCount));
+    }
+    /// gives every triangle of the meshes and their levels of detail a back face, after generateLODs() since decimating needs each edge shared by only two triangles
+    void appendBackFaces()
+    {
+        invalidateLighting();
+        for(pair<Material, Mesh> &mesh : meshes)
+            get<1>(mesh).append(reverse(get<1>(mesh)));
+        for(LODSet &lodSet : lodSets)
+            for(LODSet::Level &level : lodSet.getLevels())
+                level.mesh.append(reverse(level.mesh));
+    }
     Model(Mesh mesh, Material material = Material())
         : meshes{make_pair(material, mesh)}
     {
@@ -44,6 +283,9 @@ struct Model
             get<0>(mesh).texture = renderer->preloadTexture(get<0>(mesh).texture);
             get<1>(mesh).image = renderer->preloadTexture(get<1>(mesh).image);
         }
+        for(size_t i = 0; i < lodSets.size(); i++)
+            for(LODSet::Level &level : lodSets[i].getLevels())
+                level.mesh.image = get<1>(meshes[i]).image;
     }
     pair<VectorF, VectorF> getExtents() const
     {
@@ -0,0 +1,234 @@
+#ifndef POLYGON_H_INCLUDED
+#define POLYGON_H_INCLUDED
+
+#include "triangle.h"
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+using namespace std;
+
+/// twice the area times the normal of the convex polygon, the same as Triangle::point_cross() for a triangle
+inline VectorF polygonCross(const Vertex *vertices, size_t vertexCount)
+{
+    VectorF retval = VectorF(0);
+    for(size_t j = 1, k = 2; k < vertexCount; j++, k++)
+        retval += cross(vertices[0].p - vertices[j].p, vertices[0].p - vertices[k].p);
+    return retval;
+}
+
+inline bool polygonEmpty(const Vertex *vertices, size_t vertexCount)
+{
+    return absSquared(polygonCross(vertices, vertexCount)) < eps * eps * eps * eps;
+}
+
+/// appends the fan triangulation used by CutTriangle
+inline void triangulate(vector<Triangle> &dest, const Vertex *vertices, size_t vertexCount)
+{
+    for(size_t j = 1, k = 2; k < vertexCount; j++, k++)
+        dest.push_back(Triangle(vertices[0], vertices[j], vertices[k]));
+}
+
+/** convex planar polygons stored back to back in one vertex array
+ *
+ * New polygons are built a vertex at a time with addVertex() and
+ * endPolygon(). Vertices that land on top of the one before are dropped, so
+ * repeatedly cutting a polygon doesn't pile up slivers, and polygons left
+ * with fewer than 3 vertices are discarded.
+ */
+class PolygonList final
+{
+    vector<Vertex> vertices;
+    vector<uint32_t> ends;
+    size_t currentStart() const
+    {
+        return ends.empty() ? 0 : ends.back();
+    }
+    static bool sameVertex(const Vertex &a, const Vertex &b)
+    {
+        return absSquared(a.p - b.p) < eps * eps;
+    }
+public:
+    size_t size() const
+    {
+        return ends.size();
+    }
+    bool empty() const
+    {
+        return ends.empty();
+    }
+    size_t vertexCount() const
+    {
+        return currentStart();
+    }
+    void clear()
+    {
+        vertices.clear();
+        ends.clear();
+    }
+    size_t polygonStart(size_t index) const
+    {
+        return index == 0 ? 0 : ends[index - 1];
+    }
+    size_t polygonVertexCount(size_t index) const
+    {
+        return ends[index] - polygonStart(index);
+    }
+    const Vertex *polygon(size_t index) const
+    {
+        return vertices.data() + polygonStart(index);
+    }
+    Vertex *polygon(size_t index)
+    {
+        return vertices.data() + polygonStart(index);
+    }
+    Vertex *vertexData()
+    {
+        return vertices.data();
+    }
+    void addVertex(const Vertex &v)
+    {
+        if(vertices.size() > currentStart() && sameVertex(vertices.back(), v))
+            return;
+        vertices.push_back(v);
+    }
+    void endPolygon()
+    {
+        size_t start = currentStart();
+        if(vertices.size() > start + 1 && sameVertex(vertices[start], vertices.back()))
+            vertices.pop_back();
+        if(vertices.size() < start + 3)
+        {
+            vertices.resize(start);
+            return;
+        }
+        ends.push_back((uint32_t)vertices.size());
+    }
+    void addPolygon(const Vertex *polygonVertices, size_t polygonVertexCount)
+    {
+        for(size_t i = 0; i < polygonVertexCount; i++)
+            addVertex(polygonVertices[i]);
+        endPolygon();
+    }
+    void addTriangle(const Triangle &tri)
+    {
+        addVertex(tri.v1());
+        addVertex(tri.v2());
+        addVertex(tri.v3());
+        endPolygon();
+    }
+    /// appends polygons [first, last) of source
+    void append(const PolygonList &source, size_t first, size_t last)
+    {
+        assert(&source != this && first <= last && last <= source.size());
+        if(first == last)
+            return;
+        size_t sourceStart = source.polygonStart(first);
+        size_t offset = currentStart();
+        vertices.insert(vertices.end(), source.vertices.begin() + sourceStart, source.vertices.begin() + source.ends[last - 1]);
+        for(size_t i = first; i < last; i++)
+            ends.push_back((uint32_t)(source.ends[i] - sourceStart + offset));
+    }
+    void append(const PolygonList &source)
+    {
+        append(source, 0, source.size());
+    }
+    /// keeps only the first count polygons
+    void truncate(size_t count)
+    {
+        assert(count <= size());
+        vertices.resize(polygonStart(count));
+        ends.resize(count);
+    }
+    void erase(size_t index)
+    {
+        size_t start = polygonStart(index);
+        uint32_t count = (uint32_t)polygonVertexCount(index);
+        vertices.erase(vertices.begin() + start, vertices.begin() + ends[index]);
+        ends.erase(ends.begin() + index);
+        for(size_t i = index; i < ends.size(); i++)
+            ends[i] -= count;
+    }
+    /// removes the polygons that fn(vertices, vertexCount) returns true for
+    template <typename Fn>
+    void removeIf(const Fn &fn)
+    {
+        size_t writeVertex = 0, writePolygon = 0, start = 0;
+        for(size_t i = 0; i < ends.size(); i++)
+        {
+            size_t end = ends[i];
+            if(!fn((const Vertex *)&vertices[start], end - start))
+            {
+                if(writeVertex != start)
+                    std::copy(vertices.begin() + start, vertices.begin() + end, vertices.begin() + writeVertex);
+                writeVertex += end - start;
+                ends[writePolygon++] = (uint32_t)writeVertex;
+            }
+            start = end;
+        }
+        vertices.resize(writeVertex);
+        ends.resize(writePolygon);
+    }
+    void getTriangles(vector<Triangle> &dest) const
+    {
+        for(size_t i = 0; i < size(); i++)
+            triangulate(dest, polygon(i), polygonVertexCount(i));
+    }
+};
+
+/** splits a convex polygon by a plane
+ *
+ * Works like CutTriangle but keeps each side as one polygon. Returns true
+ * without adding anything if the polygon lies in the plane.
+ */
+inline bool cutPolygon(const Vertex *vertices, size_t vertexCount, VectorF planeNormal, float planeD, PolygonList &front, PolygonList &back)
+{
+    bool anyFront = false, anyBack = false;
+    for(size_t i = 0; i < vertexCount; i++)
+    {
+        float distance = dot(vertices[i].p, planeNormal) + planeD;
+        if(distance > eps)
+            anyFront = true;
+        else if(distance < -eps)
+            anyBack = true;
+    }
+    if(!anyFront && !anyBack)
+        return true;
+    if(!anyBack)
+    {
+        front.addPolygon(vertices, vertexCount);
+        return false;
+    }
+    if(!anyFront)
+    {
+        back.addPolygon(vertices, vertexCount);
+        return false;
+    }
+    // vertices in the plane go with the front side, as in CutTriangle
+    for(size_t i = 0, j = 1; i < vertexCount; i++, j++, j %= vertexCount)
+    {
+        float distanceI = dot(vertices[i].p, planeNormal) + planeD;
+        float distanceJ = dot(vertices[j].p, planeNormal) + planeD;
+        bool isFrontI = distanceI >= -eps, isFrontJ = distanceJ >= -eps;
+        if(isFrontI)
+            front.addVertex(vertices[i]);
+        else
+            back.addVertex(vertices[i]);
+        if(isFrontI != isFrontJ)
+        {
+            float divisor = dot(vertices[j].p - vertices[i].p, planeNormal);
+            if(abs(divisor) >= eps * eps)
+            {
+                float t = (-planeD - dot(vertices[i].p, planeNormal)) / divisor;
+                Vertex v = interpolate(t, vertices[i], vertices[j]);
+                front.addVertex(v);
+                back.addVertex(v);
+            }
+        }
+    }
+    front.endPolygon();
+    back.endPolygon();
+    return false;
+}
+
+#endif // POLYGON_H_INCLUDED
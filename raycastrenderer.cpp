@@ -0,0 +1,151 @@
+#include "raycastrenderer.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <atomic>
+
+using namespace std;
+
+void RayCastRenderer::render(const Mesh &m)
+{
+    shared_ptr<const Image> texture = ((m.image != nullptr) ? m.image->getImage() : whiteTexture);
+    if(textures.empty() || textures.back() != texture)
+        textures.push_back(texture);
+    // triangles behind the camera or facing away are kept so the BVH can be refit next frame; the rays miss them anyway
+    triangles.insert(triangles.end(), m.triangles.begin(), m.triangles.end());
+    triangleTextures.resize(triangles.size(), (uint32_t)textures.size() - 1);
+    size_t firstShape = shapes.size();
+    shapes.resize(triangles.size() * ShapeSize);
+    float *shapeData = &shapes[firstShape];
+    const Triangle *source = m.triangles.data();
+    parallelFor(m.triangles.size(), parallelMeshGrainSize, [shapeData, source](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+        {
+            float *shape = shapeData + i * ShapeSize;
+            shape[0] = absSquared(source[i].p2 - source[i].p1);
+            shape[1] = absSquared(source[i].p3 - source[i].p2);
+            shape[2] = absSquared(source[i].p1 - source[i].p3);
+            shape[3] = i > 0 ? absSquared(source[i].p1 - source[i - 1].p1) : 0;
+        }
+    });
+}
+
+void RayCastRenderer::tracePacket(size_t left, size_t top)
+{
+    constexpr size_t PacketSize = PacketWidth * PacketWidth;
+    static_assert(PacketSize == RayPacket::Size, "a packet has to cover a whole tile");
+    constexpr uint32_t NoHit = ~(uint32_t)0;
+    size_t w = image->w, h = image->h;
+    float centerX = 0.5 * w;
+    float centerY = 0.5 * h;
+    float scaleXToCamera = scaleX() / (w * 0.5f);
+    float scaleYToCamera = scaleY() / (h * -0.5f);
+    RayPacket packet;
+    packet.cullBackFaces = true;
+    bool active[PacketSize];
+    for(size_t i = 0; i < PacketSize; i++)
+    {
+        size_t x = left + i % PacketWidth, y = top + i / PacketWidth;
+        active[i] = x < w && y < h;
+        packet.directionX[i] = (x - centerX) * scaleXToCamera;
+        packet.directionY[i] = (y - centerY) * scaleYToCamera;
+        packet.directionZ[i] = -1;
+        packet.tMin[i] = 0;
+    }
+    ColorI layers[MaxLayers][PacketSize];
+    size_t layerCount[PacketSize] = {};
+    const vector<Triangle> &bvhTriangles = bvh.triangles();
+    for(size_t pass = 0; pass < MaxLayers; pass++)
+    {
+        bool anyActive = false;
+        for(size_t i = 0; i < PacketSize; i++)
+        {
+            anyActive = anyActive || active[i];
+            packet.tMax[i] = active[i] ? numeric_limits<float>::infinity() : packet.tMin[i];
+            packet.triangle[i] = NoHit;
+        }
+        if(!anyActive)
+            break;
+        bvh.intersect(packet);
+        for(size_t i = 0; i < PacketSize; i++)
+        {
+            if(!active[i])
+                continue;
+            if(packet.triangle[i] == NoHit)
+            {
+                active[i] = false;
+                continue;
+            }
+            const Triangle &tri = bvhTriangles[packet.triangle[i]];
+            const Image &texture = *textures[triangleTextures[bvh.originalIndex(packet.triangle[i])]];
+            float u = packet.u[i], v = packet.v[i];
+            ColorF c = RGBAF(u * (tri.c2.r - tri.c1.r) + v * (tri.c3.r - tri.c1.r) + tri.c1.r,
+                             u * (tri.c2.g - tri.c1.g) + v * (tri.c3.g - tri.c1.g) + tri.c1.g,
+                             u * (tri.c2.b - tri.c1.b) + v * (tri.c3.b - tri.c1.b) + tri.c1.b,
+                             u * (tri.c2.a - tri.c1.a) + v * (tri.c3.a - tri.c1.a) + tri.c1.a);
+            float textureU = u * (tri.t2.u - tri.t1.u) + v * (tri.t3.u - tri.t1.u) + tri.t1.u;
+            float textureV = u * (tri.t2.v - tri.t1.v) + v * (tri.t3.v - tri.t1.v) + tri.t1.v;
+            textureU -= std::floor(textureU);
+            textureV -= std::floor(textureV);
+            size_t textureX = limit<size_t>((size_t)(textureU * texture.w), 0, texture.w - 1);
+            size_t textureY = limit<size_t>((size_t)(textureV * texture.h), 0, texture.h - 1);
+            ColorI fragmentColor = colorize(c, texture.getPixels()[textureX + texture.w * (texture.h - textureY - 1)]);
+            if(fragmentColor.a != 0)
+                layers[layerCount[i]++][i] = fragmentColor;
+            if(fragmentColor.a == 0xFF)
+                active[i] = false;
+            packet.tMin[i] = packet.tMax[i];
+        }
+    }
+    for(size_t i = 0; i < PacketSize; i++)
+    {
+        size_t x = left + i % PacketWidth, y = top + i / PacketWidth;
+        if(x >= w || y >= h)
+            continue;
+        ColorI pixel = background;
+        for(size_t layer = layerCount[i]; layer-- > 0;)
+            pixel = compose(layers[layer][i], pixel);
+        image->getLineAddress(y)[x] = pixel;
+    }
+}
+
+/// if this frame's triangles are the ones the BVH was built from, with each mesh only moved rigidly
+bool RayCastRenderer::canRefit() const
+{
+    if(refitCount >= MaxRefitCount || builtShapes.size() != shapes.size())
+        return false;
+    atomic_bool matches(true);
+    parallelFor(shapes.size(), parallelMeshGrainSize, [this, &matches](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end && matches.load(memory_order_relaxed); i++)
+        {
+            if(std::fabs(shapes[i] - builtShapes[i]) > 1e-3f * max(shapes[i], builtShapes[i]) + 1e-12f)
+                matches.store(false, memory_order_relaxed);
+        }
+    });
+    return matches.load();
+}
+
+shared_ptr<Texture> RayCastRenderer::finish()
+{
+    if(canRefit())
+    {
+        bvh.refit(triangles);
+        refitCount++;
+    }
+    else
+    {
+        bvh = BVH(triangles);
+        refitCount = 0;
+        builtShapes = shapes;
+    }
+    size_t tilesX = (image->w + PacketWidth - 1) / PacketWidth;
+    size_t tilesY = (image->h + PacketWidth - 1) / PacketWidth;
+    parallelFor(tilesX * tilesY, 64, [this, tilesX](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+            tracePacket(i % tilesX * PacketWidth, i / tilesX * PacketWidth);
+    });
+    textOverlay.draw(*image);
+    return imageTexture;
+}
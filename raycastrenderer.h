@@ -0,0 +1,88 @@
+#ifndef RAYCASTRENDERER_H_INCLUDED
+#define RAYCASTRENDERER_H_INCLUDED
+
+#include "renderer.h"
+#include "bvh.h"
+#include <vector>
+
+using namespace std;
+
+/** renders by casting a ray through every pixel instead of rasterizing
+ *
+ * Meshes are only collected until finish(), which traces 4x4 ray packets
+ * through a BVH over them, spread across the render threads by tile. The
+ * tracing cost grows with the number of pixels and only logarithmically
+ * with the number of triangles. When a frame's triangles are the last
+ * frame's moved rigidly, as they are when only the camera moves, the BVH is
+ * refit instead of rebuilt. That is found by checking the edge lengths of
+ * every triangle and its distance to the one before it in its mesh, as the
+ * meshes don't say where they came from. The
+ * triangles still arrive in camera space every frame, so collecting them
+ * and refitting stays linear in the triangle count; only the tracing is
+ * sublinear. Translucent surfaces are composited in depth order rather
+ * than drawing order, so enableWriteDepth() has no effect.
+ */
+class RayCastRenderer : public ImageRenderer
+{
+private:
+    shared_ptr<Image> image;
+    shared_ptr<const Image> whiteTexture;
+    shared_ptr<ImageTexture> imageTexture;
+    vector<Triangle> triangles;
+    vector<uint32_t> triangleTextures;
+    vector<shared_ptr<const Image>> textures;
+    BVH bvh;
+    /// for each triangle the squared lengths of its edges and of the step from the one before it in its mesh, which stay the same when a mesh moves rigidly
+    vector<float> shapes, builtShapes;
+    size_t refitCount = 0;
+    TextOverlay textOverlay;
+    ColorI background = RGBAI(0, 0, 0, 0xFF);
+    float aspectRatio;
+    static constexpr size_t PacketWidth = 4;
+    /// the most surfaces a ray looks through
+    static constexpr size_t MaxLayers = 8;
+    /// the BVH is rebuilt after this many refits, as rotating the triangles makes the boxes looser
+    static constexpr size_t MaxRefitCount = 30;
+    void tracePacket(size_t left, size_t top);
+    static constexpr size_t ShapeSize = 4;
+    bool canRefit() const;
+public:
+    RayCastRenderer(size_t w, size_t h, float aspectRatio = -1)
+        : image(make_shared<Image>(w, h)), whiteTexture(make_shared<Image>(RGBI(0xFF, 0xFF, 0xFF))), aspectRatio(aspectRatio)
+    {
+        imageTexture = make_shared<ImageTexture>(image);
+    }
+    using Renderer::render;
+    virtual void render(const Mesh &m) override;
+    virtual void calcScales() override
+    {
+        Renderer::calcScales(image->w, image->h, aspectRatio);
+    }
+protected:
+    virtual void clearInternal(ColorF bg) override
+    {
+        triangles.clear();
+        shapes.clear();
+        triangleTextures.clear();
+        textures.clear();
+        textOverlay.clear();
+        background = (ColorI)bg;
+    }
+public:
+    virtual shared_ptr<Texture> finish() override;
+    virtual void enableWriteDepth(bool) override
+    {
+    }
+    virtual void resize(size_t newW, size_t newH, float newAspectRatio = -1) override
+    {
+        image = make_shared<Image>(newW, newH);
+        imageTexture = make_shared<ImageTexture>(image);
+        aspectRatio = newAspectRatio;
+    }
+    virtual void renderText(int x, int y, const wstring &str, ColorF color = GrayscaleF(1)) override
+    {
+        textOverlay.add(x, y, str, color);
+    }
+};
+
+#endif // RAYCASTRENDERER_H_INCLUDED
@@ -1,5 +1,6 @@
 #include "renderer.h"
 #include "softrender.h"
+#include "raycastrenderer.h"
 #include "libaarenderer.h"
 #include "cacarenderer.h"
 #include "ffmpeg_renderer.h"
@@ -98,7 +99,8 @@ private:
     size_t w, h;
     float aspectRatio;
 public:
-    SDLWindowRenderer()
+    /// the image renderer comes from makeImageRenderer, as the driver isn't chosen yet while this is being made
+    explicit SDLWindowRenderer(function<shared_ptr<ImageRenderer>(size_t w, size_t h, float aspectRatio)> makeImageRenderer)
     {
         if(SDL_Init(SDL_INIT_VIDEO) != 0)
         {
@@ -174,6 +176,14 @@ public:
     {
         imageRenderer->render(m);
     }
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override
+    {
+        return imageRenderer->createStaticMesh(m);
+    }
+    virtual void render(const StaticMesh &m, Transform tform) override
+    {
+        imageRenderer->render(m, tform);
+    }
     virtual void enableWriteDepth(bool v) override
     {
         imageRenderer->enableWriteDepth(v);
@@ -268,7 +278,10 @@ private:
     SDL_GLContext glContext;
     size_t w, h;
     bool supportsExtFrameBufferObjects;
+    bool supportsVertexBufferObjects;
     vector<float> vertexArray, textureCoordArray, colorArray;
+    /// lets static meshes tell when this renderer is gone, it's reset first thing in the destructor
+    shared_ptr<OpenGLWindowRenderer *> contextToken;
 
     template <typename... Args>
     static void debugDumpGLInternal(Args... args);
@@ -457,6 +470,14 @@ while(0)
     DECLARE_GL_FUNCTION(void, glTexSubImage2D, (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid *pixels));
     DECLARE_GL_FUNCTION(void, glGetTexImage, (GLenum target, GLint level, GLenum format, GLenum type, GLvoid * img));
     DECLARE_GL_FUNCTION(void, glCopyTexSubImage2D, (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint x, GLint y, GLsizei width, GLsizei height));
+    DECLARE_GL_FUNCTION(void, glLoadMatrixf, (const GLfloat *m));
+
+    // in GL_ARB_vertex_buffer_object
+    DECLARE_GL_FUNCTION(void, glGenBuffersARB, (GLsizei n, GLuint *buffers));
+    DECLARE_GL_FUNCTION(void, glDeleteBuffersARB, (GLsizei n, const GLuint *buffers));
+    DECLARE_GL_FUNCTION(void, glBindBufferARB, (GLenum target, GLuint buffer));
+    DECLARE_GL_FUNCTION(void, glBufferDataARB, (GLenum target, GLsizeiptrARB size, const GLvoid *data, GLenum usage));
+    DECLARE_GL_FUNCTION(void, glGetBufferSubDataARB, (GLenum target, GLintptrARB offset, GLsizeiptrARB size, GLvoid *data));
 
     // in GL_EXT_framebuffer_object
     DECLARE_GL_FUNCTION(void, glGenFramebuffersEXT, (GLsizei n, GLuint *framebuffers));
@@ -503,6 +524,16 @@ while(0)
         LOAD_GL_FUNCTION(glTexSubImage2D);
         LOAD_GL_FUNCTION(glGetTexImage);
         LOAD_GL_FUNCTION(glCopyTexSubImage2D);
+        LOAD_GL_FUNCTION(glLoadMatrixf);
+        supportsVertexBufferObjects = SDL_GL_ExtensionSupported("GL_ARB_vertex_buffer_object");
+        if(supportsVertexBufferObjects)
+        {
+            LOAD_GL_FUNCTION(glGenBuffersARB);
+            LOAD_GL_FUNCTION(glDeleteBuffersARB);
+            LOAD_GL_FUNCTION(glBindBufferARB);
+            LOAD_GL_FUNCTION(glBufferDataARB);
+            LOAD_GL_FUNCTION(glGetBufferSubDataARB);
+        }
         supportsExtFrameBufferObjects = SDL_GL_ExtensionSupported("GL_EXT_framebuffer_object");
         if(supportsExtFrameBufferObjects)
         {
@@ -585,6 +616,130 @@ while(0)
         }
     }
 
+    /** a StaticMesh with its vertex arrays packed once, into a vertex buffer object when those are supported
+     *
+     * Only the normals stay in memory next to the buffer; unpack() reads the rest back from it.
+     * The mesh only holds a weak reference to its renderer, so it can outlive the renderer.
+     * Once the renderer is gone its buffer is gone too, and unpack() gives an empty mesh.
+     */
+    struct GLStaticMesh final : public StaticMesh
+    {
+        weak_ptr<OpenGLWindowRenderer *> rendererToken;
+        shared_ptr<Texture> image;
+        size_t triangles;
+        /// the position, texture coordinate and color of each vertex, only kept when there's no buffer
+        vector<float> vertexData;
+        vector<VectorF> normals;
+        GLuint buffer = 0;
+        static constexpr size_t VertexSize = 3 + 2 + 4;
+        GLStaticMesh(OpenGLWindowRenderer * renderer, const Mesh &mesh, shared_ptr<Texture> image)
+            : rendererToken(renderer->contextToken), image(image), triangles(mesh.triangles.size())
+        {
+            vertexData.reserve(triangles * 3 * VertexSize);
+            normals.reserve(triangles * 3);
+            for(const Triangle &tri : mesh.triangles)
+            {
+                for(Vertex v : {tri.v1(), tri.v2(), tri.v3()})
+                {
+                    vertexData.insert(vertexData.end(), {v.p.x, v.p.y, v.p.z, v.t.u, v.t.v, v.c.r, v.c.g, v.c.b, v.c.a});
+                    normals.push_back(v.n);
+                }
+            }
+            if(renderer->supportsVertexBufferObjects && !vertexData.empty())
+            {
+                renderer->glGenBuffersARB(1, &buffer);
+                renderer->glBindBufferARB(GL_ARRAY_BUFFER_ARB, buffer);
+                renderer->glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertexData.size() * sizeof(float), (const GLvoid *)vertexData.data(), GL_STATIC_DRAW_ARB);
+                renderer->glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+                vector<float>().swap(vertexData);
+            }
+        }
+        virtual ~GLStaticMesh()
+        {
+            OpenGLWindowRenderer * renderer = getRenderer();
+            if(renderer != nullptr)
+                renderer->destroyGLStaticMesh(*this);
+        }
+        /// returns nullptr once the renderer is destroyed
+        OpenGLWindowRenderer * getRenderer() const
+        {
+            shared_ptr<OpenGLWindowRenderer *> renderer = rendererToken.lock();
+            if(renderer == nullptr)
+                return nullptr;
+            return *renderer;
+        }
+        virtual size_t triangleCount() const override
+        {
+            return triangles;
+        }
+        virtual void unpack(Mesh &dest, Transform tform) const override
+        {
+            dest.triangles.clear();
+            dest.image = image;
+            const float * data = vertexData.data();
+            vector<float> bufferData;
+            if(buffer != 0)
+            {
+                OpenGLWindowRenderer * renderer = getRenderer();
+                if(renderer == nullptr)
+                    return;
+                bufferData.resize(triangles * 3 * VertexSize);
+                renderer->glBindBufferARB(GL_ARRAY_BUFFER_ARB, buffer);
+                renderer->glGetBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, bufferData.size() * sizeof(float), (GLvoid *)bufferData.data());
+                renderer->glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+                data = bufferData.data();
+            }
+            Matrix m = tform.get();
+            NormalTransform normalTransform(tform);
+            dest.triangles.reserve(triangles);
+            for(size_t i = 0; i < triangles; i++)
+            {
+                Vertex v[3];
+                for(size_t j = 0; j < 3; j++)
+                {
+                    const float * vertex = &data[(i * 3 + j) * VertexSize];
+                    v[j] = Vertex(VectorF(vertex[0], vertex[1], vertex[2]), TextureCoord(vertex[3], vertex[4]), RGBAF(vertex[5], vertex[6], vertex[7], vertex[8]), normals[i * 3 + j]);
+                }
+                dest.triangles.push_back(transform(m, normalTransform, Triangle(v[0], v[1], v[2])));
+            }
+        }
+    };
+
+    void destroyGLStaticMesh(GLStaticMesh & m)
+    {
+        if(glContext != nullptr && m.buffer != 0)
+        {
+            glDeleteBuffersARB(1, &m.buffer);
+            m.buffer = 0;
+        }
+    }
+
+    /// the context has to be set up first
+    void drawStaticMesh(const GLStaticMesh & m, Transform tform)
+    {
+        if(m.triangleCount() == 0)
+            return;
+        bindImage(m.image);
+        uintptr_t base = 0;
+        if(m.buffer != 0)
+            glBindBufferARB(GL_ARRAY_BUFFER_ARB, m.buffer);
+        else
+            base = reinterpret_cast<uintptr_t>(m.vertexData.data());
+        const GLsizei stride = GLStaticMesh::VertexSize * sizeof(float);
+        glVertexPointer(3, GL_FLOAT, stride, reinterpret_cast<const void *>(base));
+        glTexCoordPointer(2, GL_FLOAT, stride, reinterpret_cast<const void *>(base + 3 * sizeof(float)));
+        glColorPointer(4, GL_FLOAT, stride, reinterpret_cast<const void *>(base + 5 * sizeof(float)));
+        // Matrix is row major for row vectors, which is the same layout as OpenGL's column major for column vectors
+        Matrix matrix = tform.get();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixf(&matrix.x[0][0]);
+        glDrawArrays(GL_TRIANGLES, 0, (GLint)m.triangleCount() * 3);
+        glLoadIdentity();
+        glMatrixMode(GL_PROJECTION);
+        if(m.buffer != 0)
+            glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+    }
+
     shared_ptr<GLTexture> createTexture(size_t w, size_t h)
     {
         shared_ptr<GLTexture> retval = make_shared<GLTexture>(this);
@@ -765,10 +920,12 @@ public:
             throw e;
         }
         setupContext();
+        contextToken = make_shared<OpenGLWindowRenderer *>(this);
         windowRenderer = this;
     }
     virtual ~OpenGLWindowRenderer()
     {
+        contextToken = nullptr;
         windowRenderer = nullptr;
         SDL_GL_DeleteContext(glContext);
         glContext = nullptr;
@@ -837,6 +994,23 @@ public:
         glColorPointer(4, GL_FLOAT, 0, (const void *)&colorArray[0]);
         glDrawArrays(GL_TRIANGLES, 0, (GLint)m.triangles.size() * 3);
     }
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override
+    {
+        return make_shared<GLStaticMesh>(this, m, preloadTexture(m.image));
+    }
+    virtual void render(const StaticMesh &m, Transform tform) override
+    {
+        const GLStaticMesh *glMesh = dynamic_cast<const GLStaticMesh *>(&m);
+        if(glMesh == nullptr || glMesh->getRenderer() != this)
+        {
+            Renderer::render(m, tform);
+            return;
+        }
+        if(supportsExtFrameBufferObjects)
+            setupContext();
+        glDepthMask(writeDepth ? GL_TRUE : GL_FALSE);
+        drawStaticMesh(*glMesh, tform);
+    }
     virtual void enableWriteDepth(bool v) override
     {
         writeDepth = v;
@@ -941,6 +1115,34 @@ private:
     }
 
     bool writeDepth = true;
+
+    struct TextItem
+    {
+        int x, y;
+        wstring str;
+        ColorF color;
+    };
+    vector<TextItem> textItems;
+    shared_ptr<Texture> fontTexture;
+
+    /// there's no framebuffer in memory to draw into, so the text goes through Generate::Text after the depth buffer is cleared
+    void renderTextItems()
+    {
+        if(textItems.empty())
+            return;
+        if(fontTexture == nullptr)
+            fontTexture = loadTextFontTexture();
+        renderer->glClear(GL_DEPTH_BUFFER_BIT);
+        float pixelScaleX = 2 * scaleX() / w, pixelScaleY = 2 * scaleY() / h;
+        for(const TextItem &item : textItems)
+        {
+            float lineCount = Generate::Text::height(item.str);
+            Matrix tform = Matrix::scale(textFontCharacterSize * pixelScaleX, textFontCharacterSize * pixelScaleY, 1)
+                .concat(Matrix::translate((item.x - 0.5f * w) * pixelScaleX, (0.5f * h - item.y - textFontCharacterSize * lineCount) * pixelScaleY, -1));
+            render(transform(tform, Generate::Text::cachedMesh(item.str, fontTexture, item.color)));
+        }
+        textItems.clear();
+    }
 public:
     OpenGLImageRenderer(size_t w, size_t h, float aspectRatio, OpenGLWindowRenderer * renderer = OpenGLWindowRenderer::windowRenderer)
         : w(w), h(h), aspectRatio(aspectRatio), renderer(renderer)
@@ -958,6 +1160,7 @@ protected:
         renderer->glDepthMask(GL_TRUE);
         renderer->glClearColor(bg.r, bg.g, bg.b, bg.a);
         renderer->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        textItems.clear();
     }
 public:
     virtual void calcScales() override
@@ -1010,6 +1213,22 @@ public:
         renderer->glColorPointer(4, GL_FLOAT, 0, (const void *)&colorArray[0]);
         renderer->glDrawArrays(GL_TRIANGLES, 0, (GLint)m.triangles.size() * 3);
     }
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override
+    {
+        return make_shared<OpenGLWindowRenderer::GLStaticMesh>(renderer, m, preloadTexture(m.image));
+    }
+    virtual void render(const StaticMesh &m, Transform tform) override
+    {
+        const OpenGLWindowRenderer::GLStaticMesh *glMesh = dynamic_cast<const OpenGLWindowRenderer::GLStaticMesh *>(&m);
+        if(glMesh == nullptr || glMesh->getRenderer() != renderer)
+        {
+            Renderer::render(m, tform);
+            return;
+        }
+        setupContext();
+        renderer->glDepthMask(writeDepth ? GL_TRUE : GL_FALSE);
+        renderer->drawStaticMesh(*glMesh, tform);
+    }
     virtual void enableWriteDepth(bool v) override
     {
         writeDepth = v;
@@ -1017,6 +1236,7 @@ public:
     virtual shared_ptr<Texture> finish() override
     {
         setupContext();
+        renderTextItems();
         bindImage(image);
         renderer->glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, w, h);
         image->invalidate();
@@ -1039,6 +1259,10 @@ public:
         aspectRatio = newAspectRatio;
         setup();
     }
+    virtual void renderText(int x, int y, const wstring &str, ColorF color = GrayscaleF(1)) override
+    {
+        textItems.push_back(TextItem{x, y, str, color});
+    }
 };
 #endif
 class NullWindowRenderer : public WindowRenderer
@@ -1081,6 +1305,11 @@ shared_ptr<ImageRenderer> makeSoftwareImageRenderer(size_t w, size_t h, float as
     return make_shared<SoftwareRenderer>(w, h, aspectRatio);
 }
 
+shared_ptr<ImageRenderer> makeRayCastImageRenderer(size_t w, size_t h, float aspectRatio)
+{
+    return make_shared<RayCastRenderer>(w, h, aspectRatio);
+}
+
 shared_ptr<ImageRenderer> makeOpenGLImageRenderer(size_t w, size_t h, float aspectRatio)
 {
 #ifndef __EMSCRIPTEN__
@@ -1136,16 +1365,9 @@ class FFmpegOpenGLRenderer : public WindowRenderer
     shared_ptr<Texture> fontTexture;
     void renderCharacter(Mesh &dest, int x, int y, char ch)
     {
-        TextureDescriptor td = getTextFontCharacterTextureDescriptor(ch, fontTexture);
-        if(!td)
+        if(fontTexture == nullptr)
             return;
-        ColorF c = RGBF(0, 0, 0);
-        dest.append(Generate::quadrilateral(td,
-                                            VectorF(0 + x, 0 + y, 0), c,
-                                            VectorF(1 + x, 0 + y, 0), c,
-                                            VectorF(1 + x, 1 + y, 0), c,
-                                            VectorF(0 + x, 1 + y, 0), c
-                                            ));
+        Generate::GlyphTable::get(fontTexture).appendGlyph(dest, ch, x, y, RGBF(0, 0, 0));
     }
     void renderText(Mesh &dest, int x, int y, string str)
     {
@@ -1177,6 +1399,14 @@ public:
     {
         ffmpegRenderer->render(m);
     }
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override
+    {
+        return ffmpegRenderer->createStaticMesh(m);
+    }
+    virtual void render(const StaticMesh &m, Transform tform) override
+    {
+        ffmpegRenderer->render(m, tform);
+    }
     virtual void enableWriteDepth(bool v) override
     {
         ffmpegRenderer->enableWriteDepth(v);
@@ -1224,13 +1454,14 @@ const Driver drivers[] =
     Driver("opengl", []()->shared_ptr<WindowRenderer>{return make_shared<OpenGLWindowRenderer>();}, makeOpenGLImageRenderer),
     Driver("opengl-no-fbo", []()->shared_ptr<WindowRenderer>{return make_shared<OpenGLWindowRenderer>();}, makeSoftwareImageRenderer),
 #endif
-    Driver("sdl", []()->shared_ptr<WindowRenderer>{return make_shared<SDLWindowRenderer>();}, makeSoftwareImageRenderer),
+    Driver("sdl", []()->shared_ptr<WindowRenderer>{return make_shared<SDLWindowRenderer>(makeSoftwareImageRenderer);}, makeSoftwareImageRenderer),
 #ifndef __EMSCRIPTEN__
     Driver("svga", makeSVGARenderer, makeSoftwareImageRenderer),
     Driver("caca", makeCacaRenderer, makeSoftwareImageRenderer),
     Driver("aalib", makeLibAARenderer, makeSoftwareImageRenderer),
 #endif
     Driver("null", []()->shared_ptr<WindowRenderer>{return make_shared<NullWindowRenderer>();}, makeSoftwareImageRenderer),
+    Driver("raycast", []()->shared_ptr<WindowRenderer>{return make_shared<SDLWindowRenderer>(makeRayCastImageRenderer);}, makeRayCastImageRenderer),
 #ifndef __EMSCRIPTEN__
     Driver("ffmpeg", makeFFmpegOpenGLRenderer, makeOpenGLImageRenderer),
     Driver("ffmpeg-no-opengl", makeFFmpegNoOpenGLRenderer, makeSoftwareImageRenderer),
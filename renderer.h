@@ -2,6 +2,9 @@
 #define RENDERER_H_INCLUDED
 
 #include "mesh.h"
+#include "arena.h"
+#include "compact_mesh.h"
+#include "bsp_tree.h"
 #include <chrono>
 
 using namespace std;
@@ -12,6 +15,47 @@ inline double realTimer()
     return 1e-9 * timePointInNanoseconds.time_since_epoch().count();
 }
 
+/** a mesh a renderer has prepared once, so drawing it every frame only costs its transform
+ *
+ * Made by Renderer::createStaticMesh(). Another renderer can still draw
+ * one, through unpack().
+ */
+class StaticMesh
+{
+public:
+    StaticMesh(const StaticMesh &) = delete;
+    const StaticMesh &operator =(const StaticMesh &) = delete;
+    StaticMesh()
+    {
+    }
+    virtual ~StaticMesh()
+    {
+    }
+    virtual size_t triangleCount() const = 0;
+    /// writes the triangles, transformed by tform, to dest
+    virtual void unpack(Mesh &dest, Transform tform) const = 0;
+};
+
+/// the StaticMesh for renderers that have no better way to keep a mesh
+class UnpackedStaticMesh final : public StaticMesh
+{
+private:
+    Mesh mesh;
+public:
+    explicit UnpackedStaticMesh(const Mesh &mesh)
+        : mesh(mesh)
+    {
+    }
+    virtual size_t triangleCount() const override
+    {
+        return mesh.triangles.size();
+    }
+    virtual void unpack(Mesh &dest, Transform tform) const override
+    {
+        dest.assign(mesh, tform);
+    }
+};
+
 struct Renderer
 {
     Renderer(const Renderer & rt) = delete;
@@ -27,27 +71,27 @@ struct Renderer
     }
     void render(TransformedMesh m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(ColorizedTransformedMesh m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(ColorizedMesh m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(TransformedMeshRef m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(ColorizedTransformedMeshRef m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(ColorizedMeshRef m)
     {
-        render((Mesh)m);
+        renderTemporary(m);
     }
     void render(TransformedMeshRRef &&m)
     {
@@ -61,9 +105,61 @@ struct Renderer
     {
         render(Mesh(std::move(m)));
     }
+    /// renderers that can read a CompactMesh directly override this
+    virtual void render(const CompactMesh &m, Transform tform)
+    {
+        FrameArenaScope scope(arena);
+        Mesh &temp = arena.allocate();
+        m.unpack(temp, tform);
+        render(temp);
+    }
+    void render(const CompactMesh &m)
+    {
+        render(m, Transform(Matrix::identity()));
+    }
+    /// prepares m for drawing with render(const StaticMesh &, Transform) every frame
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m)
+    {
+        return make_shared<UnpackedStaticMesh>(m);
+    }
+    /// draws m, which tform takes to camera space
+    virtual void render(const StaticMesh &m, Transform tform)
+    {
+        FrameArenaScope scope(arena);
+        Mesh &temp = arena.allocate();
+        m.unpack(temp, tform);
+        render(temp);
+    }
+    /** draws tree, which tform takes to camera space, in painter's order
+     *
+     * Blended trees are drawn back to front, which gets transparency right
+     * without depth sorting. Opaque trees are drawn front to back so hidden
+     * fragments fail the depth test before they're shaded.
+     */
+    void render(const BSPTree &tree, Transform tform, shared_ptr<Texture> image = nullptr, bool blended = false)
+    {
+        FrameArenaScope scope(arena);
+        Mesh &temp = arena.allocate(std::move(image));
+        VectorF viewPoint = transform(inverse(tform), VectorF(0));
+        tree.getTriangles(temp.triangles, viewPoint, blended ? DrawOrder::BackToFront : DrawOrder::FrontToBack);
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        mapTrianglesInPlace(temp.triangles, [&m, &normalTransform](const Triangle &tri)
+        {
+            return transform(m, normalTransform, tri);
+        });
+        render(temp);
+    }
     virtual void calcScales() = 0;
 protected:
     virtual void clearInternal(ColorF bg) = 0;
+    FrameArena arena;
+    template <typename T>
+    void renderTemporary(const T &m)
+    {
+        FrameArenaScope scope(arena);
+        render(arena.allocateCopy(m));
+    }
     float scaleXValue = 1;
     float scaleYValue = 1;
     double lastFlipTime = -1;
@@ -128,9 +224,15 @@ public:
     }
     void clear(ColorF backgroundColor = RGBF(0, 0, 0))
     {
+        arena.reset();
         calcScales();
         clearInternal(backgroundColor);
     }
+    /// scratch meshes that stay valid until the next clear()
+    FrameArena &frameArena()
+    {
+        return arena;
+    }
     float scaleX() const
     {
         return scaleXValue;
@@ -155,10 +257,43 @@ struct WindowRenderer : public Renderer
     }
 };
 
+/// text from ImageRenderer::renderText() waiting to be drawn over the finished frame
+class TextOverlay final
+{
+private:
+    struct Item
+    {
+        int x, y;
+        wstring str;
+        ColorI color;
+    };
+    vector<Item> items;
+public:
+    void add(int x, int y, const wstring &str, ColorF color)
+    {
+        items.push_back(Item{x, y, str, (ColorI)color});
+    }
+    void clear()
+    {
+        items.clear();
+    }
+    void draw(Image &image) const
+    {
+        for(const Item &item : items)
+            drawText(image, item.x, item.y, item.str, item.color);
+    }
+};
+
 struct ImageRenderer : public Renderer
 {
     virtual shared_ptr<Texture> finish() = 0;
     virtual void resize(size_t newW, size_t newH, float newAspectRatio = -1) = 0;
+    /** draws str over everything else in this frame with the top left of the first character at pixel (x, y)
+     *
+     * Characters are textFontCharacterSize pixels square and laid out like
+     * Generate::Text, without going through the 3D pipeline.
+     */
+    virtual void renderText(int x, int y, const wstring &str, ColorF color = GrayscaleF(1)) = 0;
 };
 
 void setDefaultRendererSize(int w, int h, float aspectRatio = -1);
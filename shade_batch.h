@@ -0,0 +1,131 @@
+#ifndef SHADE_BATCH_H_INCLUDED
+#define SHADE_BATCH_H_INCLUDED
+
+#include "vector.h"
+#include "image.h"
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+/// how many vertices are shaded at once, a multiple of every vector width so the lane loops vectorize evenly
+constexpr size_t ShadeBatchSize = 16;
+
+struct VectorBatch
+{
+    float x[ShadeBatchSize], y[ShadeBatchSize], z[ShadeBatchSize];
+    void set(size_t lane, VectorF v)
+    {
+        x[lane] = v.x;
+        y[lane] = v.y;
+        z[lane] = v.z;
+    }
+    VectorF get(size_t lane) const
+    {
+        return VectorF(x[lane], y[lane], z[lane]);
+    }
+    /// a sphere around every lane
+    void getBoundingSphere(VectorF &center, float &radius) const
+    {
+        VectorF minP = get(0), maxP = get(0);
+        for(size_t i = 1; i < ShadeBatchSize; i++)
+        {
+            minP.x = x[i] < minP.x ? x[i] : minP.x;
+            minP.y = y[i] < minP.y ? y[i] : minP.y;
+            minP.z = z[i] < minP.z ? z[i] : minP.z;
+            maxP.x = x[i] > maxP.x ? x[i] : maxP.x;
+            maxP.y = y[i] > maxP.y ? y[i] : maxP.y;
+            maxP.z = z[i] > maxP.z ? z[i] : maxP.z;
+        }
+        center = 0.5f * (minP + maxP);
+        radius = abs(maxP - center);
+    }
+};
+
+struct ColorBatch
+{
+    float r[ShadeBatchSize], g[ShadeBatchSize], b[ShadeBatchSize], a[ShadeBatchSize];
+    void set(size_t lane, ColorF c)
+    {
+        r[lane] = c.r;
+        g[lane] = c.g;
+        b[lane] = c.b;
+        a[lane] = c.a;
+    }
+    ColorF get(size_t lane) const
+    {
+        return RGBAF(r[lane], g[lane], b[lane], a[lane]);
+    }
+    void fill(ColorF c)
+    {
+        for(size_t i = 0; i < ShadeBatchSize; i++)
+            set(i, c);
+    }
+};
+
+/// what a light adds to each lane, and which lanes it reaches at all
+struct LightBatch
+{
+    ColorBatch color;
+    /// int rather than bool, the same size as a float, so selecting on it vectorizes
+    int reached[ShadeBatchSize];
+};
+
+/// add() for the lanes b reaches, with the same operations so the results match, leaving the other lanes alone
+inline void add(ColorBatch &a, const LightBatch &b)
+{
+    for(size_t i = 0; i < ShadeBatchSize; i++)
+    {
+        float alphaValue = 1 - (1 - a.a[i]) * (1 - b.color.a[i]);
+        bool transparent = (a.a[i] <= 0) & (b.color.a[i] <= 0);
+        float aScale = a.a[i] / alphaValue, bScale = b.color.a[i] / alphaValue;
+        float sumR = transparent ? a.r[i] + b.color.r[i] : a.r[i] * aScale + b.color.r[i] * bScale;
+        float sumG = transparent ? a.g[i] + b.color.g[i] : a.g[i] * aScale + b.color.g[i] * bScale;
+        float sumB = transparent ? a.b[i] + b.color.b[i] : a.b[i] * aScale + b.color.b[i] * bScale;
+        float sumA = transparent ? 0 : alphaValue;
+        a.r[i] = b.reached[i] != 0 ? sumR : a.r[i];
+        a.g[i] = b.reached[i] != 0 ? sumG : a.g[i];
+        a.b[i] = b.reached[i] != 0 ? sumB : a.b[i];
+        a.a[i] = b.reached[i] != 0 ? sumA : a.a[i];
+    }
+}
+
+/** vertices in structure of arrays form, for shading several at once
+ *
+ * A shading function with a <code>void shadeBatch(ShadeBatch &) const</code>
+ * member gets vertices a batch at a time and replaces color with the shaded
+ * colors, instead of being called once per vertex. The lanes from count on
+ * are padding. Loops over all ShadeBatchSize lanes, without branches, let
+ * the compiler vectorize at whatever width the target has.
+ */
+struct ShadeBatch
+{
+    size_t count = 0;
+    ColorBatch color;
+    VectorBatch normal, position;
+    /// copies the last vertex into the padding lanes so they hold ordinary values
+    void pad()
+    {
+        for(size_t i = count; i < ShadeBatchSize; i++)
+        {
+            color.set(i, color.get(count - 1));
+            normal.set(i, normal.get(count - 1));
+            position.set(i, position.get(count - 1));
+        }
+    }
+};
+
+/// if Fn has a shadeBatch(ShadeBatch &) member
+template <typename Fn>
+struct HasShadeBatch
+{
+private:
+    template <typename T>
+    static char test(decltype(std::declval<const T &>().shadeBatch(std::declval<ShadeBatch &>())) *);
+    template <typename T>
+    static long test(...);
+public:
+    static constexpr bool value = sizeof(test<Fn>(nullptr)) == sizeof(char);
+};
+
+#endif // SHADE_BATCH_H_INCLUDED
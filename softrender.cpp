@@ -1,8 +1,8 @@
 #include "softrender.h"
+#include "thread_pool.h"
 #include <utility>
 #include <iostream>
 #ifndef __EMSCRIPTEN__
-#include <thread>
 #include <mutex>
 #include <condition_variable>
 #endif
@@ -267,467 +267,571 @@ void SoftwareRenderer::renderTriangle(Triangle triangleIn, size_t sectionTop, si
     }
 }
 
-#ifndef __EMSCRIPTEN__
-namespace
+template <typename TriangleSource>
+void SoftwareRenderer::renderSection(const TriangleSource &source, const Image &texture, size_t sectionTop, size_t sectionBottom)
 {
-struct RenderThreadState final
-{
-    mutex lock;
-    condition_variable cond;
-    thread theThread;
-    enum class State
-    {
-        Stopped,
-        Waiting,
-        Starting,
-        Stopping,
-        Running
-    };
-    State state = State::Stopped;
-    function<void()> currentRunFunction = nullptr;
-    void run_fn()
+    size_t w = image->w, h = image->h;
+    float centerX = 0.5 * w;
+    float centerY = 0.5 * h;
+    Matrix transformToScreen = Matrix(w * 0.5 / scaleX(), 0, -centerX, -0.5,
+                             0, h * -0.5 / scaleY(), -centerY, -0.5,
+                             0, 0, 1, 0);
+    const ColorI * texturePixels = texture.getPixels();
+    size_t textureW = texture.w;
+    size_t textureH = texture.h;
+
+    size_t triangleCount = source.size();
+    for(size_t triangleIndex = 0; triangleIndex < triangleCount; triangleIndex++)
     {
-        unique_lock<mutex> lockIt(lock);
-        state = State::Waiting;
-        cond.notify_all();
-        while(state != State::Stopping)
+        Triangle tri;
+        source.getPositions(triangleIndex, tri.p1, tri.p2, tri.p3);
+        tri.p1 = transformToScreen.apply(gridify(tri.p1));
+        tri.p2 = transformToScreen.apply(gridify(tri.p2));
+        tri.p3 = transformToScreen.apply(gridify(tri.p3));
+        if(tri.p1.z >= 0 && tri.p2.z >= 0 && tri.p3.z >= 0)
+            continue;
+        PlaneEq plane = PlaneEq(tri);
+        if(plane.d >= -eps)
+            continue;
+        plane.normal /= -plane.d;
+        plane.d = -1;
+        PlaneEq edge1 = PlaneEq(VectorF(0), tri.p1, tri.p2);
+        PlaneEq edge2 = PlaneEq(VectorF(0), tri.p2, tri.p3);
+        PlaneEq edge3 = PlaneEq(VectorF(0), tri.p3, tri.p1);
+        edge1.d = 0; // assign to 0 because it helps optimization and it should already be 0
+        edge2.d = 0; // assign to 0 because it helps optimization and it should already be 0
+        edge3.d = 0; // assign to 0 because it helps optimization and it should already be 0
+
+        PlaneEq uEquation = PlaneEq(VectorF(0), tri.p1, tri.p2);
+        {
+            float divisor = uEquation.eval(tri.p3);
+            uEquation.normal /= divisor;
+            // uEquation.d == 0
+        }
+        PlaneEq vEquation = PlaneEq(VectorF(0), tri.p3, tri.p1);
+        {
+            float divisor = vEquation.eval(tri.p2);
+            vEquation.normal /= divisor;
+            // vEquation.d == 0
+        }
+
+        int_fast32_t startY = sectionTop, endY = (int_fast32_t)sectionBottom - 1;
+        if(tri.p1.z < -eps && tri.p2.z < -eps && tri.p3.z < -eps)
         {
-            while(state == State::Waiting)
-                cond.wait(lockIt);
-            if(state == State::Starting)
+            float y[3] = {-tri.p1.y / tri.p1.z, -tri.p2.y / tri.p2.z, -tri.p3.y / tri.p3.z};
+            float minY, maxY;
+            if(y[0] < y[1])
             {
-                state = State::Running;
-                cond.notify_all();
-                currentRunFunction();
-                state = State::Waiting;
-                cond.notify_all();
+                if(y[0] < y[2])
+                {
+                    minY = y[0];
+                    if(y[1] < y[2])
+                        maxY = y[2];
+                    else // y[1] >= y[2]
+                        maxY = y[1];
+                }
+                else // y[0] >= y[2];
+                {
+                    minY = y[2];
+                    maxY = y[1];
+                }
+            }
+            else // y[0] >= y[1]
+            {
+                if(y[1] < y[2])
+                {
+                    minY = y[1];
+                    if(y[0] < y[2])
+                        maxY = y[2];
+                    else // y[0] >= y[2]
+                        maxY = y[0];
+                }
+                else // y[1] >= y[2]
+                {
+                    minY = y[2];
+                    maxY = y[0];
+                }
+            }
+            if(maxY < startY || minY > endY)
+                continue;
+            if(startY < minY)
+            {
+                startY = (int_fast32_t)std::ceil(minY);
+            }
+            if(endY > maxY)
+            {
+                endY = (int_fast32_t)std::floor(maxY);
             }
-            else
-                break;
         }
-        state = State::Stopped;
-        cond.notify_all();
-    }
-    void wait()
-    {
-        unique_lock<mutex> lockIt(lock);
-        while(state == State::Running || state == State::Starting || state == State::Stopping)
-            cond.wait(lockIt);
-    }
-    void stop()
-    {
+
+        // only the triangles that reach this section need their colors and texture coordinates
+        source.getAttributes(triangleIndex, tri);
+        VectorF t1 = VectorF(tri.t1.u, tri.t1.v, 1);
+        VectorF t2 = VectorF(tri.t2.u, tri.t2.v, 1);
+        VectorF t3 = VectorF(tri.t3.u, tri.t3.v, 1);
+        for(int_fast32_t y = startY; y <= endY; y++)
         {
-            unique_lock<mutex> lockIt(lock);
-            while(state == State::Running || state == State::Starting || state == State::Stopping)
-                cond.wait(lockIt);
-            if(state == State::Stopped)
-                return;
-            state = State::Stopping;
-            cond.notify_all();
+            ColorI * imageLine = image->getLineAddress(y);
+            VectorF startPixelCoords = VectorF(0, y, -1);
+            VectorF stepPixelCoords = VectorF(1, 0, 0);
+            float startInvZ = dot(plane.normal, startPixelCoords);
+            float stepInvZ = dot(plane.normal, stepPixelCoords);
+            float startEdge1V = dot(edge1.normal, startPixelCoords) + edge1.d * startInvZ;
+            float stepEdge1V = dot(edge1.normal, stepPixelCoords) + edge1.d * stepInvZ;
+            float startEdge2V = dot(edge2.normal, startPixelCoords) + edge2.d * startInvZ;
+            float stepEdge2V = dot(edge2.normal, stepPixelCoords) + edge2.d * stepInvZ;
+            float startEdge3V = dot(edge3.normal, startPixelCoords) + edge3.d * startInvZ;
+            float stepEdge3V = dot(edge3.normal, stepPixelCoords) + edge3.d * stepInvZ;
+
+            int_fast32_t startX = 0, endX = (int_fast32_t)w - 1;
+
+            if(stepEdge1V > 0) // startEdge
+            {
+                if(-startEdge1V >= (endX + 1) * stepEdge1V)
+                    continue;
+                if(startX * stepEdge1V < -startEdge1V)
+                {
+                    startX = (int_fast32_t)std::ceil(-startEdge1V / stepEdge1V);
+                }
+            }
+            else if(stepEdge1V == 0)
+            {
+                if(startEdge1V < 0)
+                    continue;
+            }
+            else // endEdge
+            {
+                if(startEdge1V < 0)
+                    continue;
+                if(endX * stepEdge1V < -startEdge1V)
+                {
+                    endX = (int_fast32_t)std::ceil(-startEdge1V / stepEdge1V) - 1;
+                }
+            }
+            if(stepEdge2V > 0) // startEdge
+            {
+                if(-startEdge2V >= (endX + 1) * stepEdge2V)
+                    continue;
+                if(startX * stepEdge2V < -startEdge2V)
+                {
+                    startX = (int_fast32_t)std::ceil(-startEdge2V / stepEdge2V);
+                }
+            }
+            else if(stepEdge2V == 0)
+            {
+                if(startEdge2V < 0)
+                    continue;
+            }
+            else // endEdge
+            {
+                if(startEdge2V < 0)
+                    continue;
+                if(endX * stepEdge2V < -startEdge2V)
+                {
+                    endX = (int_fast32_t)std::ceil(-startEdge2V / stepEdge2V) - 1;
+                }
+            }
+            if(stepEdge3V > 0) // startEdge
+            {
+                if(-startEdge3V >= (endX + 1) * stepEdge3V)
+                    continue;
+                if(startX * stepEdge3V < -startEdge3V)
+                {
+                    startX = (int_fast32_t)std::ceil(-startEdge3V / stepEdge3V);
+                }
+            }
+            else if(stepEdge3V == 0)
+            {
+                if(startEdge3V < 0)
+                    continue;
+            }
+            else // endEdge
+            {
+                if(startEdge3V < 0)
+                    continue;
+                if(endX * stepEdge3V < -startEdge3V)
+                {
+                    endX = (int_fast32_t)std::ceil(-startEdge3V / stepEdge3V) - 1;
+                }
+            }
+
+            startPixelCoords += stepPixelCoords * startX;
+            startInvZ += stepInvZ * startX;
+            startEdge1V += stepEdge1V * startX;
+            startEdge2V += stepEdge2V * startX;
+            startEdge3V += stepEdge3V * startX;
+
+            VectorF pixelCoords = startPixelCoords;
+            float invZ = startInvZ;
+            for(int_fast32_t x = startX; x <= endX; x++, pixelCoords += stepPixelCoords, invZ += stepInvZ)
+            {
+                if(invZ < zBuffer[x + y * w])
+                    continue;
+
+                VectorF p = pixelCoords / invZ;
+
+                VectorF triPos = VectorF(uEquation.eval(p), vEquation.eval(p), 1);
+                float c1r = tri.c1.r;
+                float c1g = tri.c1.g;
+                float c1b = tri.c1.b;
+                float c1a = tri.c1.a;
+                float c2r = tri.c2.r;
+                float c2g = tri.c2.g;
+                float c2b = tri.c2.b;
+                float c2a = tri.c2.a;
+                float c3r = tri.c3.r;
+                float c3g = tri.c3.g;
+                float c3b = tri.c3.b;
+                float c3a = tri.c3.a;
+                VectorF texturePos = triPos.x * (t3 - t1) + triPos.y * (t2 - t1) + t1;
+                ColorF c = RGBAF(triPos.x * (c3r - c1r) + triPos.y * (c2r - c1r) + c1r,
+                                 triPos.x * (c3g - c1g) + triPos.y * (c2g - c1g) + c1g,
+                                 triPos.x * (c3b - c1b) + triPos.y * (c2b - c1b) + c1b,
+                                 triPos.x * (c3a - c1a) + triPos.y * (c2a - c1a) + c1a);
+
+                texturePos.x -= std::floor(texturePos.x);
+                texturePos.y -= std::floor(texturePos.y);
+
+                texturePos.x *= textureW;
+                texturePos.y *= textureH;
+
+                size_t u = limit<size_t>((size_t)texturePos.x, 0, textureW);
+                size_t v = limit<size_t>((size_t)texturePos.y, 0, textureH);
+
+                ColorI fragmentColor = colorize(c, texturePixels[u + textureW * (textureH - v - 1)]);
+
+                if(fragmentColor.a == 0)
+                    continue;
+
+                if(writeDepth)
+                    zBuffer[x + y * w] = invZ;
+
+                ColorI & pixel = imageLine[x];
+                pixel = compose(fragmentColor, pixel);
+            }
         }
-        theThread.join();
     }
-    void start(function<void()> fn)
+}
+
+template <typename TriangleSource>
+void SoftwareRenderer::renderTriangles(const TriangleSource &source, const Image &texture)
+{
+    size_t threadCount = getRenderThreadCount();
+
+    // the thread functions only capture a pointer to this so that
+    // function<void()> doesn't need to allocate
+    struct RenderJob
     {
-        assert(fn != nullptr);
-        unique_lock<mutex> lockIt(lock);
-        while(state == State::Running || state == State::Starting || state == State::Stopping)
-            cond.wait(lockIt);
-        if(state == State::Stopped)
+        SoftwareRenderer *renderer;
+        const TriangleSource *source;
+        const Image *texture;
+        size_t threadCount;
+#ifndef __EMSCRIPTEN__
+        size_t threadsLeft;
+        mutex threadsLeftLock;
+        condition_variable threadsLeftCond;
+#endif
+        void run(size_t i)
         {
-            theThread = thread([this](){run_fn();});
-            while(state == State::Stopped)
-                cond.wait(lockIt);
+            size_t h = renderer->image->h;
+            size_t sectionTop = i * h / threadCount;
+            size_t sectionBottom = (i + 1) * h / threadCount;
+            if(sectionTop != sectionBottom)
+                renderer->renderSection(*source, *texture, sectionTop, sectionBottom);
+#ifndef __EMSCRIPTEN__
+            unique_lock<mutex> lockIt(threadsLeftLock);
+            threadsLeft--;
+            threadsLeftCond.notify_all();
+#endif // __EMSCRIPTEN__
         }
-        assert(state == State::Waiting);
-        state = State::Starting;
-        currentRunFunction = fn;
-        cond.notify_all();
-    }
-    bool tryStart(function<void()> fn)
+    };
+    RenderJob job;
+    job.renderer = this;
+    job.source = &source;
+    job.texture = &texture;
+    job.threadCount = threadCount;
+#ifndef __EMSCRIPTEN__
+    job.threadsLeft = threadCount;
+#endif
+
+    for(size_t i = 0; i < threadCount; i++)
     {
-        assert(fn != nullptr);
-        unique_lock<mutex> lockIt(lock);
-        if(state == State::Running || state == State::Starting)
-            return false;
-        while(state == State::Stopping)
-            cond.wait(lockIt);
-        if(state == State::Stopped)
+        RenderJob *pJob = &job;
+        function<void()> fn = [pJob, i]()
         {
-            theThread = thread([this](){run_fn();});
-            while(state == State::Stopped)
-                cond.wait(lockIt);
-        }
-        assert(state == State::Waiting);
-        state = State::Starting;
-        currentRunFunction = fn;
-        cond.notify_all();
-        return true;
+            pJob->run(i);
+        };
+        startRenderThread(fn);
+    }
+#ifndef __EMSCRIPTEN__
+    unique_lock<mutex> lockIt(job.threadsLeftLock);
+    while(job.threadsLeft > 0)
+        job.threadsLeftCond.wait(lockIt);
+#endif
+}
+
+namespace
+{
+/** the triangles of a Mesh as renderSection reads them
+ *
+ * A triangle source gives renderSection the positions of every triangle and
+ * the texture coordinates and colors of only the triangles that reach its section.
+ */
+struct MeshTriangles final
+{
+    const vector<Triangle> &triangles;
+    explicit MeshTriangles(const vector<Triangle> &triangles)
+        : triangles(triangles)
+    {
     }
-    bool available()
+    size_t size() const
     {
-        unique_lock<mutex> lockIt(lock);
-        switch(state)
-        {
-        case State::Running:
-        case State::Starting:
-            return false;
-        case State::Stopped:
-        case State::Waiting:
-        case State::Stopping:
-            return true;
-        }
-        assert(false);
-        return false;
+        return triangles.size();
     }
-    bool stopped()
+    void getPositions(size_t index, VectorF &p1, VectorF &p2, VectorF &p3) const
     {
-        unique_lock<mutex> lockIt(lock);
-        switch(state)
-        {
-        case State::Running:
-        case State::Starting:
-        case State::Waiting:
-            return false;
-        case State::Stopped:
-        case State::Stopping:
-            return true;
-        }
-        assert(false);
-        return true;
+        const Triangle &tri = triangles[index];
+        p1 = tri.p1;
+        p2 = tri.p2;
+        p3 = tri.p3;
+    }
+    void getAttributes(size_t index, Triangle &dest) const
+    {
+        const Triangle &tri = triangles[index];
+        dest.t1 = tri.t1;
+        dest.t2 = tri.t2;
+        dest.t3 = tri.t3;
+        dest.c1 = tri.c1;
+        dest.c2 = tri.c2;
+        dest.c3 = tri.c3;
     }
 };
-struct RenderThreadPool final
+
+/// transforms every position once, across the render threads, so the sections don't each transform all of them
+template <typename GetPosition>
+void transformPositions(vector<VectorF> &dest, size_t count, const Matrix &tform, GetPosition getPosition)
+{
+    dest.resize(count);
+    VectorF *destPositions = dest.data();
+    parallelFor(count, parallelMeshGrainSize, [destPositions, &tform, &getPosition](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+            destPositions[i] = tform.apply(getPosition(i));
+    });
+}
+
+/// reads the transformed positions and unpacks the rest of a CompactMesh one triangle at a time
+struct CompactMeshTriangles final
 {
-    vector<unique_ptr<RenderThreadState>> threads;
-    RenderThreadPool()
+    const CompactMesh &mesh;
+    const VectorF *positions;
+    CompactMeshTriangles(const CompactMesh &mesh, const VectorF *positions)
+        : mesh(mesh), positions(positions)
     {
-        size_t threadCount = thread::hardware_concurrency();
-        if(threadCount == 0)
-            threadCount = 1;
-        threads.reserve(threadCount);
-        for(size_t i = 0; i < threadCount; i++)
-            threads.push_back(unique_ptr<RenderThreadState>(new RenderThreadState()));
     }
-    ~RenderThreadPool()
+    size_t size() const
     {
-        for(unique_ptr<RenderThreadState> &t : threads)
-        {
-            t->stop();
-        }
+        return mesh.triangleCount();
     }
-    size_t nextThreadIndex = 0;
-    void start(function<void()> fn)
+    void getPositions(size_t index, VectorF &p1, VectorF &p2, VectorF &p3) const
     {
-        for(size_t i = 0; i < threads.size(); i++)
-        {
-            size_t index = nextThreadIndex;
-            nextThreadIndex = (nextThreadIndex + 1) % threads.size();
-            if(threads[index]->tryStart(fn))
-                return;
-        }
-        size_t index = nextThreadIndex;
-        nextThreadIndex = (nextThreadIndex + 1) % threads.size();
-        threads[index]->start(fn);
-        return;
+        p1 = positions[index * 3];
+        p2 = positions[index * 3 + 1];
+        p3 = positions[index * 3 + 2];
+    }
+    void getAttributes(size_t index, Triangle &dest) const
+    {
+        dest.t1 = mesh.textureCoord(index * 3);
+        dest.t2 = mesh.textureCoord(index * 3 + 1);
+        dest.t3 = mesh.textureCoord(index * 3 + 2);
+        dest.c1 = mesh.color(index * 3);
+        dest.c2 = mesh.color(index * 3 + 1);
+        dest.c3 = mesh.color(index * 3 + 2);
     }
 };
-RenderThreadPool &getRenderThreadPool()
-{
-    static RenderThreadPool retval;
-    return retval;
-}
 }
-#endif
 
 void SoftwareRenderer::render(const Mesh &m)
 {
     shared_ptr<const Image> texture = ((m.image != nullptr) ? m.image->getImage() : whiteTexture);
+    renderTriangles(MeshTriangles(m.triangles), *texture);
+}
 
-#ifndef __EMSCRIPTEN__
-#ifndef DEBUG
-    size_t threadCount = thread::hardware_concurrency();
-    if(threadCount == 0)
-        threadCount = 1;
-#else
-    const size_t threadCount = 1;
-#endif
-    size_t threadsLeft = threadCount;
-    mutex threadsLeftLock;
-    condition_variable threadsLeftCond;
-#else
-    const size_t threadCount = 1;
-#endif
-
-    size_t h = image->h;
+void SoftwareRenderer::render(const CompactMesh &m, Transform tform)
+{
+    shared_ptr<const Image> texture = ((m.image != nullptr) ? m.image->getImage() : whiteTexture);
+    transformPositions(transformedPositions, m.triangleCount() * 3, tform.get(), [&m](size_t index)
+    {
+        return m.position(index);
+    });
+    renderTriangles(CompactMeshTriangles(m, transformedPositions.data()), *texture);
+}
 
-    for(size_t i = 0; i < threadCount; i++)
+namespace
+{
+/** a StaticMesh packed for triangle setup
+ *
+ * Rasterization only reads the positions, texture coordinates and colors,
+ * so those are kept together and the normals are kept apart for unpack().
+ * The bounding sphere lets meshes outside of the view be skipped whole.
+ */
+class SoftwareStaticMesh final : public StaticMesh
+{
+public:
+    struct SetupTriangle
     {
-        function<void()> fn = [i, threadCount, h, texture,
-#ifndef __EMSCRIPTEN__
-                                &threadsLeft, &threadsLeftLock, &threadsLeftCond,
-#endif // __EMSCRIPTEN__
-                                &m, this]()
+        VectorF p1, p2, p3;
+        TextureCoord t1, t2, t3;
+        ColorF c1, c2, c3;
+    };
+    vector<SetupTriangle> triangles;
+    vector<VectorF> normals;
+    shared_ptr<Texture> image;
+    VectorF center = VectorF(0);
+    float radius = 0;
+    explicit SoftwareStaticMesh(const Mesh &mesh)
+        : image(mesh.image)
+    {
+        triangles.reserve(mesh.triangles.size());
+        normals.reserve(mesh.triangles.size() * 3);
+        for(const Triangle &tri : mesh.triangles)
         {
-            size_t w = image->w, h = image->h;
-            size_t sectionTop = i * h / threadCount;
-            size_t sectionBottom = (i + 1) * h / threadCount;
-            if(sectionTop == sectionBottom)
-                return;
-            float centerX = 0.5 * w;
-            float centerY = 0.5 * h;
-            Transform transformToScreen = Matrix(w * 0.5 / scaleX(), 0, -centerX, -0.5,
-                                     0, h * -0.5 / scaleY(), -centerY, -0.5,
-                                     0, 0, 1, 0);
-            const ColorI * texturePixels = texture->getPixels();
-            size_t textureW = texture->w;
-            size_t textureH = texture->h;
-
-            for(const Triangle &triangleIn : m.triangles)
-            {
-                Triangle tri = transform(transformToScreen, gridify(triangleIn));
-                if(tri.p1.z >= 0 && tri.p2.z >= 0 && tri.p3.z >= 0)
-                    continue;
-                PlaneEq plane = PlaneEq(tri);
-                if(plane.d >= -eps)
-                    continue;
-                plane.normal /= -plane.d;
-                plane.d = -1;
-                PlaneEq edge1 = PlaneEq(VectorF(0), tri.p1, tri.p2);
-                PlaneEq edge2 = PlaneEq(VectorF(0), tri.p2, tri.p3);
-                PlaneEq edge3 = PlaneEq(VectorF(0), tri.p3, tri.p1);
-                edge1.d = 0; // assign to 0 because it helps optimization and it should already be 0
-                edge2.d = 0; // assign to 0 because it helps optimization and it should already be 0
-                edge3.d = 0; // assign to 0 because it helps optimization and it should already be 0
-
-                PlaneEq uEquation = PlaneEq(VectorF(0), tri.p1, tri.p2);
-                {
-                    float divisor = uEquation.eval(tri.p3);
-                    uEquation.normal /= divisor;
-                    // uEquation.d == 0
-                }
-                PlaneEq vEquation = PlaneEq(VectorF(0), tri.p3, tri.p1);
-                {
-                    float divisor = vEquation.eval(tri.p2);
-                    vEquation.normal /= divisor;
-                    // vEquation.d == 0
-                }
+            SetupTriangle setupTriangle;
+            setupTriangle.p1 = tri.p1;
+            setupTriangle.p2 = tri.p2;
+            setupTriangle.p3 = tri.p3;
+            setupTriangle.t1 = tri.t1;
+            setupTriangle.t2 = tri.t2;
+            setupTriangle.t3 = tri.t3;
+            setupTriangle.c1 = tri.c1;
+            setupTriangle.c2 = tri.c2;
+            setupTriangle.c3 = tri.c3;
+            triangles.push_back(setupTriangle);
+            normals.push_back(tri.n1);
+            normals.push_back(tri.n2);
+            normals.push_back(tri.n3);
+        }
+        if(triangles.empty())
+            return;
+        pair<VectorF, VectorF> extents = mesh.getExtents();
+        center = 0.5f * (extents.first + extents.second);
+        for(const SetupTriangle &tri : triangles)
+        {
+            for(VectorF p : {tri.p1, tri.p2, tri.p3})
+                radius = max(radius, abs(p - center));
+        }
+    }
+    virtual size_t triangleCount() const override
+    {
+        return triangles.size();
+    }
+    Triangle triangle(size_t index) const
+    {
+        const SetupTriangle &tri = triangles[index];
+        Triangle retval(tri.p1, tri.t1, tri.c1, tri.p2, tri.t2, tri.c2, tri.p3, tri.t3, tri.c3);
+        retval.n1 = normals[index * 3];
+        retval.n2 = normals[index * 3 + 1];
+        retval.n3 = normals[index * 3 + 2];
+        return retval;
+    }
+    virtual void unpack(Mesh &dest, Transform tform) const override
+    {
+        dest.triangles.clear();
+        dest.image = image;
+        dest.triangles.resize(triangles.size());
+        Matrix m = tform.get();
+        NormalTransform normalTransform(tform);
+        Triangle *destTriangles = dest.triangles.data();
+        parallelFor(triangles.size(), parallelMeshGrainSize, [this, destTriangles, &m, &normalTransform](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+                destTriangles[i] = transform(m, normalTransform, triangle(i));
+        });
+    }
+};
 
-                int_fast32_t startY = sectionTop, endY = (int_fast32_t)sectionBottom - 1;
-                if(tri.p1.z < -eps && tri.p2.z < -eps && tri.p3.z < -eps)
-                {
-                    float y[3] = {-tri.p1.y / tri.p1.z, -tri.p2.y / tri.p2.z, -tri.p3.y / tri.p3.z};
-                    float minY, maxY;
-                    if(y[0] < y[1])
-                    {
-                        if(y[0] < y[2])
-                        {
-                            minY = y[0];
-                            if(y[1] < y[2])
-                                maxY = y[2];
-                            else // y[1] >= y[2]
-                                maxY = y[1];
-                        }
-                        else // y[0] >= y[2];
-                        {
-                            minY = y[2];
-                            maxY = y[1];
-                        }
-                    }
-                    else // y[0] >= y[1]
-                    {
-                        if(y[1] < y[2])
-                        {
-                            minY = y[1];
-                            if(y[0] < y[2])
-                                maxY = y[2];
-                            else // y[0] >= y[2]
-                                maxY = y[0];
-                        }
-                        else // y[1] >= y[2]
-                        {
-                            minY = y[2];
-                            maxY = y[0];
-                        }
-                    }
-                    if(maxY < startY || minY > endY)
-                        continue;
-                    if(startY < minY)
-                    {
-                        startY = (int_fast32_t)std::ceil(minY);
-                    }
-                    if(endY > maxY)
-                    {
-                        endY = (int_fast32_t)std::floor(maxY);
-                    }
-                }
+/// reads the transformed positions and the rest of a SoftwareStaticMesh one triangle at a time
+struct StaticMeshTriangles final
+{
+    const SoftwareStaticMesh &mesh;
+    const VectorF *positions;
+    StaticMeshTriangles(const SoftwareStaticMesh &mesh, const VectorF *positions)
+        : mesh(mesh), positions(positions)
+    {
+    }
+    size_t size() const
+    {
+        return mesh.triangles.size();
+    }
+    void getPositions(size_t index, VectorF &p1, VectorF &p2, VectorF &p3) const
+    {
+        p1 = positions[index * 3];
+        p2 = positions[index * 3 + 1];
+        p3 = positions[index * 3 + 2];
+    }
+    void getAttributes(size_t index, Triangle &dest) const
+    {
+        const SoftwareStaticMesh::SetupTriangle &tri = mesh.triangles[index];
+        dest.t1 = tri.t1;
+        dest.t2 = tri.t2;
+        dest.t3 = tri.t3;
+        dest.c1 = tri.c1;
+        dest.c2 = tri.c2;
+        dest.c3 = tri.c3;
+    }
+};
+}
 
-                VectorF t1 = VectorF(tri.t1.u, tri.t1.v, 1);
-                VectorF t2 = VectorF(tri.t2.u, tri.t2.v, 1);
-                VectorF t3 = VectorF(tri.t3.u, tri.t3.v, 1);
-                for(int_fast32_t y = startY; y <= endY; y++)
-                {
-                    ColorI * imageLine = image->getLineAddress(y);
-                    VectorF startPixelCoords = VectorF(0, y, -1);
-                    VectorF stepPixelCoords = VectorF(1, 0, 0);
-                    float startInvZ = dot(plane.normal, startPixelCoords);
-                    float stepInvZ = dot(plane.normal, stepPixelCoords);
-                    float startEdge1V = dot(edge1.normal, startPixelCoords) + edge1.d * startInvZ;
-                    float stepEdge1V = dot(edge1.normal, stepPixelCoords) + edge1.d * stepInvZ;
-                    float startEdge2V = dot(edge2.normal, startPixelCoords) + edge2.d * startInvZ;
-                    float stepEdge2V = dot(edge2.normal, stepPixelCoords) + edge2.d * stepInvZ;
-                    float startEdge3V = dot(edge3.normal, startPixelCoords) + edge3.d * startInvZ;
-                    float stepEdge3V = dot(edge3.normal, stepPixelCoords) + edge3.d * stepInvZ;
-
-                    int_fast32_t startX = 0, endX = (int_fast32_t)w - 1;
-
-                    if(stepEdge1V > 0) // startEdge
-                    {
-                        if(-startEdge1V >= (endX + 1) * stepEdge1V)
-                            continue;
-                        if(startX * stepEdge1V < -startEdge1V)
-                        {
-                            startX = (int_fast32_t)std::ceil(-startEdge1V / stepEdge1V);
-                        }
-                    }
-                    else if(stepEdge1V == 0)
-                    {
-                        if(startEdge1V < 0)
-                            continue;
-                    }
-                    else // endEdge
-                    {
-                        if(startEdge1V < 0)
-                            continue;
-                        if(endX * stepEdge1V < -startEdge1V)
-                        {
-                            endX = (int_fast32_t)std::ceil(-startEdge1V / stepEdge1V) - 1;
-                        }
-                    }
-                    if(stepEdge2V > 0) // startEdge
-                    {
-                        if(-startEdge2V >= (endX + 1) * stepEdge2V)
-                            continue;
-                        if(startX * stepEdge2V < -startEdge2V)
-                        {
-                            startX = (int_fast32_t)std::ceil(-startEdge2V / stepEdge2V);
-                        }
-                    }
-                    else if(stepEdge2V == 0)
-                    {
-                        if(startEdge2V < 0)
-                            continue;
-                    }
-                    else // endEdge
-                    {
-                        if(startEdge2V < 0)
-                            continue;
-                        if(endX * stepEdge2V < -startEdge2V)
-                        {
-                            endX = (int_fast32_t)std::ceil(-startEdge2V / stepEdge2V) - 1;
-                        }
-                    }
-                    if(stepEdge3V > 0) // startEdge
-                    {
-                        if(-startEdge3V >= (endX + 1) * stepEdge3V)
-                            continue;
-                        if(startX * stepEdge3V < -startEdge3V)
-                        {
-                            startX = (int_fast32_t)std::ceil(-startEdge3V / stepEdge3V);
-                        }
-                    }
-                    else if(stepEdge3V == 0)
-                    {
-                        if(startEdge3V < 0)
-                            continue;
-                    }
-                    else // endEdge
-                    {
-                        if(startEdge3V < 0)
-                            continue;
-                        if(endX * stepEdge3V < -startEdge3V)
-                        {
-                            endX = (int_fast32_t)std::ceil(-startEdge3V / stepEdge3V) - 1;
-                        }
-                    }
-
-                    startPixelCoords += stepPixelCoords * startX;
-                    startInvZ += stepInvZ * startX;
-                    startEdge1V += stepEdge1V * startX;
-                    startEdge2V += stepEdge2V * startX;
-                    startEdge3V += stepEdge3V * startX;
-
-                    VectorF pixelCoords = startPixelCoords;
-                    float invZ = startInvZ;
-                    for(int_fast32_t x = startX; x <= endX; x++, pixelCoords += stepPixelCoords, invZ += stepInvZ)
-                    {
-                        if(invZ < zBuffer[x + y * w])
-                            continue;
-
-                        VectorF p = pixelCoords / invZ;
-
-                        VectorF triPos = VectorF(uEquation.eval(p), vEquation.eval(p), 1);
-                        float c1r = tri.c1.r;
-                        float c1g = tri.c1.g;
-                        float c1b = tri.c1.b;
-                        float c1a = tri.c1.a;
-                        float c2r = tri.c2.r;
-                        float c2g = tri.c2.g;
-                        float c2b = tri.c2.b;
-                        float c2a = tri.c2.a;
-                        float c3r = tri.c3.r;
-                        float c3g = tri.c3.g;
-                        float c3b = tri.c3.b;
-                        float c3a = tri.c3.a;
-                        VectorF texturePos = triPos.x * (t3 - t1) + triPos.y * (t2 - t1) + t1;
-                        ColorF c = RGBAF(triPos.x * (c3r - c1r) + triPos.y * (c2r - c1r) + c1r,
-                                         triPos.x * (c3g - c1g) + triPos.y * (c2g - c1g) + c1g,
-                                         triPos.x * (c3b - c1b) + triPos.y * (c2b - c1b) + c1b,
-                                         triPos.x * (c3a - c1a) + triPos.y * (c2a - c1a) + c1a);
-
-                        texturePos.x -= std::floor(texturePos.x);
-                        texturePos.y -= std::floor(texturePos.y);
-
-                        texturePos.x *= textureW;
-                        texturePos.y *= textureH;
-
-                        size_t u = limit<size_t>((size_t)texturePos.x, 0, textureW);
-                        size_t v = limit<size_t>((size_t)texturePos.y, 0, textureH);
-
-                        ColorI fragmentColor = colorize(c, texturePixels[u + textureW * (textureH - v - 1)]);
-
-                        if(fragmentColor.a == 0)
-                            continue;
-
-                        if(writeDepth)
-                            zBuffer[x + y * w] = invZ;
-
-                        ColorI & pixel = imageLine[x];
-                        pixel = compose(fragmentColor, pixel);
-                    }
-                }
-            }
-#ifndef __EMSCRIPTEN__
-            unique_lock<mutex> lockIt(threadsLeftLock);
-            threadsLeft--;
-            threadsLeftCond.notify_all();
-#endif // __EMSCRIPTEN__
-        };
-#ifndef __EMSCRIPTEN__
-        getRenderThreadPool().start(fn);
-#else
-        fn();
-#endif
+shared_ptr<StaticMesh> SoftwareRenderer::createStaticMesh(const Mesh &m)
+{
+    return make_shared<SoftwareStaticMesh>(m);
+}
+
+void SoftwareRenderer::render(const StaticMesh &m, Transform tform)
+{
+    const SoftwareStaticMesh *softwareMesh = dynamic_cast<const SoftwareStaticMesh *>(&m);
+    if(softwareMesh == nullptr)
+    {
+        Renderer::render(m, tform);
+        return;
     }
-#ifndef __EMSCRIPTEN__
-    unique_lock<mutex> lockIt(threadsLeftLock);
-    while(threadsLeft > 0)
-        threadsLeftCond.wait(lockIt);
-#endif
+    if(softwareMesh->triangles.empty())
+        return;
+    Matrix matrix = tform.get();
+    VectorF center = matrix.apply(softwareMesh->center);
+    float scale = 0;
+    for(VectorF axis : {VectorF(1, 0, 0), VectorF(0, 1, 0), VectorF(0, 0, 1)})
+        scale = max(scale, abs(matrix.applyNoTranslate(axis)));
+    float radius = softwareMesh->radius * scale;
+    // the view is the pyramid with |x| <= -z * scaleX() and |y| <= -z * scaleY()
+    if(center.z >= radius)
+        return;
+    if(std::fabs(center.x) + center.z * scaleX() > radius * std::sqrt(1 + scaleX() * scaleX()))
+        return;
+    if(std::fabs(center.y) + center.z * scaleY() > radius * std::sqrt(1 + scaleY() * scaleY()))
+        return;
+    shared_ptr<const Image> texture = ((softwareMesh->image != nullptr) ? softwareMesh->image->getImage() : whiteTexture);
+    const vector<SoftwareStaticMesh::SetupTriangle> &triangles = softwareMesh->triangles;
+    transformPositions(transformedPositions, triangles.size() * 3, matrix, [&triangles](size_t index) -> VectorF
+    {
+        const SoftwareStaticMesh::SetupTriangle &tri = triangles[index / 3];
+        switch(index % 3)
+        {
+        case 0:
+            return tri.p1;
+        case 1:
+            return tri.p2;
+        default:
+            return tri.p3;
+        }
+    });
+    renderTriangles(StaticMeshTriangles(*softwareMesh, transformedPositions.data()), *texture);
 }
 
 shared_ptr<Texture> SoftwareRenderer::finish()
 {
+    textOverlay.draw(*image);
+    textOverlay.clear();
     return imageTexture;
 }
 
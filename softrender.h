@@ -49,10 +49,16 @@ private:
     vector<TriangleDescriptor> triangles;
     vector<float> zBuffer;
     vector<size_t> tBuffer;
+    vector<VectorF> transformedPositions;
     bool writeDepth = true;
     enum {NoTexture = ~(size_t)0};
     void renderTriangle(Triangle triangleIn, size_t sectionTop, size_t sectionBottom, shared_ptr<const Image> texture);
+    template <typename TriangleSource>
+    void renderSection(const TriangleSource &source, const Image &texture, size_t sectionTop, size_t sectionBottom);
+    template <typename TriangleSource>
+    void renderTriangles(const TriangleSource &source, const Image &texture);
     float aspectRatio;
+    TextOverlay textOverlay;
 public:
     SoftwareRenderer(size_t w, size_t h, float aspectRatio = -1)
         : image(make_shared<Image>(w, h)), whiteTexture(make_shared<Image>(RGBI(0xFF, 0xFF, 0xFF))), aspectRatio(aspectRatio)
@@ -61,7 +67,11 @@ public:
         tBuffer.assign(w * h, (const size_t &)NoTexture);
         imageTexture = make_shared<ImageTexture>(image);
     }
+    using Renderer::render;
     virtual void render(const Mesh & m) override;
+    virtual void render(const CompactMesh &m, Transform tform) override;
+    virtual shared_ptr<StaticMesh> createStaticMesh(const Mesh &m) override;
+    virtual void render(const StaticMesh &m, Transform tform) override;
     virtual void calcScales() override
     {
         Renderer::calcScales(image->w, image->h, aspectRatio);
@@ -70,6 +80,7 @@ protected:
     virtual void clearInternal(ColorF bg)
     {
         triangles.resize(0);
+        textOverlay.clear();
         image->clear((ColorI)bg);
         zBuffer.assign(image->w * image->h, (float)0);
         tBuffer.assign(image->w * image->h, NoTexture);
@@ -88,6 +99,10 @@ public:
         tBuffer.assign(newW * newH, (const size_t &)NoTexture);
         aspectRatio = newAspectRatio;
     }
+    virtual void renderText(int x, int y, const wstring &str, ColorF color = GrayscaleF(1)) override
+    {
+        textOverlay.add(x, y, str, color);
+    }
 };
 
 #endif // SOFTRENDER_H_INCLUDED
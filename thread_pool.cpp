@@ -0,0 +1,278 @@
+#include "thread_pool.h"
+#include <cassert>
+#include <algorithm>
+#include <exception>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+#ifndef __EMSCRIPTEN__
+namespace
+{
+thread_local bool isRenderThread = false;
+
+struct RenderThreadState final
+{
+    mutex lock;
+    condition_variable cond;
+    thread theThread;
+    enum class State
+    {
+        Stopped,
+        Waiting,
+        Starting,
+        Stopping,
+        Running
+    };
+    State state = State::Stopped;
+    function<void()> currentRunFunction = nullptr;
+    void run_fn()
+    {
+        isRenderThread = true;
+        unique_lock<mutex> lockIt(lock);
+        state = State::Waiting;
+        cond.notify_all();
+        while(state != State::Stopping)
+        {
+            while(state == State::Waiting)
+                cond.wait(lockIt);
+            if(state == State::Starting)
+            {
+                state = State::Running;
+                cond.notify_all();
+                currentRunFunction();
+                state = State::Waiting;
+                cond.notify_all();
+            }
+            else
+                break;
+        }
+        state = State::Stopped;
+        cond.notify_all();
+    }
+    void wait()
+    {
+        unique_lock<mutex> lockIt(lock);
+        while(state == State::Running || state == State::Starting || state == State::Stopping)
+            cond.wait(lockIt);
+    }
+    void stop()
+    {
+        {
+            unique_lock<mutex> lockIt(lock);
+            while(state == State::Running || state == State::Starting || state == State::Stopping)
+                cond.wait(lockIt);
+            if(state == State::Stopped)
+                return;
+            state = State::Stopping;
+            cond.notify_all();
+        }
+        theThread.join();
+    }
+    void start(function<void()> fn)
+    {
+        assert(fn != nullptr);
+        unique_lock<mutex> lockIt(lock);
+        while(state == State::Running || state == State::Starting || state == State::Stopping)
+            cond.wait(lockIt);
+        if(state == State::Stopped)
+        {
+            theThread = thread([this](){run_fn();});
+            while(state == State::Stopped)
+                cond.wait(lockIt);
+        }
+        assert(state == State::Waiting);
+        state = State::Starting;
+        currentRunFunction = fn;
+        cond.notify_all();
+    }
+    bool tryStart(function<void()> fn)
+    {
+        assert(fn != nullptr);
+        unique_lock<mutex> lockIt(lock);
+        if(state == State::Running || state == State::Starting)
+            return false;
+        while(state == State::Stopping)
+            cond.wait(lockIt);
+        if(state == State::Stopped)
+        {
+            theThread = thread([this](){run_fn();});
+            while(state == State::Stopped)
+                cond.wait(lockIt);
+        }
+        assert(state == State::Waiting);
+        state = State::Starting;
+        currentRunFunction = fn;
+        cond.notify_all();
+        return true;
+    }
+    bool available()
+    {
+        unique_lock<mutex> lockIt(lock);
+        switch(state)
+        {
+        case State::Running:
+        case State::Starting:
+            return false;
+        case State::Stopped:
+        case State::Waiting:
+        case State::Stopping:
+            return true;
+        }
+        assert(false);
+        return false;
+    }
+    bool stopped()
+    {
+        unique_lock<mutex> lockIt(lock);
+        switch(state)
+        {
+        case State::Running:
+        case State::Starting:
+        case State::Waiting:
+            return false;
+        case State::Stopped:
+        case State::Stopping:
+            return true;
+        }
+        assert(false);
+        return true;
+    }
+};
+struct RenderThreadPool final
+{
+    vector<unique_ptr<RenderThreadState>> threads;
+    RenderThreadPool()
+    {
+        size_t threadCount = thread::hardware_concurrency();
+        if(threadCount == 0)
+            threadCount = 1;
+        threads.reserve(threadCount);
+        for(size_t i = 0; i < threadCount; i++)
+            threads.push_back(unique_ptr<RenderThreadState>(new RenderThreadState()));
+    }
+    ~RenderThreadPool()
+    {
+        for(unique_ptr<RenderThreadState> &t : threads)
+        {
+            t->stop();
+        }
+    }
+    /// start() can be called from several threads at once, it's only used modulo the thread count so wrapping around is fine
+    atomic_size_t nextThreadIndex{0};
+    void start(function<void()> fn)
+    {
+        for(size_t i = 0; i < threads.size(); i++)
+        {
+            size_t index = nextThreadIndex.fetch_add(1, memory_order_relaxed) % threads.size();
+            if(threads[index]->tryStart(fn))
+                return;
+        }
+        size_t index = nextThreadIndex.fetch_add(1, memory_order_relaxed) % threads.size();
+        threads[index]->start(fn);
+        return;
+    }
+};
+RenderThreadPool &getRenderThreadPool()
+{
+    static RenderThreadPool retval;
+    return retval;
+}
+}
+#endif
+
+size_t getRenderThreadCount()
+{
+#if !defined(__EMSCRIPTEN__) && !defined(DEBUG)
+    size_t threadCount = thread::hardware_concurrency();
+    if(threadCount == 0)
+        threadCount = 1;
+    return threadCount;
+#else
+    return 1;
+#endif
+}
+
+void startRenderThread(function<void()> fn)
+{
+#ifndef __EMSCRIPTEN__
+    getRenderThreadPool().start(fn);
+#else
+    fn();
+#endif
+}
+
+void parallelForHelper(size_t count, size_t grainSize, const function<void(size_t start, size_t end)> &fn)
+{
+    if(grainSize == 0)
+        grainSize = 1;
+#ifndef __EMSCRIPTEN__
+    size_t chunkCount = (count + grainSize - 1) / grainSize;
+    size_t threadCount = getRenderThreadCount();
+    if(chunkCount > 1 && threadCount > 1 && !isRenderThread)
+    {
+        struct ParallelForJob
+        {
+            const function<void(size_t start, size_t end)> *fn;
+            size_t count, grainSize, chunkCount;
+            atomic_size_t nextChunk;
+            size_t workersLeft;
+            mutex lock;
+            condition_variable cond;
+            exception_ptr error;
+            void runChunks()
+            {
+                try
+                {
+                    for(size_t chunk = nextChunk++; chunk < chunkCount; chunk = nextChunk++)
+                    {
+                        size_t start = chunk * grainSize;
+                        (*fn)(start, min(count, start + grainSize));
+                    }
+                }
+                catch(...)
+                {
+                    unique_lock<mutex> lockIt(lock);
+                    if(!error)
+                        error = current_exception();
+                    nextChunk = chunkCount;
+                }
+            }
+        };
+        ParallelForJob job;
+        job.fn = &fn;
+        job.count = count;
+        job.grainSize = grainSize;
+        job.chunkCount = chunkCount;
+        job.nextChunk = 0;
+        job.workersLeft = min(threadCount, chunkCount) - 1;
+        ParallelForJob *pJob = &job;
+        for(size_t i = job.workersLeft; i > 0; i--)
+        {
+            startRenderThread([pJob]()
+            {
+                pJob->runChunks();
+                unique_lock<mutex> lockIt(pJob->lock);
+                pJob->workersLeft--;
+                pJob->cond.notify_all();
+            });
+        }
+        job.runChunks();
+        unique_lock<mutex> lockIt(job.lock);
+        while(job.workersLeft > 0)
+            job.cond.wait(lockIt);
+        if(job.error)
+            rethrow_exception(job.error);
+        return;
+    }
+#endif
+    for(size_t start = 0; start < count; start += grainSize)
+        fn(start, min(count, start + grainSize));
+}
@@ -0,0 +1,42 @@
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <functional>
+#include <cstddef>
+
+using namespace std;
+
+/// the number of threads work is split across
+size_t getRenderThreadCount();
+
+/// runs fn on one of the render threads, waiting for one to be free if needed
+void startRenderThread(function<void()> fn);
+
+void parallelForHelper(size_t count, size_t grainSize, const function<void(size_t start, size_t end)> &fn);
+
+/** calls fn(start, end) for consecutive ranges covering [0, count)
+ *
+ * The ranges are [k * grainSize, (k + 1) * grainSize) clipped to count, no
+ * matter how many threads there are, so partial results kept per range give
+ * the same output everywhere. They are spread across the render threads
+ * unless there are no threads or this is called from a render thread, in
+ * which case they are run in order on the calling thread. Returns after
+ * every range is done and rethrows the first exception thrown by fn.
+ */
+template <typename Fn>
+inline void parallelFor(size_t count, size_t grainSize, const Fn &fn)
+{
+    if(count == 0)
+        return;
+    if(count <= grainSize)
+    {
+        fn((size_t)0, count);
+        return;
+    }
+    parallelForHelper(count, grainSize, [&fn](size_t start, size_t end)
+    {
+        fn(start, end);
+    });
+}
+
+#endif // THREAD_POOL_H_INCLUDED
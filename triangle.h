@@ -171,11 +171,16 @@ struct Triangle
     }
 };
 
+inline Triangle transform(const Matrix & m, const NormalTransform & normalTransform, const Triangle & t)
+{
+    return Triangle(m.apply(t.p1), t.t1, t.c1, transformNormal(normalTransform, t.n1),
+                     m.apply(t.p2), t.t2, t.c2, transformNormal(normalTransform, t.n2),
+                     m.apply(t.p3), t.t3, t.c3, transformNormal(normalTransform, t.n3));
+}
+
 inline Triangle transform(const Transform & m, const Triangle & t)
 {
-    return Triangle(transform(m, t.p1), t.t1, t.c1, transformNormal(m, t.n1),
-                     transform(m, t.p2), t.t2, t.c2, transformNormal(m, t.n2),
-                     transform(m, t.p3), t.t3, t.c3, transformNormal(m, t.n3));
+    return transform(m.get(), NormalTransform(m), t);
 }
 
 inline Vertex transform(Transform tform, Vertex v)
@@ -0,0 +1,349 @@
+#ifndef WELD_H_INCLUDED
+#define WELD_H_INCLUDED
+
+#include "mesh.h"
+#include "thread_pool.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+using namespace std;
+
+/// how far apart vertices can be and still be welded, for each attribute
+struct WeldTolerance
+{
+    float position, textureCoord, color, normal;
+    explicit WeldTolerance(float position = 0, float textureCoord = 0, float color = 0, float normal = 0)
+        : position(position), textureCoord(textureCoord), color(color), normal(normal)
+    {
+    }
+    bool matches(const Vertex &a, const Vertex &b) const
+    {
+        return absSquared(a.p - b.p) <= position * position
+            && absSquared(a.n - b.n) <= normal * normal
+            && std::fabs(a.t.u - b.t.u) <= textureCoord
+            && std::fabs(a.t.v - b.t.v) <= textureCoord
+            && std::fabs(a.c.r - b.c.r) <= color
+            && std::fabs(a.c.g - b.c.g) <= color
+            && std::fabs(a.c.b - b.c.b) <= color
+            && std::fabs(a.c.a - b.c.a) <= color;
+    }
+};
+
+namespace weld_internal
+{
+inline uint32_t hashCell(const int64_t (&cell)[3])
+{
+    uint64_t retval = 14695981039346656037ULL;
+    for(int64_t v : cell)
+    {
+        retval ^= (uint32_t)v;
+        retval *= 1099511628211ULL;
+        retval ^= (uint32_t)((uint64_t)v >> 32);
+        retval *= 1099511628211ULL;
+        retval ^= retval >> 29;
+    }
+    return (uint32_t)(retval >> 32);
+}
+
+/// 64 bits so far away coordinates still get cells of their own, the limit is only reached past about 1e13 units
+inline int64_t getCell(float v, float inverseCellSize)
+{
+    return (int64_t)limit<double>(std::floor((double)v * inverseCellSize), -0x4000000000000000LL, 0x4000000000000000LL);
+}
+
+/// when the position tolerance is 0 the cells are single points
+inline void getCell(VectorF p, float inverseCellSize, int64_t (&cell)[3])
+{
+    const float values[] = {p.x, p.y, p.z};
+    for(size_t i = 0; i < 3; i++)
+    {
+        if(inverseCellSize == 0)
+        {
+            float value = values[i] + 0.0f; // so -0 and 0 are in the same cell
+            int32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            cell[i] = bits;
+        }
+        else
+            cell[i] = getCell(values[i], inverseCellSize);
+    }
+}
+
+/// kept between calls so weldVertices() stops allocating once these have grown to fit
+struct Scratch
+{
+    /// cell hash in the high half, corner index in the low half
+    vector<uint64_t> sortedCorners;
+    vector<uint32_t> bucketStarts;
+    /// open addressed from the cell hash to the bucket, as the hash in the high half and the bucket in the low half
+    vector<uint64_t> bucketTable;
+    vector<uint32_t> parents;
+    /// the matches between neighboring cells found for each batch of buckets
+    vector<vector<pair<uint32_t, uint32_t>>> links;
+};
+}
+
+/** merges vertices that are within tolerance of each other
+ *
+ * Vertices are sorted into a grid of cells four times as big as the position
+ * tolerance, then vertices are merged inside each cell and with the
+ * neighboring cells, a cell at a time across the render threads. Chains of
+ * vertices each within tolerance of the next get merged together, so on
+ * dense meshes the tolerance should be well under the edge length.
+ * cornerVertices gets the index of each corner's vertex and the vertices are
+ * returned in order of first use, each with the value of its first corner.
+ */
+inline vector<Vertex> weldVertices(const vector<Vertex> &corners, WeldTolerance tolerance, vector<uint32_t> &cornerVertices)
+{
+    using namespace weld_internal;
+    static thread_local Scratch scratch;
+    assert(corners.size() < 0xFFFFFFFFU);
+    vector<uint64_t> &sortedCorners = scratch.sortedCorners;
+    vector<uint32_t> &bucketStarts = scratch.bucketStarts;
+    vector<uint64_t> &bucketTable = scratch.bucketTable;
+    vector<uint32_t> &parents = scratch.parents;
+    vector<vector<pair<uint32_t, uint32_t>>> &links = scratch.links;
+    // cells four times the tolerance across, so the vertices in reach are usually in 1 cell along each axis and never more than 2
+    float inverseCellSize = tolerance.position > 0 ? 0.25f / tolerance.position : 0;
+    size_t count = corners.size();
+    sortedCorners.resize(count);
+    parallelFor(count, 4096, [&](size_t start, size_t end)
+    {
+        for(size_t i = start; i < end; i++)
+        {
+            int64_t cell[3];
+            getCell(corners[i].p, inverseCellSize, cell);
+            sortedCorners[i] = (uint64_t)hashCell(cell) << 32 | i;
+        }
+    });
+    std::sort(sortedCorners.begin(), sortedCorners.end());
+    bucketStarts.clear();
+    for(size_t i = 0; i < count; i++)
+        if(i == 0 || sortedCorners[i] >> 32 != sortedCorners[i - 1] >> 32)
+            bucketStarts.push_back((uint32_t)i);
+    bucketStarts.push_back((uint32_t)count);
+    size_t bucketCount = bucketStarts.size() - 1;
+    size_t tableMask = 1;
+    while(tableMask < 2 * bucketCount)
+        tableMask = tableMask * 2 + 1;
+    const uint64_t EmptySlot = ~(uint64_t)0;
+    bucketTable.assign(tableMask + 1, EmptySlot);
+    for(size_t bucket = 0; bucket < bucketCount; bucket++)
+    {
+        uint64_t hash = sortedCorners[bucketStarts[bucket]] >> 32;
+        size_t slot = (size_t)hash & tableMask;
+        while(bucketTable[slot] != EmptySlot)
+            slot = (slot + 1) & tableMask;
+        bucketTable[slot] = hash << 32 | bucket;
+    }
+    auto findBucket = [&](uint32_t hash)->size_t
+    {
+        for(size_t slot = hash & tableMask; bucketTable[slot] != EmptySlot; slot = (slot + 1) & tableMask)
+        {
+            if(bucketTable[slot] >> 32 == hash)
+                return (uint32_t)bucketTable[slot];
+        }
+        return bucketCount;
+    };
+
+    // parents form a union find forest where every group's root is its first corner, so each link points to an earlier corner
+    parents.resize(count);
+    auto findRoot = [&](uint32_t corner)->uint32_t
+    {
+        while(parents[corner] != corner)
+        {
+            parents[corner] = parents[parents[corner]];
+            corner = parents[corner];
+        }
+        return corner;
+    };
+    auto join = [&](uint32_t a, uint32_t b)
+    {
+        a = findRoot(a);
+        b = findRoot(b);
+        if(a < b)
+            parents[b] = a;
+        else if(b < a)
+            parents[a] = b;
+    };
+
+    // first every corner is compared with the corners before it in its own bucket, which only touches that bucket's parents
+    parallelFor(bucketCount, 64, [&](size_t start, size_t end)
+    {
+        for(size_t bucket = start; bucket < end; bucket++)
+        {
+            for(size_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++)
+            {
+                uint32_t corner = (uint32_t)sortedCorners[i];
+                parents[corner] = corner;
+                for(size_t j = bucketStarts[bucket]; j < i; j++)
+                {
+                    uint32_t earlierCorner = (uint32_t)sortedCorners[j];
+                    if(findRoot(earlierCorner) != findRoot(corner) && tolerance.matches(corners[earlierCorner], corners[corner]))
+                        join(earlierCorner, corner);
+                }
+            }
+            // the roots come first, so this leaves every corner pointing straight at its root
+            for(size_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++)
+            {
+                uint32_t corner = (uint32_t)sortedCorners[i];
+                parents[corner] = parents[parents[corner]];
+            }
+        }
+    });
+
+    // then every corner is compared with the earlier corners in the neighboring cells. the parents are only read here, where
+    // they all point straight at their roots, so the matches are collected for a batch of buckets at a time and joined afterwards
+    if(inverseCellSize != 0)
+    {
+        constexpr size_t bucketsPerBatch = 64;
+        size_t batchCount = (bucketCount + bucketsPerBatch - 1) / bucketsPerBatch;
+        if(links.size() < batchCount)
+            links.resize(batchCount);
+        parallelFor(batchCount, 1, [&](size_t startBatch, size_t endBatch)
+        {
+            for(size_t batch = startBatch; batch < endBatch; batch++)
+            {
+                vector<pair<uint32_t, uint32_t>> &batchLinks = links[batch];
+                batchLinks.clear();
+                size_t endBucket = std::min(bucketCount, (batch + 1) * bucketsPerBatch);
+                for(size_t bucket = batch * bucketsPerBatch; bucket < endBucket; bucket++)
+                {
+                    for(size_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++)
+                    {
+                        uint32_t corner = (uint32_t)sortedCorners[i];
+                        uint32_t root = parents[corner];
+                        VectorF p = corners[corner].p;
+                        int64_t minCell[3], maxCell[3];
+                        getCell(p - VectorF(tolerance.position), inverseCellSize, minCell);
+                        getCell(p + VectorF(tolerance.position), inverseCellSize, maxCell);
+                        for(int64_t x = minCell[0]; x <= maxCell[0]; x++)
+                        {
+                            for(int64_t y = minCell[1]; y <= maxCell[1]; y++)
+                            {
+                                for(int64_t z = minCell[2]; z <= maxCell[2]; z++)
+                                {
+                                    int64_t neighbor[3] = {x, y, z};
+                                    size_t neighborBucket = findBucket(hashCell(neighbor));
+                                    if(neighborBucket == bucketCount || neighborBucket == bucket)
+                                        continue;
+                                    // each pair is only looked at from its later corner
+                                    for(size_t j = bucketStarts[neighborBucket]; j < bucketStarts[neighborBucket + 1]; j++)
+                                    {
+                                        uint32_t otherCorner = (uint32_t)sortedCorners[j];
+                                        if(otherCorner >= corner)
+                                            break;
+                                        uint32_t otherRoot = parents[otherCorner];
+                                        if(otherRoot == root || (!batchLinks.empty() && batchLinks.back() == make_pair(root, otherRoot)))
+                                            continue;
+                                        if(tolerance.matches(corners[otherCorner], corners[corner]))
+                                            batchLinks.push_back(make_pair(root, otherRoot));
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        });
+        for(size_t batch = 0; batch < batchCount; batch++)
+            for(const pair<uint32_t, uint32_t> &link : links[batch])
+                join(link.first, link.second);
+    }
+
+    // every link points to an earlier corner, so one pass in order finds the first corner of every group
+    vector<Vertex> vertices;
+    cornerVertices.resize(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        uint32_t root = findRoot((uint32_t)i);
+        if(root == i)
+        {
+            cornerVertices[i] = (uint32_t)vertices.size();
+            vertices.push_back(corners[i]);
+        }
+        else
+            cornerVertices[i] = cornerVertices[root];
+    }
+    return vertices;
+}
+
+/** a mesh as shared vertices and three vertex indices per triangle
+ *
+ * Building one welds the vertices and drops the triangles that become
+ * degenerate, so converting back gives a mesh without cracks from
+ * vertices that were almost, but not exactly, equal.
+ */
+struct IndexedMesh
+{
+    vector<Vertex> vertices;
+    vector<uint32_t> indices;
+    shared_ptr<Texture> image;
+    IndexedMesh()
+    {
+    }
+    explicit IndexedMesh(const vector<Triangle> &triangles, WeldTolerance tolerance = WeldTolerance(), shared_ptr<Texture> image = nullptr)
+        : image(image)
+    {
+        vector<Vertex> corners;
+        corners.reserve(triangles.size() * 3);
+        for(const Triangle &tri : triangles)
+        {
+            corners.push_back(tri.v1());
+            corners.push_back(tri.v2());
+            corners.push_back(tri.v3());
+        }
+        vector<uint32_t> cornerVertices;
+        vertices = weldVertices(corners, tolerance, cornerVertices);
+        indices.reserve(cornerVertices.size());
+        for(size_t i = 0; i < cornerVertices.size(); i += 3)
+        {
+            uint32_t v1 = cornerVertices[i], v2 = cornerVertices[i + 1], v3 = cornerVertices[i + 2];
+            if(v1 == v2 || v2 == v3 || v3 == v1)
+                continue;
+            indices.push_back(v1);
+            indices.push_back(v2);
+            indices.push_back(v3);
+        }
+    }
+    explicit IndexedMesh(const Mesh &mesh, WeldTolerance tolerance = WeldTolerance())
+        : IndexedMesh(mesh.triangles, tolerance, mesh.image)
+    {
+    }
+    size_t triangleCount() const
+    {
+        return indices.size() / 3;
+    }
+    Triangle triangle(size_t index) const
+    {
+        return Triangle(vertices[indices[index * 3]], vertices[indices[index * 3 + 1]], vertices[indices[index * 3 + 2]]);
+    }
+    Mesh unpack() const
+    {
+        Mesh retval(vector<Triangle>(triangleCount()), image);
+        Triangle *destTriangles = retval.triangles.data();
+        parallelFor(triangleCount(), parallelMeshGrainSize, [this, destTriangles](size_t start, size_t end)
+        {
+            for(size_t i = start; i < end; i++)
+                destTriangles[i] = triangle(i);
+        });
+        return retval;
+    }
+};
+
+/// snaps vertices within tolerance of each other together, dropping the triangles that become degenerate
+inline vector<Triangle> weld(const vector<Triangle> &triangles, WeldTolerance tolerance)
+{
+    return IndexedMesh(triangles, tolerance).unpack().triangles;
+}
+
+inline Mesh weld(const Mesh &mesh, WeldTolerance tolerance)
+{
+    return IndexedMesh(mesh, tolerance).unpack();
+}
+
+#endif // WELD_H_INCLUDED